@@ -0,0 +1,279 @@
+#include "Benchmarks.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <vector>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include "CalibrationSettings.h"
+#include "CameraDetector.h"
+#include "CameraCalibratationUtils.h"
+#include "CornerUndistorter.h"
+#include "PoseBatch.h"
+
+namespace CameraMarkerServer {
+namespace {
+const int BENCHMARK_MARKERS = 2000;
+const float BENCHMARK_MARKER_LENGTH = 76.2f;
+const int BENCHMARK_BATCH_MARKERS = 64;
+const int BENCHMARK_BATCH_ROUNDS = 20000;
+const int BENCHMARK_CALIBRATION_RUNS = 10;
+
+double ElapsedMicroseconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+std::optional<CameraParameters> LoadCameraParameters(
+    const std::string& calibration_file) {
+  CalibrationSettings settings;
+  settings.outputFileName = calibration_file;
+  std::optional<CameraParameters> params =
+      GetCameraParametersFromFile(settings);
+  if (!params.has_value() || params->insintric_camera_parms.empty()) {
+    std::cout << "Could not read camera parameters from \""
+              << calibration_file << "\"" << std::endl;
+    return std::nullopt;
+  }
+  return params;
+}
+
+// Reads the board corners and solver settings a calibration was written
+// with. The pattern is not stored, it is told apart by the corner count.
+bool LoadCalibrationInput(const std::string& calibration_file,
+                          CalibrationSettings& s, cv::Size& image_size,
+                          std::vector<std::vector<cv::Point2f>>& image_points) {
+  cv::FileStorage fs(calibration_file, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    std::cout << "Could not open \"" << calibration_file << "\"" << std::endl;
+    return false;
+  }
+  cv::Mat points;
+  fs["image_points"] >> points;
+  fs["image_width"] >> image_size.width;
+  fs["image_height"] >> image_size.height;
+  fs["board_width"] >> s.boardSize.width;
+  fs["board_height"] >> s.boardSize.height;
+  fs["square_size"] >> s.calibrationSquareSize;
+  fs["flags"] >> s.flag;
+  fs["fisheye_model"] >> s.useFisheye;
+  s.aspectRatio = 1;
+  if (!fs["fix_aspect_ratio"].empty()) fs["fix_aspect_ratio"] >> s.aspectRatio;
+  if (points.empty() || points.type() != CV_32FC2 || image_size.area() == 0) {
+    std::cout << "\"" << calibration_file
+              << "\" has no image points, calibrate with "
+                 "Write_DetectedFeaturePoints set"
+              << std::endl;
+    return false;
+  }
+  if (points.cols == s.boardSize.area()) {
+    s.calibrationPattern = CalibrationSettings::CHESSBOARD;
+  } else if (points.cols ==
+             (s.boardSize.width - 1) * (s.boardSize.height - 1)) {
+    s.calibrationPattern = CalibrationSettings::CHARUCOBOARD;
+  } else {
+    std::cout << "Image points do not match the board size" << std::endl;
+    return false;
+  }
+  image_points.resize(points.rows);
+  for (int i = 0; i < points.rows; i++) {
+    const cv::Point2f* row = points.ptr<cv::Point2f>(i);
+    image_points[i].assign(row, row + points.cols);
+  }
+  return true;
+}
+
+std::vector<cv::Point3f> MarkerObjectPoints(float marker_length) {
+  return {cv::Point3f(-marker_length / 2.f, marker_length / 2.f, 0),
+          cv::Point3f(marker_length / 2.f, marker_length / 2.f, 0),
+          cv::Point3f(marker_length / 2.f, -marker_length / 2.f, 0),
+          cv::Point3f(-marker_length / 2.f, -marker_length / 2.f, 0)};
+}
+}  // namespace
+
+int RunUndistortionBenchmark(const std::string& calibration_file) {
+  std::optional<CameraParameters> params =
+      LoadCameraParameters(calibration_file);
+  if (!params.has_value()) {
+    return 1;
+  }
+  if (params->image_size.area() == 0) {
+    std::cout << "Calibration file has no image size" << std::endl;
+    return 1;
+  }
+  const cv::Matx33d camera_matrix = params->insintric_camera_parms;
+  const std::vector<cv::Point3f> obj_points =
+      MarkerObjectPoints(BENCHMARK_MARKER_LENGTH);
+
+  // Random marker poses whose projections land inside the frame
+  cv::RNG rng(42);
+  std::vector<std::vector<cv::Point2f>> corners;
+  std::vector<cv::Vec3d> true_translations;
+  std::vector<cv::Point2f> projected;
+  while ((int)corners.size() < BENCHMARK_MARKERS) {
+    cv::Vec3d rvec(rng.uniform(-0.6, 0.6), rng.uniform(-0.6, 0.6),
+                   rng.uniform(-3.1, 3.1));
+    double z = rng.uniform(300.0, 3000.0);
+    cv::Vec3d tvec(rng.uniform(-0.5, 0.5) * z, rng.uniform(-0.4, 0.4) * z, z);
+    if (params->fisheye) {
+      cv::fisheye::projectPoints(obj_points, projected, rvec, tvec,
+                                 params->insintric_camera_parms,
+                                 params->distortion_mat);
+    } else {
+      cv::projectPoints(obj_points, rvec, tvec, params->insintric_camera_parms,
+                        params->distortion_mat, projected);
+    }
+    const cv::Rect2f frame(0, 0, (float)params->image_size.width - 1,
+                           (float)params->image_size.height - 1);
+    bool inside = true;
+    for (const cv::Point2f& corner : projected) {
+      inside = inside && frame.contains(corner);
+    }
+    if (inside) {
+      corners.push_back(projected);
+      true_translations.push_back(tvec);
+    }
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  CornerUndistorter undistorter(params.value(), params->image_size);
+  const double table_build_us = ElapsedMicroseconds(start);
+
+  cv::Vec3d rvec;
+  cv::Vec3d tvec;
+  double direct_error = 0;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < corners.size(); i++) {
+    cv::solvePnP(obj_points, corners[i], params->insintric_camera_parms,
+                 params->distortion_mat, rvec, tvec);
+    direct_error += cv::norm(tvec - true_translations[i]);
+  }
+  const double direct_us = ElapsedMicroseconds(start) / corners.size();
+
+  double table_error = 0;
+  std::vector<cv::Point2f> normalized;
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < corners.size(); i++) {
+    undistorter.Undistort(corners[i], normalized);
+    cv::solvePnP(obj_points, normalized, cv::Matx33d::eye(), cv::noArray(),
+                 rvec, tvec);
+    table_error += cv::norm(tvec - true_translations[i]);
+  }
+  const double table_us = ElapsedMicroseconds(start) / corners.size();
+
+  std::cout << "Undistortion benchmark, " << corners.size() << " markers, "
+            << (params->fisheye ? "fisheye" : "pinhole") << " model, "
+            << params->image_size << " frame" << std::endl;
+  std::cout << "  lookup table build: " << table_build_us / 1000 << " ms"
+            << std::endl;
+  std::cout << "  solvePnP with distortion: " << direct_us
+            << " us/marker, mean translation error "
+            << direct_error / corners.size() << std::endl;
+  std::cout << "  lookup table + solvePnP:  " << table_us
+            << " us/marker, mean translation error "
+            << table_error / corners.size() << std::endl;
+  return 0;
+}
+
+int RunPoseBatchBenchmark() {
+  cv::RNG rng(42);
+  std::vector<MarkerObservation> observations(BENCHMARK_BATCH_MARKERS);
+  for (int i = 0; i < BENCHMARK_BATCH_MARKERS; i++) {
+    observations[i].id = i;
+    observations[i].rvec = cv::Vec3d(
+        rng.uniform(-3.1, 3.1), rng.uniform(-3.1, 3.1), rng.uniform(-3.1, 3.1));
+    observations[i].tvec = cv::Vec3d(
+        rng.uniform(-1000.0, 1000.0), rng.uniform(-1000.0, 1000.0),
+        rng.uniform(100.0, 5000.0));
+  }
+
+  // Sums keep the compiler from dropping the conversions
+  double rodrigues_sum = 0;
+  cv::Matx33d rotation;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCHMARK_BATCH_ROUNDS; round++) {
+    for (const MarkerObservation& observation : observations) {
+      cv::Rodrigues(observation.rvec, rotation);
+      rodrigues_sum += rotation(0, 1) + rotation(0, 2);
+    }
+  }
+  const double rodrigues_ns = ElapsedMicroseconds(start) * 1000 /
+                              BENCHMARK_BATCH_ROUNDS / BENCHMARK_BATCH_MARKERS;
+
+  PoseBatch batch;
+  double batch_sum = 0;
+  start = std::chrono::steady_clock::now();
+  for (int round = 0; round < BENCHMARK_BATCH_ROUNDS; round++) {
+    batch.SetFromObservations(observations);
+    batch_sum += batch.qw[round % BENCHMARK_BATCH_MARKERS];
+  }
+  const double batch_ns = ElapsedMicroseconds(start) * 1000 /
+                          BENCHMARK_BATCH_ROUNDS / BENCHMARK_BATCH_MARKERS;
+  double max_difference = 0;
+  for (int i = 0; i < BENCHMARK_BATCH_MARKERS; i++) {
+    cv::Rodrigues(observations[i].rvec, rotation);
+    const Pose pose = batch.ExpandPose(i);
+    const cv::Vec3d up(rotation(0, 1), rotation(1, 1), rotation(2, 1));
+    const cv::Vec3d forward(rotation(0, 2), rotation(1, 2), rotation(2, 2));
+    max_difference = std::max(max_difference, cv::norm(up - pose.up));
+    max_difference = std::max(max_difference, cv::norm(forward - pose.forward));
+  }
+
+  std::cout << "Pose batch benchmark, " << BENCHMARK_BATCH_MARKERS
+            << " markers per frame (checksums " << rodrigues_sum << ", "
+            << batch_sum << ")" << std::endl;
+  std::cout << "  cv::Rodrigues per marker: " << rodrigues_ns << " ns/marker"
+            << std::endl;
+  std::cout << "  PoseBatch quaternions:    " << batch_ns
+            << " ns/marker, max axis difference " << max_difference
+            << std::endl;
+  return 0;
+}
+
+int RunCalibrationBenchmark(const std::string& calibration_file) {
+  CalibrationSettings s;
+  cv::Size image_size;
+  std::vector<std::vector<cv::Point2f>> image_points;
+  if (!LoadCalibrationInput(calibration_file, s, image_size, image_points)) {
+    return 1;
+  }
+  std::cout << "Calibration benchmark, " << image_points.size() << " views of "
+            << image_points.front().size() << " corners, "
+            << (s.useFisheye ? "fisheye" : "pinhole") << " model, "
+            << BENCHMARK_CALIBRATION_RUNS << " runs" << std::endl;
+
+  // The solve itself is serial, the reprojection errors use OpenCV's pool
+  const int default_threads = cv::getNumThreads();
+  for (int threads : {1, default_threads}) {
+    cv::setNumThreads(threads);
+    double average_error = 0;
+    double total_us = 0;
+    double best_us = std::numeric_limits<double>::max();
+    for (int run = 0; run < BENCHMARK_CALIBRATION_RUNS; run++) {
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      std::optional<CameraParameters> params =
+          SolveCalibration(s, image_size, image_points, average_error);
+      const double elapsed_us = ElapsedMicroseconds(start);
+      if (!params.has_value()) {
+        std::cout << "Calibration failed" << std::endl;
+        cv::setNumThreads(default_threads);
+        return 1;
+      }
+      total_us += elapsed_us;
+      best_us = std::min(best_us, elapsed_us);
+    }
+    std::cout << "  " << threads << " thread(s): mean "
+              << total_us / BENCHMARK_CALIBRATION_RUNS / 1000 << " ms, best "
+              << best_us / 1000 << " ms, reprojection error "
+              << average_error << std::endl;
+  }
+  cv::setNumThreads(default_threads);
+  return 0;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,25 @@
+#ifndef BENCHMARKS_H_
+#define BENCHMARKS_H_
+#include <string>
+
+// Benchmarks run from the command line instead of the server, see Main.cpp.
+// Each returns the process exit code.
+namespace CameraMarkerServer {
+
+// Compares solving marker poses with per solve distortion inversion
+// against the precomputed CornerUndistorter table, on synthetic corners
+// projected through the calibration in calibration_file.
+int RunUndistortionBenchmark(const std::string& calibration_file);
+
+// Compares converting rotation vectors one cv::Rodrigues call at a time
+// against PoseBatch's batched quaternion conversion, and checks the axes
+// expanded from the batch against the rotation matrices.
+int RunPoseBatchBenchmark();
+
+// Times the full calibration solve on the board corners stored in
+// calibration_file (written with Write_DetectedFeaturePoints), once on one
+// thread and once on OpenCV's default thread count.
+int RunCalibrationBenchmark(const std::string& calibration_file);
+
+}  // namespace CameraMarkerServer
+#endif  // BENCHMARKS_H_
@@ -1,4 +1,5 @@
 #include "CalibrationSettings.h"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -14,6 +15,10 @@
 #include <opencv2/videoio.hpp>
 #include <opencv2/highgui.hpp>
 #include "opencv2/objdetect/charuco_detector.hpp"
+#include "CameraDetector.h"
+#include "PoseOutput.h"
+#include "RawFrameRecording.h"
+#include "ThreadUtils.h"
 
 
 namespace CameraMarkerServer {
@@ -23,7 +28,9 @@ void CalibrationSettings::write(cv::FileStorage& fs) const  // Write serializati
      << "BoardSize_Width" << boardSize.width << "BoardSize_Height"
      << boardSize.height << "Calibration_Square_Size" << calibrationSquareSize
      << "Calibration_Marker_Size" << calibrationMarkerSize << "Pose_Marker_Size"
-     << poseMarkerSize << "Window_Size" << windowSize
+     << poseMarkerSize << "Detect_TilesX" << detectTilesX << "Detect_TilesY"
+     << detectTilesY << "Detect_TileOverlap" << detectTileOverlap
+     << "Window_Size" << windowSize
      << "Calibrate_Pattern" << patternToUse << "ArUco_Dict_Name"
      << arucoDictName << "ArUco_Dict_File_Name" << arucoDictFileName
      << "Calibrate_NrOfFrameToUse" << nrFrames << "Calibrate_FixAspectRatio"
@@ -37,12 +44,86 @@ void CalibrationSettings::write(cv::FileStorage& fs) const  // Write serializati
      << "Show_UndistortedImage" << showUndistorted
 
      << "Input_FlipAroundHorizontalAxis" << flipVertical << "Input_Delay"
-     << delay << "Input" << input << "}";
+     << delay << "Target_FrameRate" << targetFrameRate << "Show_Preview"
+     << showPreview << "Roi_FullFrameInterval" << roiFullFrameInterval
+     << "Governor_Enabled" << governorEnabled << "Governor_TargetMs"
+     << governorTargetMs << "Governor_StepDownFrames" << governorStepDownFrames
+     << "Governor_StepUpFrames" << governorStepUpFrames << "Governor_Headroom"
+     << governorHeadroom
+     << "Input" << input << "Input_ReplayMode" << replayMode
+     << "Capture_Width" << captureWidth << "Capture_Height" << captureHeight
+     << "Capture_FPS" << captureFps << "Capture_FourCC" << captureFourcc
+     << "Capture_BufferSize" << captureBufferSize
+     << "Capture_Grayscale" << captureGrayscale
+     << "Record_OutputFileName" << recordFileName << "Camera_Name"
+     << cameraName << "Camera_To_World" << cv::Mat(cameraToWorld)
+     << "Merge_MaxAgeMs" << mergeMaxAgeMs << "Filter_Enabled" << filterEnabled
+     << "Filter_MinCutoffHz" << filterMinCutoffHz << "Filter_TranslationBeta"
+     << filterTranslationBeta << "Filter_RotationBeta" << filterRotationBeta
+     << "Filter_DerivativeCutoffHz" << filterDerivativeCutoffHz
+     << "Filter_PredictionMs" << filterPredictionMs
+     << "Filter_MaxExtrapolationMs" << filterMaxExtrapolationMs
+     << "Thread_CaptureCpus" << threadCaptureCpus << "Thread_DetectCpus"
+     << threadDetectCpus << "Thread_SendCpus" << threadSendCpus
+     << "Thread_RealTime" << threadRealtime << "Detector_ParamsFile"
+     << detectorParamsFile << "Watchdog_StallMs"
+     << watchdogStallMs << "Watchdog_ReopenIntervalMs"
+     << watchdogReopenIntervalMs << "Fault_Mode" << faultMode
+     << "Fault_StallAfterFrames" << faultStallAfterFrames << "Fault_StallMs"
+     << faultStallMs << "Encoding_Mode" << encodingMode
+     << "Encoding_TextVersion" << encodingTextVersion
+     << "Encoding_Resolution" << encodingResolution
+     << "Encoding_DeltaMinMarkers" << encodingDeltaMinMarkers
+     << "Encoding_KeyframeInterval" << encodingKeyframeInterval
+     << "Quality_MinPixelArea" << qualityMinPixelArea
+     << "Quality_MaxReprojectionError" << qualityMaxReprojectionError
+     << "Quality_MaxViewAngle" << qualityMaxViewAngle
+     << "Quality_MinConfidence" << qualityMinConfidence;
+  WriteRigidObjects(fs, objects);
+  fs << "Mask_ImageFile" << maskImageFile << "Mask_Margin" << maskMargin
+     << "Mask_PolygonWidth" << maskPolygonWidth << "Mask_PolygonHeight"
+     << maskPolygonHeight << "Mask_Polygons" << "[";
+  for (const std::vector<int>& polygon : maskPolygons) {
+    fs << polygon;
+  }
+  fs << "]" << "Control_Port" << controlPort << "Trace_Enabled" << traceEnabled
+     << "Trace_OutputFile" << traceOutputFile << "FlightRecorder_Seconds"
+     << flightRecorderSeconds << "FlightRecorder_Scale" << flightRecorderScale
+     << "FlightRecorder_Quality" << flightRecorderQuality
+     << "FlightRecorder_FrameTimeMs" << flightRecorderFrameTimeMs
+     << "FlightRecorder_MarkerLostMs" << flightRecorderMarkerLostMs
+     << "FlightRecorder_Directory" << flightRecorderDirectory << "}";
+
+}
+
+namespace {
+template <typename T>
+void readIfPresent(const cv::FileNode& node, const char* key, T& value) {
+  const cv::FileNode child = node[key];
+  if (!child.empty()) child >> value;
+}
 
+void readMaskPolygons(const cv::FileNode& node,
+                      std::vector<std::vector<int>>& polygons) {
+  polygons.clear();
+  if (!node.isSeq()) {
+    return;
+  }
+  for (const cv::FileNode& polygon_node : node) {
+    std::vector<int> polygon;
+    polygon_node >> polygon;
+    polygons.push_back(polygon);
+  }
 }
+}  // namespace
 
 void CalibrationSettings::read(const cv::FileNode& node)  // Read serialization for this class
 {
+  readFields(node);
+  validate();
+}
+
+void CalibrationSettings::readFields(const cv::FileNode& node) {
   node["BoardSize_Width"] >> boardSize.width;
   node["BoardSize_Height"] >> boardSize.height;
   node["Window_Size"] >> windowSize;
@@ -52,6 +133,9 @@ void CalibrationSettings::read(const cv::FileNode& node)  // Read serialization
   node["Calibration_Square_Size"] >> calibrationSquareSize;
   node["Calibration_Marker_Size"] >> calibrationMarkerSize;
   node["Pose_Marker_Size"] >> poseMarkerSize;
+  node["Detect_TilesX"] >> detectTilesX;
+  node["Detect_TilesY"] >> detectTilesY;
+  node["Detect_TileOverlap"] >> detectTileOverlap;
   node["Calibrate_NrOfFrameToUse"] >> nrFrames;
   node["Calibrate_FixAspectRatio"] >> aspectRatio;
   node["Write_DetectedFeaturePoints"] >> writePoints;
@@ -65,16 +149,118 @@ void CalibrationSettings::read(const cv::FileNode& node)  // Read serialization
   node["Show_UndistortedImage"] >> showUndistorted;
   node["Input"] >> input;
   node["Input_Delay"] >> delay;
+  node["Target_FrameRate"] >> targetFrameRate;
+  node["Show_Preview"] >> showPreview;
+  node["Roi_FullFrameInterval"] >> roiFullFrameInterval;
+  node["Governor_Enabled"] >> governorEnabled;
+  node["Governor_TargetMs"] >> governorTargetMs;
+  node["Governor_StepDownFrames"] >> governorStepDownFrames;
+  node["Governor_StepUpFrames"] >> governorStepUpFrames;
+  node["Governor_Headroom"] >> governorHeadroom;
+  node["Input_ReplayMode"] >> replayMode;
+  node["Capture_Width"] >> captureWidth;
+  node["Capture_Height"] >> captureHeight;
+  node["Capture_FPS"] >> captureFps;
+  node["Capture_FourCC"] >> captureFourcc;
+  node["Capture_BufferSize"] >> captureBufferSize;
+  node["Capture_Grayscale"] >> captureGrayscale;
+  node["Record_OutputFileName"] >> recordFileName;
   node["Fix_K1"] >> fixK1;
   node["Fix_K2"] >> fixK2;
   node["Fix_K3"] >> fixK3;
   node["Fix_K4"] >> fixK4;
   node["Fix_K5"] >> fixK5;
+  node["Camera_Name"] >> cameraName;
+  node["Merge_MaxAgeMs"] >> mergeMaxAgeMs;
+  node["Detector_ParamsFile"] >> detectorParamsFile;
+  node["Watchdog_StallMs"] >> watchdogStallMs;
+  node["Watchdog_ReopenIntervalMs"] >> watchdogReopenIntervalMs;
+  node["Fault_Mode"] >> faultMode;
+  node["Fault_StallAfterFrames"] >> faultStallAfterFrames;
+  node["Fault_StallMs"] >> faultStallMs;
+  node["Thread_CaptureCpus"] >> threadCaptureCpus;
+  node["Thread_DetectCpus"] >> threadDetectCpus;
+  node["Thread_SendCpus"] >> threadSendCpus;
+  node["Thread_RealTime"] >> threadRealtime;
+  node["Filter_Enabled"] >> filterEnabled;
+  node["Filter_MinCutoffHz"] >> filterMinCutoffHz;
+  node["Filter_TranslationBeta"] >> filterTranslationBeta;
+  node["Filter_RotationBeta"] >> filterRotationBeta;
+  node["Filter_DerivativeCutoffHz"] >> filterDerivativeCutoffHz;
+  node["Filter_PredictionMs"] >> filterPredictionMs;
+  node["Filter_MaxExtrapolationMs"] >> filterMaxExtrapolationMs;
+  node["Encoding_Mode"] >> encodingMode;
+  // Settings files from before the key was added get the layout their
+  // receivers were written for
+  encodingTextVersion = 1;
+  readIfPresent(node, "Encoding_TextVersion", encodingTextVersion);
+  node["Encoding_Resolution"] >> encodingResolution;
+  node["Encoding_DeltaMinMarkers"] >> encodingDeltaMinMarkers;
+  node["Encoding_KeyframeInterval"] >> encodingKeyframeInterval;
+  node["Quality_MinPixelArea"] >> qualityMinPixelArea;
+  node["Quality_MaxReprojectionError"] >> qualityMaxReprojectionError;
+  node["Quality_MaxViewAngle"] >> qualityMaxViewAngle;
+  node["Quality_MinConfidence"] >> qualityMinConfidence;
+  objectsGood = ReadRigidObjects(node["Objects"], objects);
+  node["Mask_ImageFile"] >> maskImageFile;
+  // 0 is a valid margin, a missing key keeps the default
+  maskMargin = DetectionMaskOptions().margin;
+  readIfPresent(node, "Mask_Margin", maskMargin);
+  node["Mask_PolygonWidth"] >> maskPolygonWidth;
+  node["Mask_PolygonHeight"] >> maskPolygonHeight;
+  readMaskPolygons(node["Mask_Polygons"], maskPolygons);
+  node["Control_Port"] >> controlPort;
+  node["Trace_Enabled"] >> traceEnabled;
+  node["Trace_OutputFile"] >> traceOutputFile;
+  node["FlightRecorder_Seconds"] >> flightRecorderSeconds;
+  node["FlightRecorder_Scale"] >> flightRecorderScale;
+  node["FlightRecorder_Quality"] >> flightRecorderQuality;
+  node["FlightRecorder_FrameTimeMs"] >> flightRecorderFrameTimeMs;
+  node["FlightRecorder_MarkerLostMs"] >> flightRecorderMarkerLostMs;
+  node["FlightRecorder_Directory"] >> flightRecorderDirectory;
+  cv::Mat camera_to_world;
+  node["Camera_To_World"] >> camera_to_world;
+  cameraToWorld = camera_to_world.empty() ? cv::Matx44d::eye()
+                                          : cv::Matx44d(camera_to_world);
+}
 
-  validate();
+void CalibrationSettings::readCameraOverrides(const cv::FileNode& node) {
+  readIfPresent(node, "Camera_Name", cameraName);
+  readIfPresent(node, "Input", input);
+  readIfPresent(node, "Input_ReplayMode", replayMode);
+  readIfPresent(node, "Capture_Width", captureWidth);
+  readIfPresent(node, "Capture_Height", captureHeight);
+  readIfPresent(node, "Capture_FPS", captureFps);
+  readIfPresent(node, "Capture_FourCC", captureFourcc);
+  readIfPresent(node, "Capture_BufferSize", captureBufferSize);
+  readIfPresent(node, "Capture_Grayscale", captureGrayscale);
+  readIfPresent(node, "Record_OutputFileName", recordFileName);
+  readIfPresent(node, "Write_outputFileName", outputFileName);
+  readIfPresent(node, "Detect_TilesX", detectTilesX);
+  readIfPresent(node, "Detect_TilesY", detectTilesY);
+  readIfPresent(node, "Detect_TileOverlap", detectTileOverlap);
+  readIfPresent(node, "Detector_ParamsFile", detectorParamsFile);
+  readIfPresent(node, "Fault_Mode", faultMode);
+  readIfPresent(node, "Fault_StallAfterFrames", faultStallAfterFrames);
+  readIfPresent(node, "Fault_StallMs", faultStallMs);
+  readIfPresent(node, "Thread_CaptureCpus", threadCaptureCpus);
+  readIfPresent(node, "Thread_DetectCpus", threadDetectCpus);
+  readIfPresent(node, "Mask_ImageFile", maskImageFile);
+  readIfPresent(node, "Mask_Margin", maskMargin);
+  readIfPresent(node, "Mask_PolygonWidth", maskPolygonWidth);
+  readIfPresent(node, "Mask_PolygonHeight", maskPolygonHeight);
+  readIfPresent(node, "Quality_MinPixelArea", qualityMinPixelArea);
+  readIfPresent(node, "Quality_MaxReprojectionError",
+                qualityMaxReprojectionError);
+  if (!node["Mask_Polygons"].empty()) {
+    readMaskPolygons(node["Mask_Polygons"], maskPolygons);
+  }
+  cv::Mat camera_to_world;
+  readIfPresent(node, "Camera_To_World", camera_to_world);
+  if (!camera_to_world.empty()) cameraToWorld = cv::Matx44d(camera_to_world);
 }
 
-void CalibrationSettings::validate() {
+void CalibrationSettings::validate(bool openInput) {
   goodInput = true;
   if (boardSize.width <= 0 || boardSize.height <= 0) {
     std::cerr << "Invalid Board size: " << boardSize.width << " "
@@ -92,6 +278,100 @@ void CalibrationSettings::validate() {
   if (poseMarkerSize <= 10e-6) {
     std::cerr << "Invalid pose marker size " << poseMarkerSize << std::endl;
   }
+  if (mergeMaxAgeMs <= 0) mergeMaxAgeMs = 100;
+  if (roiFullFrameInterval < 1) roiFullFrameInterval = 1;
+  if (governorStepDownFrames < 1) governorStepDownFrames = 5;
+  if (governorStepUpFrames < 1) governorStepUpFrames = 60;
+  if (governorHeadroom <= 0 || governorHeadroom >= 1) governorHeadroom = 0.6;
+  if (watchdogStallMs <= 0) watchdogStallMs = 500;
+  if (watchdogReopenIntervalMs <= 0) watchdogReopenIntervalMs = 1000;
+  if (filterMinCutoffHz <= 0) filterMinCutoffHz = 1.0;
+  if (filterDerivativeCutoffHz <= 0) filterDerivativeCutoffHz = 1.0;
+  if (filterTranslationBeta < 0) filterTranslationBeta = 0;
+  if (filterRotationBeta < 0) filterRotationBeta = 0;
+  if (filterMaxExtrapolationMs <= 0) filterMaxExtrapolationMs = 50;
+  if (encodingMode.empty()) encodingMode = "TEXT";
+  if (encodingResolution <= 0) encodingResolution = 0.1;
+  if (encodingDeltaMinMarkers < 1) encodingDeltaMinMarkers = 8;
+  if (encodingKeyframeInterval < 1) encodingKeyframeInterval = 30;
+  if (encodingMode != "TEXT" && encodingMode != "QUANTIZED") {
+    std::cerr << "Invalid encoding mode " << encodingMode << std::endl;
+    goodInput = false;
+  }
+  if (encodingTextVersion < 1 || encodingTextVersion > MAX_TEXT_VERSION) {
+    std::cerr << "Invalid text packet version " << encodingTextVersion
+              << std::endl;
+    goodInput = false;
+  }
+  for (const std::string& cpus :
+       {threadCaptureCpus, threadDetectCpus, threadSendCpus}) {
+    if (!ParseCpuList(cpus).has_value()) {
+      std::cerr << "Invalid CPU list \"" << cpus << "\"" << std::endl;
+      goodInput = false;
+    }
+  }
+  if (!objectsGood) {
+    goodInput = false;
+  }
+  if (maskMargin < 0) {
+    std::cerr << "Invalid mask margin " << maskMargin << std::endl;
+    goodInput = false;
+  }
+  if (maskPolygonWidth < 0 || maskPolygonHeight < 0 ||
+      (maskPolygonWidth > 0) != (maskPolygonHeight > 0)) {
+    std::cerr << "Invalid mask polygon frame size " << maskPolygonWidth << "x"
+              << maskPolygonHeight << std::endl;
+    goodInput = false;
+  }
+  if (qualityMinPixelArea < 0 || qualityMaxReprojectionError < 0 ||
+      qualityMaxViewAngle < 0 || qualityMaxViewAngle > 90 ||
+      qualityMinConfidence < 0 || qualityMinConfidence > 1) {
+    std::cerr << "Invalid pose quality limits" << std::endl;
+    goodInput = false;
+  }
+  for (const std::vector<int>& polygon : maskPolygons) {
+    if (polygon.size() < 6 || polygon.size() % 2 != 0) {
+      std::cerr << "Invalid mask polygon of " << polygon.size()
+                << " coordinates, expected x y pairs of at least three points"
+                << std::endl;
+      goodInput = false;
+    }
+  }
+  if (!IsRigidTransform(cameraToWorld)) {
+    std::cerr << "Camera_To_World of " << cameraName
+              << " is not a rotation and translation" << std::endl;
+    goodInput = false;
+  }
+  if (filterPredictionMs < 0) {
+    std::cerr << "Invalid filter prediction " << filterPredictionMs << std::endl;
+    goodInput = false;
+  }
+  if (targetFrameRate < 0) {
+    std::cerr << "Invalid target frame rate " << targetFrameRate << std::endl;
+    goodInput = false;
+  }
+  if (traceOutputFile.empty()) traceOutputFile = "trace.json";
+  if (flightRecorderScale <= 0 || flightRecorderScale > 1) {
+    flightRecorderScale = 0.5;
+  }
+  if (flightRecorderDirectory.empty()) flightRecorderDirectory = "flight";
+  if (flightRecorderSeconds < 0 || flightRecorderQuality < 0 ||
+      flightRecorderQuality > 100 || flightRecorderFrameTimeMs < 0 ||
+      flightRecorderMarkerLostMs < 0) {
+    std::cerr << "Invalid flight recorder settings" << std::endl;
+    goodInput = false;
+  }
+  if (controlPort < 0 || controlPort > 65535) {
+    std::cerr << "Invalid control port " << controlPort << std::endl;
+    goodInput = false;
+  }
+  if (detectTilesX < 1) detectTilesX = 1;
+  if (detectTilesY < 1) detectTilesY = 1;
+  if (detectTileOverlap < 0) {
+    std::cerr << "Invalid detection tile overlap " << detectTileOverlap
+              << std::endl;
+    goodInput = false;
+  }
   if (windowSize <= 0) {
     std::cerr << "Invalid window size " << windowSize << std::endl;
     goodInput = false;
@@ -103,6 +383,8 @@ void CalibrationSettings::validate() {
       std::stringstream ss(input);
       ss >> cameraID;
       inputType = CAMERA;
+    } else if (isRawRecording(input)) {
+      inputType = RAW_RECORDING;
     } else {
       if (isListOfImages(input) && readStringList(input, imageList)) {
         inputType = IMAGE_LIST;
@@ -111,10 +393,13 @@ void CalibrationSettings::validate() {
       } else
         inputType = VIDEO_FILE;
     }
-    if (inputType == CAMERA) inputCapture.open(cameraID);
-    if (inputType == VIDEO_FILE) inputCapture.open(input);
-    if (inputType != IMAGE_LIST && !inputCapture.isOpened())
-      inputType = INVALID;
+    if (openInput) {
+      frameSource = CreateFrameSource(*this);
+      if (!frameSource || !frameSource->Open()) {
+        frameSource.reset();
+        inputType = INVALID;
+      }
+    }
   }
   if (inputType == INVALID) {
     std::cerr << " Input does not exist: " << input;
@@ -152,20 +437,66 @@ void CalibrationSettings::validate() {
               << std::endl;
     goodInput = false;
   }
-  atImageList = 0;
 }
 
 cv::Mat CalibrationSettings::nextImage() {
-  cv::Mat result;
-  if (inputCapture.isOpened()) {
-    cv::Mat view0;
-    inputCapture >> view0;
+  Frame frame;
+  if (frameSource && frameSource->Read(frame)) {
+    return frame.image;
+  }
+  return cv::Mat();
+}
+
+std::optional<std::vector<CalibrationSettings>> ReadCalibrationSettings(
+    const std::string settings_file_path, bool open_inputs) {
+    std::vector<CalibrationSettings> cameras;
+    cv::FileStorage fs(settings_file_path,
+                            cv::FileStorage::READ);  // Read the settings
+    if (!fs.isOpened()) {
+        std::cout << "Could not open the configuration file: \""
+                    << settings_file_path << "\"" << std::endl;
+        return std::nullopt;
+    }
+    try {
+        cv::FileNode camera_nodes = fs["Cameras"];
+        if (camera_nodes.empty()) {
+          CalibrationSettings s;
+          s.readFields(fs["Settings"]);
+          s.validate(open_inputs);
+          cameras.push_back(s);
+        } else {
+          CalibrationSettings defaults;
+          defaults.readFields(fs["Settings"]);
+          for (const cv::FileNode& camera_node : camera_nodes) {
+            CalibrationSettings s = defaults;
+            s.readCameraOverrides(camera_node);
+            s.validate(open_inputs);
+            cameras.push_back(s);
+          }
+        }
+    } catch (...) {
+        std::cout << "Invalid server settings file" << std::endl;
+        return std::nullopt;
+    }
+    for (size_t i = 0; i < cameras.size(); i++) {
+      if (cameras[i].cameraName.empty()) {
+        cameras[i].cameraName = "camera" + std::to_string(i);
+      }
+    }
+      
+    fs.release();  // close Settings file
+    return cameras;
+}
 
-    view0.copyTo(result);
-  } else if (atImageList < imageList.size())
-    result = cv::imread(imageList[atImageList++], cv::IMREAD_COLOR);
+bool CalibrationSettings::isLiveInput() const {
+  return frameSource && frameSource->IsLive();
+}
 
-  return result;
+std::chrono::microseconds CalibrationSettings::framePeriod() const {
+  if (targetFrameRate > 0) {
+    return std::chrono::microseconds((int64_t)(1e6 / targetFrameRate));
+  }
+  return std::chrono::milliseconds(std::max(delay, 1));
 }
 
 // static
@@ -181,6 +512,14 @@ bool CalibrationSettings::readStringList(const std::string& filename,
   return true;
 }
 
+// static
+bool CalibrationSettings::isRawRecording(const std::string& filename) {
+  return filename.size() >= RAW_RECORDING_EXTENSION.size() &&
+         filename.compare(filename.size() - RAW_RECORDING_EXTENSION.size(),
+                          RAW_RECORDING_EXTENSION.size(),
+                          RAW_RECORDING_EXTENSION) == 0;
+}
+
 // static
 bool CalibrationSettings::isListOfImages(const std::string& filename) {
   std::string s(filename);
@@ -1,12 +1,19 @@
 #pragma once
 #include <opencv2/core.hpp>
 #include <string.h>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
 #include <opencv2/videoio.hpp>
+#include "FrameSource.h"
+#include "RigidObject.h"
 
 namespace CameraMarkerServer {
 class CalibrationSettings {
  public:
-  CalibrationSettings() : goodInput(false) {}
+  CalibrationSettings() : objectsGood(true), goodInput(false) {}
   enum Pattern {
     NOT_EXISTING,
     CHESSBOARD,
@@ -14,14 +21,24 @@ class CalibrationSettings {
     CIRCLES_GRID,
     ASYMMETRIC_CIRCLES_GRID
   };
-  enum InputType { INVALID, CAMERA, VIDEO_FILE, IMAGE_LIST };
+  enum InputType { INVALID, CAMERA, VIDEO_FILE, IMAGE_LIST, RAW_RECORDING };
   void write(cv::FileStorage& fs) const;
   void read(const cv::FileNode& node);
-  void validate();
+  // Reads the fields without validating or opening the input.
+  void readFields(const cv::FileNode& node);
+  // Overrides the per camera fields present in an entry of the Cameras list.
+  void readCameraOverrides(const cv::FileNode& node);
+  // Without openInput the input is classified but not opened, for rereading
+  // the settings of a server that already has it open.
+  void validate(bool openInput = true);
   cv::Mat nextImage();
+  bool isLiveInput() const;
+  // Target output period, from Target_FrameRate or else from Input_Delay.
+  std::chrono::microseconds framePeriod() const;
   static bool readStringList(const std::string& filename,
                              std::vector<std::string>& l);
   static bool isListOfImages(const std::string& filename);
+  static bool isRawRecording(const std::string& filename);
 
 
  public:
@@ -35,6 +52,11 @@ class CalibrationSettings {
                                 // (point,
                      // millimeter,etc).
   float poseMarkerSize;
+  int detectTilesX;            // Tile grid for detection, 1x1 is a full frame
+  int detectTilesY;            // pass
+  int detectTileOverlap;       // Pixels each detection tile overlaps its
+                               // neighbours, at least the largest marker side
+  std::string detectorParamsFile;  // Tuned ArUco parameters, "" for defaults
   int windowSize; 
   std::string arucoDictName;  // The Name of ArUco dictionary which you use in
                               // ChArUco pattern
@@ -43,6 +65,15 @@ class CalibrationSettings {
   int nrFrames;  // The number of frames to use from the input for calibration
   float aspectRatio;            // The aspect ratio
   int delay;                    // In case of a video input
+  double targetFrameRate;       // Output rate of the server in frames/second
+  bool showPreview;             // Show annotated frames while running
+  int roiFullFrameInterval;     // Frames between full passes while detection
+                                // is limited to regions around known markers
+  bool governorEnabled;         // Lower detection quality under CPU pressure
+  double governorTargetMs;      // Per frame processing target, 0 = period
+  int governorStepDownFrames;   // Slow frames in a row before degrading
+  int governorStepUpFrames;     // Fast frames in a row before recovering
+  double governorHeadroom;      // Fast means below headroom * target
   bool writePoints;             // Write detected feature points
   bool writeExtrinsics;         // Write extrinsic parameters
   bool writeGrid;               // Write refined 3D target grid points
@@ -52,6 +83,58 @@ class CalibrationSettings {
   std::string outputFileName;  // The name of the file where to write
   bool showUndistorted;        // Show undistorted images after calibration
   std::string input;           // The input ->
+  std::string replayMode;      // REAL_TIME or MAX_SPEED for raw recordings
+  int captureWidth;            // Requested camera resolution, 0 = default
+  int captureHeight;
+  double captureFps;           // Requested camera frame rate, 0 = default
+  std::string captureFourcc;   // Requested pixel format, e.g. MJPG
+  int captureBufferSize;       // Frames buffered by the driver, 0 = default
+  bool captureGrayscale;       // Deliver single channel luminance frames
+  std::string recordFileName;  // Raw recording of the live input, if set
+  std::string cameraName;      // Name of the camera in logs and previews
+  cv::Matx44d cameraToWorld;   // Rigid transform from camera to arena frame
+  int mergeMaxAgeMs;           // Oldest camera result merged into a packet
+  int watchdogStallMs;         // Live input without frames this long is lost
+  int watchdogReopenIntervalMs;  // Time between attempts to reopen it
+  std::string faultMode;       // Injected capture fault: NONE, BLOCK or EMPTY
+  int faultStallAfterFrames;   // Good frames before the injected fault
+  int faultStallMs;            // Length of a BLOCK fault
+  std::string threadCaptureCpus;  // CPU lists like "2,3" or "4-7" per stage,
+  std::string threadDetectCpus;   // empty for any CPU
+  std::string threadSendCpus;
+  bool threadRealtime;         // Request real-time priority for stage threads
+  bool filterEnabled;          // Smooth poses and predict them to send time
+  double filterMinCutoffHz;    // Smoothing cutoff of a marker at rest
+  double filterTranslationBeta;  // Cutoff increase per unit/s of speed
+  double filterRotationBeta;   // Cutoff increase per rad/s of rotation
+  double filterDerivativeCutoffHz;  // Smoothing of the velocity estimate
+  double filterPredictionMs;   // Prediction past the send time
+  double filterMaxExtrapolationMs;  // Longest a missed marker is extrapolated
+  std::string encodingMode;    // Pose packets: TEXT or QUANTIZED
+  int encodingTextVersion;     // Layout of text packets, see PoseOutput.h
+  double encodingResolution;   // Quantized translation step, marker size units
+  int encodingDeltaMinMarkers;  // Markers in a frame before delta encoding
+  int encodingKeyframeInterval;  // Packets between quantized key packets
+  std::vector<RigidObject> objects;  // Multi-marker props, one pose each
+  bool objectsGood;            // Objects list parsed without errors
+  std::string maskImageFile;   // Painted detection mask, non-zero is active
+  std::vector<std::vector<int>> maskPolygons;  // Active polygons, x y lists
+  int maskPolygonWidth;        // Frame the polygons were drawn on, 0 for
+  int maskPolygonHeight;       // pixels of the detected frame
+  int maskMargin;              // Pixels searched around the active areas
+  double qualityMinPixelArea;  // Smaller markers are dropped before the solve
+  double qualityMaxReprojectionError;  // Pixels, poses fitting worse dropped
+  double qualityMaxViewAngle;  // Degrees off the line of sight, 0 = no limit
+  double qualityMinConfidence;  // Poses of lower confidence are dropped
+  int controlPort;             // Local control command port, 0 = disabled
+  bool traceEnabled;           // Record per frame spans from the start
+  std::string traceOutputFile;  // Chrome trace written at exit and on demand
+  double flightRecorderSeconds;  // Recent frames kept in memory, 0 = disabled
+  double flightRecorderScale;  // Size of the kept frames relative to capture
+  int flightRecorderQuality;   // JPEG quality of kept frames, 0 = lossless PNG
+  double flightRecorderFrameTimeMs;  // Dump on slower capture to pose, 0 = off
+  double flightRecorderMarkerLostMs;  // Dump on a marker unseen this long
+  std::string flightRecorderDirectory;  // Where dumps are written
   bool useFisheye;             // use fisheye camera model for calibration
   bool fixK1;                  // fix K1 distortion coefficient
   bool fixK2;                  // fix K2 distortion coefficient
@@ -61,8 +144,7 @@ class CalibrationSettings {
 
   int cameraID;
   std::vector<std::string> imageList;
-  size_t atImageList;
-  cv::VideoCapture inputCapture;
+  std::shared_ptr<FrameSource> frameSource;
   InputType inputType;
   bool goodInput;
   int flag;
@@ -70,6 +152,14 @@ class CalibrationSettings {
  private:
   std::string patternToUse;
 };
+
+// Reads one CalibrationSettings per camera. Without a Cameras list the
+// Settings node describes the only camera; with one, every entry starts from
+// Settings and overrides its per camera fields. Without open_inputs the
+// inputs are left closed, for rereading the settings while running.
+std::optional<std::vector<CalibrationSettings>> ReadCalibrationSettings(
+    const std::string settings_file_path, bool open_inputs = true);
+
 static inline void read(
     const cv::FileNode& node, CalibrationSettings& x,
     const CalibrationSettings& default_value = CalibrationSettings()) {
@@ -1,6 +1,7 @@
 #pragma once
 #include <optional>
 #include <string>
+#include <vector>
 #include <opencv2/core.hpp>
 #include <opencv2/aruco.hpp>
 #include "CalibrationSettings.h"
@@ -8,18 +9,37 @@ namespace CameraMarkerServer {
 struct CameraParameters {
   cv::Mat insintric_camera_parms;
   cv::Mat distortion_mat;
+  bool fisheye = false;  // distortion_mat holds fisheye (k1..k4) coefficients
+  cv::Size image_size;   // Resolution the camera was calibrated at
 };
 
 std::optional<CameraParameters> CalibrateAndSaveCameraParameters(
     CalibrationSettings &camera_settings);
 
 
+// Solves the intrinsics from board corners found in several views of
+// image_size, without saving them. average_error receives the RMS
+// reprojection error in pixels. Returns nullopt if the solve fails.
+std::optional<CameraParameters> SolveCalibration(
+    CalibrationSettings& s, const cv::Size& image_size,
+    const std::vector<std::vector<cv::Point2f>>& image_points,
+    double& average_error);
+
 std::optional<CameraParameters> GetCameraParametersFromFile(
     CalibrationSettings &camera_settings);
 
 std::optional<const CameraParameters> CalulateCameraParameters(
     CalibrationSettings &camera_settings);
 
+// Adapts intrinsics calibrated at camera_parameters.image_size to frames of
+// actual_size. Focal lengths and principal point scale with the resolution,
+// distortion coefficients are resolution independent. Returns nullopt when
+// the aspect ratio differs, the sensor is then cropped rather than scaled and
+// the calibration no longer applies. An empty actual_size is taken as
+// unknown and returns camera_parameters unchanged.
+std::optional<CameraParameters> ScaleCameraParameters(
+    const CameraParameters& camera_parameters, const cv::Size& actual_size);
+
 std::optional<cv::aruco::Dictionary> CreateArucoDict(CalibrationSettings &s);
 
 
@@ -1,6 +1,8 @@
 #define _CRT_SECURE_NO_WARNINGS
 
 #include "CameraCalibratationUtils.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -26,39 +28,46 @@ namespace {
 
 enum { DETECTION = 0, CAPTURING = 1, CALIBRATED = 2 };
 
-bool runCalibrationAndSave(CalibrationSettings& s, cv::Size imageSize,
-                           cv::Mat& cameraMatrix, cv::Mat& distCoeffs,
-                           std::vector<std::vector<cv::Point2f> > imagePoints,
-                           float grid_width, bool release_object);
+bool runCalibrationAndSave(
+    CalibrationSettings& s, const cv::Size& imageSize, cv::Mat& cameraMatrix,
+    cv::Mat& distCoeffs,
+    const std::vector<std::vector<cv::Point2f>>& imagePoints,
+    float grid_width, bool release_object);
 
 //! [compute_errors]
+// Every view shows the same board, so the board points are passed once
+// rather than per view. Views are projected in parallel; the total is summed
+// in view order so the result does not depend on the thread count.
 static double computeReprojectionErrors(
-    const std::vector<std::vector<cv::Point3f> >& objectPoints,
+    const std::vector<cv::Point3f>& boardPoints,
     const std::vector<std::vector<cv::Point2f> >& imagePoints, const std::vector<cv::Mat>& rvecs,
     const std::vector<cv::Mat>& tvecs, const cv::Mat& cameraMatrix, const cv::Mat& distCoeffs,
     std::vector<float>& perViewErrors, bool fisheye) {
-  std::vector<cv::Point2f> imagePoints2;
-  size_t totalPoints = 0;
-  double totalErr = 0, err;
-  perViewErrors.resize(objectPoints.size());
-
-  for (size_t i = 0; i < objectPoints.size(); ++i) {
-    if (fisheye) {
-      cv::fisheye::projectPoints(objectPoints[i], imagePoints2, rvecs[i], tvecs[i],
-                             cameraMatrix, distCoeffs);
-    } else {
-      projectPoints(objectPoints[i], rvecs[i], tvecs[i], cameraMatrix,
-                    distCoeffs, imagePoints2);
+  const int views = (int)imagePoints.size();
+  std::vector<double> squaredErrors(views);
+  perViewErrors.resize(views);
+
+  cv::parallel_for_(cv::Range(0, views), [&](const cv::Range& range) {
+    std::vector<cv::Point2f> imagePoints2;
+    for (int i = range.start; i < range.end; ++i) {
+      if (fisheye) {
+        cv::fisheye::projectPoints(boardPoints, imagePoints2, rvecs[i], tvecs[i],
+                                   cameraMatrix, distCoeffs);
+      } else {
+        projectPoints(boardPoints, rvecs[i], tvecs[i], cameraMatrix,
+                      distCoeffs, imagePoints2);
+      }
+      const double err = norm(imagePoints[i], imagePoints2, cv::NORM_L2);
+      squaredErrors[i] = err * err;
+      perViewErrors[i] = (float)std::sqrt(err * err / boardPoints.size());
     }
-    err = norm(imagePoints[i], imagePoints2, cv::NORM_L2);
+  });
 
-    size_t n = objectPoints[i].size();
-    perViewErrors[i] = (float)std::sqrt(err * err / n);
-    totalErr += err * err;
-    totalPoints += n;
+  double totalErr = 0;
+  for (double squaredError : squaredErrors) {
+    totalErr += squaredError;
   }
-
-  return std::sqrt(totalErr / totalPoints);
+  return std::sqrt(totalErr / ((double)boardPoints.size() * views));
 }
 //! [compute_errors]
 //! [board_corners]
@@ -96,10 +105,10 @@ static void calcBoardCornerPositions(
   }
 }
 //! [board_corners]
-static bool runCalibration(CalibrationSettings& s, cv::Size& imageSize,
+static bool runCalibration(CalibrationSettings& s, const cv::Size& imageSize,
                            cv::Mat& cameraMatrix,
                            cv::Mat& distCoeffs,
-                           std::vector<std::vector<cv::Point2f>> imagePoints,
+                           const std::vector<std::vector<cv::Point2f>>& imagePoints,
                            std::vector<cv::Mat>& rvecs, std::vector<cv::Mat>& tvecs,
                            std::vector<float>& reprojErrs, double& totalAvgErr,
                            std::vector<cv::Point3f>& newObjPoints, float grid_width,
@@ -115,19 +124,16 @@ static bool runCalibration(CalibrationSettings& s, cv::Size& imageSize,
     distCoeffs = cv::Mat::zeros(8, 1, CV_64F);
   }
 
-  std::vector<std::vector<cv::Point3f>> objectPoints(1);
-  calcBoardCornerPositions(s.boardSize, s.calibrationSquareSize, objectPoints[0],
+  calcBoardCornerPositions(s.boardSize, s.calibrationSquareSize, newObjPoints,
                            s.calibrationPattern);
   if (s.calibrationPattern == CalibrationSettings::Pattern::CHARUCOBOARD) {
-    objectPoints[0][s.boardSize.width - 2].x =
-        objectPoints[0][0].x + grid_width;
+    newObjPoints[s.boardSize.width - 2].x = newObjPoints[0].x + grid_width;
   } else {
-    objectPoints[0][s.boardSize.width - 1].x =
-        objectPoints[0][0].x + grid_width;
+    newObjPoints[s.boardSize.width - 1].x = newObjPoints[0].x + grid_width;
   }
-  newObjPoints = objectPoints[0];
-
-  objectPoints.resize(imagePoints.size(), objectPoints[0]);
+  // The solvers take one board copy per view
+  const std::vector<std::vector<cv::Point3f>> objectPoints(imagePoints.size(),
+                                                           newObjPoints);
 
   // Find intrinsic and extrinsic camera parameters
   double rms;
@@ -163,9 +169,7 @@ static bool runCalibration(CalibrationSettings& s, cv::Size& imageSize,
 
   bool ok = checkRange(cameraMatrix) && checkRange(distCoeffs);
 
-  objectPoints.clear();
-  objectPoints.resize(imagePoints.size(), newObjPoints);
-  totalAvgErr = computeReprojectionErrors(objectPoints, imagePoints, rvecs,
+  totalAvgErr = computeReprojectionErrors(newObjPoints, imagePoints, rvecs,
                                           tvecs, cameraMatrix, distCoeffs,
                                           reprojErrs, s.useFisheye);
 
@@ -173,7 +177,7 @@ static bool runCalibration(CalibrationSettings& s, cv::Size& imageSize,
 }
 
 // Print camera parameters to the output file
-static void saveCameraParams(CalibrationSettings& s, cv::Size& imageSize,
+static void saveCameraParams(CalibrationSettings& s, const cv::Size& imageSize,
                              cv::Mat& cameraMatrix,
                              cv::Mat& distCoeffs, const std::vector<cv::Mat>& rvecs,
                              const std::vector<cv::Mat>& tvecs,
@@ -291,11 +295,11 @@ static void saveCameraParams(CalibrationSettings& s, cv::Size& imageSize,
 }
 
 //! [run_and_save]
-bool runCalibrationAndSave(CalibrationSettings& s, cv::Size imageSize,
-                           cv::Mat& cameraMatrix,
-                           cv::Mat& distCoeffs,
-                           std::vector<std::vector<cv::Point2f> > imagePoints,
-                           float grid_width, bool release_object) {
+bool runCalibrationAndSave(
+    CalibrationSettings& s, const cv::Size& imageSize, cv::Mat& cameraMatrix,
+    cv::Mat& distCoeffs,
+    const std::vector<std::vector<cv::Point2f>>& imagePoints,
+    float grid_width, bool release_object) {
   std::vector<cv::Mat> rvecs, tvecs;
   std::vector<float> reprojErrs;
   double totalAvgErr = 0;
@@ -314,6 +318,14 @@ bool runCalibrationAndSave(CalibrationSettings& s, cv::Size imageSize,
 }
 //! [run_and_save]
 
+// Distance between the outer corners of the board's first row.
+float boardGridWidth(const CalibrationSettings& s) {
+  if (s.calibrationPattern == CalibrationSettings::Pattern::CHARUCOBOARD) {
+    return s.calibrationSquareSize * (s.boardSize.width - 2);
+  }
+  return s.calibrationSquareSize * (s.boardSize.width - 1);
+}
+
 }  // namespace
 
 std::optional<cv::aruco::Dictionary> CreateArucoDict(CalibrationSettings &s) {
@@ -385,10 +397,7 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
     return std::nullopt;
   }
 
-  float grid_width = s.calibrationSquareSize * (s.boardSize.width - 1);
-  if (s.calibrationPattern == CalibrationSettings::Pattern::CHARUCOBOARD) {
-    grid_width = s.calibrationSquareSize * (s.boardSize.width - 2);
-  }
+  const float grid_width = boardGridWidth(s);
 
   bool release_object = false;
 
@@ -412,8 +421,8 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
   std::vector<std::vector<cv::Point2f>> imagePoints;
   cv::Mat cameraMatrix, distCoeffs;
   cv::Size imageSize;
-  int mode =
-      s.inputType == CalibrationSettings::IMAGE_LIST ? CAPTURING : DETECTION;
+  // Recorded inputs start capturing straight away, cameras wait for 'g'
+  int mode = s.isLiveInput() ? DETECTION : CAPTURING;
   clock_t prevTimestamp = 0;
   const cv::Scalar RED(0, 0, 255), GREEN(0, 255, 0);
   const char ESC_KEY = 27;
@@ -490,7 +499,7 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
       // improve the found corners' coordinate accuracy for chessboard
       if (s.calibrationPattern == CalibrationSettings::CHESSBOARD) {
         cv::Mat viewGray;
-        cvtColor(view, viewGray, cv::COLOR_BGR2GRAY);
+        ToGrayscale(view, viewGray);
         cornerSubPix(
             viewGray, pointBuf, cv::Size(s.windowSize, s.windowSize), cv::Size(-1, -1),
             cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.0001));
@@ -498,11 +507,11 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
 
       if (mode ==
               CAPTURING &&  // For camera only take new samples after delay time
-          (!s.inputCapture.isOpened() ||
+          (!s.isLiveInput() ||
            clock() - prevTimestamp > s.delay * 1e-3 * CLOCKS_PER_SEC)) {
         imagePoints.push_back(pointBuf);
         prevTimestamp = clock();
-        blinkOutput = s.inputCapture.isOpened();
+        blinkOutput = s.isLiveInput();
       }
 
       // Draw the corners.
@@ -555,14 +564,14 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
     //-------------------
     //! [await_input]
     imshow("Image View", view);
-    char key = (char)cv::waitKey(s.inputCapture.isOpened() ? 50 : s.delay);
+    char key = (char)cv::waitKey(s.isLiveInput() ? 50 : s.delay);
 
     if (key == ESC_KEY) break;
 
     if (key == 'u' && mode == CALIBRATED)
       s.showUndistorted = !s.showUndistorted;
 
-    if (s.inputCapture.isOpened() && key == 'g') {
+    if (s.isLiveInput() && key == 'g') {
       mode = CAPTURING;
       imagePoints.clear();
     }
@@ -572,10 +581,32 @@ std::optional<CameraParameters> CalibrateAndSaveCameraParameters(CalibrationSett
   CameraParameters parameters;
   parameters.insintric_camera_parms = cameraMatrix;
   parameters.distortion_mat = distCoeffs;
+  parameters.fisheye = s.useFisheye;
+  parameters.image_size = imageSize;
 
   return parameters;
 }
 
+std::optional<CameraParameters> SolveCalibration(
+    CalibrationSettings& s, const cv::Size& image_size,
+    const std::vector<std::vector<cv::Point2f>>& image_points,
+    double& average_error) {
+  CameraParameters parameters;
+  std::vector<cv::Mat> rvecs, tvecs;
+  std::vector<float> reprojErrs;
+  std::vector<cv::Point3f> newObjPoints;
+  if (image_points.empty() ||
+      !runCalibration(s, image_size, parameters.insintric_camera_parms,
+                      parameters.distortion_mat, image_points, rvecs, tvecs,
+                      reprojErrs, average_error, newObjPoints,
+                      boardGridWidth(s), false)) {
+    return std::nullopt;
+  }
+  parameters.fisheye = s.useFisheye;
+  parameters.image_size = image_size;
+  return parameters;
+}
+
 std::optional<CameraParameters> GetCameraParametersFromFile(
     CalibrationSettings &camera_settings) {
   //! [file_read]
@@ -588,6 +619,9 @@ std::optional<CameraParameters> GetCameraParametersFromFile(
   try {
     fs["distortion_coefficients"] >> params.distortion_mat;
     fs["camera_matrix"] >> params.insintric_camera_parms;
+    fs["fisheye_model"] >> params.fisheye;
+    fs["image_width"] >> params.image_size.width;
+    fs["image_height"] >> params.image_size.height;
   } catch (...) {
     fs.release();
     return std::nullopt;
@@ -595,6 +629,40 @@ std::optional<CameraParameters> GetCameraParametersFromFile(
   return params;
 }
 
+std::optional<CameraParameters> ScaleCameraParameters(
+    const CameraParameters& camera_parameters, const cv::Size& actual_size) {
+  const cv::Size& calibrated_size = camera_parameters.image_size;
+  // Some backends do not report the frame size; scaling to 0x0 would zero
+  // the camera matrix
+  if (actual_size.area() == 0) {
+    std::cout << "Frame size unknown, using the calibration unscaled"
+              << std::endl;
+    return camera_parameters;
+  }
+  CameraParameters scaled = camera_parameters;
+  scaled.image_size = actual_size;
+  // Calibrations written before the image size was stored cannot be scaled
+  if (calibrated_size.area() == 0 || calibrated_size == actual_size) {
+    return scaled;
+  }
+  const double sx = (double)actual_size.width / calibrated_size.width;
+  const double sy = (double)actual_size.height / calibrated_size.height;
+  const double MAX_ASPECT_DIFFERENCE = 0.01;
+  if (std::abs(sx - sy) > MAX_ASPECT_DIFFERENCE * std::max(sx, sy)) {
+    return std::nullopt;
+  }
+  cv::Mat camera_matrix;
+  camera_parameters.insintric_camera_parms.convertTo(camera_matrix, CV_64F);
+  camera_matrix.at<double>(0, 0) *= sx;
+  camera_matrix.at<double>(1, 1) *= sy;
+  // Pixel centers sit at +0.5, so the principal point scales around -0.5
+  camera_matrix.at<double>(0, 2) = (camera_matrix.at<double>(0, 2) + 0.5) * sx - 0.5;
+  camera_matrix.at<double>(1, 2) = (camera_matrix.at<double>(1, 2) + 0.5) * sy - 0.5;
+  scaled.insintric_camera_parms = camera_matrix;
+  scaled.distortion_mat = camera_parameters.distortion_mat.clone();
+  return scaled;
+}
+
 std::optional<const CameraParameters> CalulateCameraParameters(
     CalibrationSettings& camera_settings) {
   std::optional<CameraParameters> cachedCameraParameters =
@@ -1,73 +1,382 @@
-
 #include "CameraDetector.h"
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <stdio.h>
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/videoio.hpp>
 #include <opencv2/calib3d.hpp>
 #include <optional>
+#include "Tracing.h"
 
 namespace CameraMarkerServer {
+namespace {
+// Normal of a single marker in its own frame
+const cv::Vec3d MARKER_NORMAL(0, 0, 1);
+// Confidence is full from this marker side length on
+const double FULL_CONFIDENCE_SIDE_PIXELS = 40;
+// Reprojection error at which the confidence halves
+const double HALF_CONFIDENCE_REPROJECTION_ERROR = 1.0;
+
+// Rotates v by the axis-angle rotation rvec (Rodrigues' formula), without
+// building the rotation matrix.
+cv::Vec3d RotateVector(const cv::Vec3d& rvec, const cv::Vec3d& v) {
+  const double angle = cv::norm(rvec);
+  if (angle < 1e-12) {
+    return v;
+  }
+  const cv::Vec3d axis = rvec / angle;
+  return v * std::cos(angle) + axis.cross(v) * std::sin(angle) +
+         axis * (axis.dot(v) * (1 - std::cos(angle)));
+}
+
+// Angle between a unit normal of the solved marker and the line of sight to
+// its center.
+double ViewAngle(const cv::Vec3d& rvec, const cv::Vec3d& tvec,
+                 const cv::Vec3d& normal) {
+  const double distance = cv::norm(tvec);
+  if (distance <= 0) {
+    return 0;
+  }
+  const double cosine = std::abs(RotateVector(rvec, normal).dot(tvec)) / distance;
+  return std::acos(std::min(cosine, 1.0));
+}
+
+float PoseConfidence(const MarkerObservation& observation) {
+  const double size = std::min(
+      1.0, std::sqrt(observation.pixel_area) / FULL_CONFIDENCE_SIDE_PIXELS);
+  const double fit = 1 / (1 + observation.reprojection_error /
+                                  HALF_CONFIDENCE_REPROJECTION_ERROR);
+  return (float)(size * fit * std::cos(observation.view_angle));
+}
+}  // namespace
+
+RigidTransform::RigidTransform(const cv::Matx44d& matrix)
+    : rotation(matrix.get_minor<3, 3>(0, 0)),
+      translation(matrix(0, 3), matrix(1, 3), matrix(2, 3)),
+      is_identity(matrix == cv::Matx44d::eye()) {}
+
+bool IsRigidTransform(const cv::Matx44d& matrix, double tolerance) {
+  const cv::Matx33d rotation = matrix.get_minor<3, 3>(0, 0);
+  const cv::Matx33d error = rotation.t() * rotation - cv::Matx33d::eye();
+  return cv::norm(error, cv::NORM_INF) < tolerance &&
+         std::abs(cv::determinant(rotation) - 1) < tolerance &&
+         matrix(3, 0) == 0 && matrix(3, 1) == 0 && matrix(3, 2) == 0 &&
+         matrix(3, 3) == 1;
+}
+
    
-std::optional<Pose> PoseDetector::DetectPose(cv::Mat camera_frame, const bool draw_detected_image) {
+PoseDetector::PoseDetector(float marker_length,
+                           cv::aruco::Dictionary dictionary,
+                           cv::aruco::DetectorParameters detection_params,
+                           const CameraParameters calibration_params,
+                           const TilingOptions tiling,
+                           const std::vector<RigidObject>& objects,
+                           std::shared_ptr<const DetectionMask> mask,
+                           const PoseQualityOptions& quality)
+    : marker_detector_(dictionary, detection_params, tiling, mask),
+      camera_parameters_(calibration_params),
+      marker_length_(marker_length),
+      quality_(quality) {
+  for (const RigidObject& object : objects) {
+    ObjectModel model;
+    model.id = object.id;
+    for (size_t m = 0; m < object.markers.size(); m++) {
+      const std::vector<cv::Point3f> corners =
+          ObjectMarkerCorners(object.markers[m], marker_length);
+      model.marker_corners.insert(model.marker_corners.end(), corners.begin(),
+                                  corners.end());
+      const cv::Point3d normal =
+          cv::Point3d(corners[1] - corners[0])
+              .cross(cv::Point3d(corners[3] - corners[0]));
+      model.marker_normals.push_back(cv::Vec3d(normal * (1 / cv::norm(normal))));
+      object_members_[object.markers[m].id] = ObjectMember{objects_.size(), m};
+    }
+    objects_.push_back(model);
+  }
+  if (calibration_params.image_size.width > 1 &&
+      calibration_params.image_size.height > 1) {
+    undistorter_ = std::make_shared<const CornerUndistorter>(
+        calibration_params, calibration_params.image_size);
+  } else if (calibration_params.fisheye) {
+    std::cout << "Calibration has no image size, fisheye poses will be wrong"
+              << std::endl;
+  }
+}
+
+std::vector<MarkerObservation> PoseDetector::DetectPoses(
+    const cv::Mat& camera_frame, const DetectionOptions& options) const {
   std::vector<int> ids;
   std::vector<std::vector<cv::Point2f>> corners;
+  if (camera_frame.empty()) {
+    return std::vector<MarkerObservation>();
+  }
+  {
+    TRACE_SPAN("detect");
+    marker_detector_.Detect(camera_frame, corners, ids, options);
+  }
+  return SolvePoses(corners, ids);
+}
 
-
+std::vector<MarkerObservation> PoseDetector::DetectPoses(
+    const cv::Mat& camera_frame, const std::vector<cv::Rect>& regions,
+    const DetectionOptions& options) const {
+  std::vector<int> ids;
+  std::vector<std::vector<cv::Point2f>> corners;
   if (camera_frame.empty()) {
-    return std::nullopt;
+    return std::vector<MarkerObservation>();
+  }
+  {
+    TRACE_SPAN("detect_regions");
+    marker_detector_.DetectInRegions(camera_frame, regions, corners, ids,
+                                     options);
+  }
+  return SolvePoses(corners, ids);
+}
+
+std::vector<MarkerObservation> PoseDetector::SolvePoses(
+    const std::vector<std::vector<cv::Point2f>>& corners,
+    const std::vector<int>& ids) const {
+  TRACE_SPAN("pnp");
+  std::vector<MarkerObservation> observations;
+  std::vector<cv::Point3f> obj_points = {
+      cv::Point3f(-marker_length_ / 2.f, marker_length_ / 2.f, 0),
+      cv::Point3f(marker_length_ / 2.f, marker_length_ / 2.f, 0),
+      cv::Point3f(marker_length_ / 2.f, -marker_length_ / 2.f, 0),
+      cv::Point3f(-marker_length_ / 2.f, -marker_length_ / 2.f, 0)};
+  // Markers of objects are gathered per object and solved together below
+  std::vector<std::vector<size_t>> object_markers(objects_.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    std::unordered_map<int, ObjectMember>::const_iterator member =
+        object_members_.find(ids[i]);
+    if (member != object_members_.end()) {
+      object_markers[member->second.object].push_back(i);
+      continue;
+    }
+    // Markers too small to give a usable pose are not worth a solve
+    const double pixel_area = cv::contourArea(corners[i]);
+    if (pixel_area < quality_.min_pixel_area) {
+      continue;
+    }
+    MarkerObservation observation;
+    if (!SolvePoints(obj_points, corners[i], observation)) {
+      continue;
+    }
+    observation.id = ids[i];
+    observation.pixel_area = pixel_area;
+    observation.view_angle =
+        ViewAngle(observation.rvec, observation.tvec, MARKER_NORMAL);
+    if (!RateObservation(observation)) {
+      continue;
+    }
+    observations.push_back(observation);
   }
-  
-
-
-  
-
-  
-  std::optional<Pose> answer = std::nullopt;
-  cv::Mat obj_points(4, 1, CV_32FC3);
-  obj_points.ptr<cv::Vec3f>(0)[0] =
-      cv::Vec3f(-marker_length_ / 2.f, marker_length_ / 2.f, 0);
-  obj_points.ptr<cv::Vec3f>(0)[1] =
-      cv::Vec3f(marker_length_ / 2.f, marker_length_ / 2.f, 0);
-  obj_points.ptr<cv::Vec3f>(0)[2] =
-      cv::Vec3f(marker_length_ / 2.f, -marker_length_ / 2.f, 0);
-  obj_points.ptr<cv::Vec3f>(0)[3] =
-      cv::Vec3f(-marker_length_ / 2.f, -marker_length_ / 2.f, 0);
-  aruco_detector_.detectMarkers(camera_frame, corners, ids);
-  if (ids.size() > 0) {
-    int id = ids.front();
-    std::vector<cv::Point2f> frame_corners = corners.front();
-    Pose detected_pose;
-    std::cout << "Found marker!" << std::endl;
-    cv::Mat rvec;
-    cv::Mat tvec;
-
-    if (cv::solvePnP(obj_points, corners.front(),
+
+  std::vector<cv::Point3f> object_points;
+  std::vector<cv::Point2f> image_points;
+  std::vector<size_t> members;
+  for (size_t o = 0; o < objects_.size(); o++) {
+    if (object_markers[o].empty()) {
+      continue;
+    }
+    const ObjectModel& model = objects_[o];
+    object_points.clear();
+    image_points.clear();
+    members.clear();
+    double pixel_area = 0;
+    for (size_t i : object_markers[o]) {
+      const double marker_area = cv::contourArea(corners[i]);
+      if (marker_area < quality_.min_pixel_area) {
+        continue;
+      }
+      const size_t member = object_members_.at(ids[i]).member;
+      members.push_back(member);
+      object_points.insert(object_points.end(),
+                           model.marker_corners.begin() + member * 4,
+                           model.marker_corners.begin() + member * 4 + 4);
+      image_points.insert(image_points.end(), corners[i].begin(),
+                          corners[i].end());
+      pixel_area += marker_area;
+    }
+    MarkerObservation observation;
+    if (members.empty() ||
+        !SolvePoints(object_points, image_points, observation)) {
+      continue;
+    }
+    observation.id = model.id;
+    observation.pixel_area = pixel_area;
+    // The best placed marker decides, the others are seen at steeper angles
+    observation.view_angle = CV_PI / 2;
+    for (size_t member : members) {
+      observation.view_angle =
+          std::min(observation.view_angle,
+                   ViewAngle(observation.rvec, observation.tvec,
+                             model.marker_normals[member]));
+    }
+    if (!RateObservation(observation)) {
+      continue;
+    }
+    observations.push_back(observation);
+  }
+  return observations;
+}
+
+bool PoseDetector::SolvePoints(const std::vector<cv::Point3f>& object_points,
+                               const std::vector<cv::Point2f>& image_points,
+                               MarkerObservation& observation) const {
+  std::vector<cv::Point2f> normalized;
+  std::vector<cv::Point2f> projected;
+  const cv::Matx33d camera_matrix = camera_parameters_.insintric_camera_parms;
+  const double mean_focal_length = (camera_matrix(0, 0) + camera_matrix(1, 1)) / 2;
+  const double point_count = (double)image_points.size();
+  cv::Vec3d rvec;
+  cv::Vec3d tvec;
+  double reprojection_error;
+  if (undistorter_) {
+    // Undistorted corners need no camera model in the solve; the error is
+    // measured in normalized coordinates and scaled back to pixels.
+    undistorter_->Undistort(image_points, normalized);
+    if (!cv::solvePnP(object_points, normalized, cv::Matx33d::eye(),
+                      cv::noArray(), rvec, tvec)) {
+      return false;
+    }
+    cv::projectPoints(object_points, rvec, tvec, cv::Matx33d::eye(),
+                      cv::noArray(), projected);
+    reprojection_error = cv::norm(normalized, projected, cv::NORM_L2) /
+                         std::sqrt(point_count) * mean_focal_length;
+  } else {
+    if (!cv::solvePnP(object_points, image_points,
                       camera_parameters_.insintric_camera_parms,
-                      camera_parameters_.distortion_mat, rvec,
-                      tvec)) {
-      detected_pose.translation = tvec;
-      cv::Mat rot_mat;
-
-      cv::Rodrigues(rvec, rot_mat);
-      rot_mat.col(1).copyTo(detected_pose.up);
-      rot_mat.col(2).copyTo(detected_pose.forward);
-      cv::Mat drawnMarkers;
-      camera_frame.copyTo(drawnMarkers);
-      cv::drawFrameAxes(drawnMarkers, camera_parameters_.insintric_camera_parms,
-                        camera_parameters_.distortion_mat, rvec, tvec, marker_length_);
-      cv::imshow("CameraServer", drawnMarkers);
-      return detected_pose;
+                      camera_parameters_.distortion_mat, rvec, tvec)) {
+      return false;
     }
+    cv::projectPoints(object_points, rvec, tvec,
+                      camera_parameters_.insintric_camera_parms,
+                      camera_parameters_.distortion_mat, projected);
+    reprojection_error =
+        cv::norm(image_points, projected, cv::NORM_L2) / std::sqrt(point_count);
+  }
+  observation.corners = image_points;
+  observation.rvec = rvec;
+  observation.tvec = tvec;
+  observation.reprojection_error = reprojection_error;
+  return true;
+}
+
+bool PoseDetector::RateObservation(MarkerObservation& observation) const {
+  if ((quality_.max_reprojection_error > 0 &&
+       observation.reprojection_error > quality_.max_reprojection_error) ||
+      (quality_.max_view_angle > 0 &&
+       observation.view_angle > quality_.max_view_angle)) {
+    return false;
   }
+  observation.confidence = PoseConfidence(observation);
+  return observation.confidence >= quality_.min_confidence;
+}
 
-   cv::imshow("CameraServer", camera_frame);
-  
+void PoseDetector::DrawObservations(
+    cv::Mat& image, const std::vector<MarkerObservation>& observations) const {
+  if (!camera_parameters_.fisheye) {
+    for (const MarkerObservation& observation : observations) {
+      cv::drawFrameAxes(image, camera_parameters_.insintric_camera_parms,
+                        camera_parameters_.distortion_mat, observation.rvec,
+                        observation.tvec, marker_length_);
+    }
+    return;
+  }
+  // drawFrameAxes only knows the pinhole model
+  std::vector<cv::Point3f> axes = {
+      cv::Point3f(0, 0, 0), cv::Point3f(marker_length_, 0, 0),
+      cv::Point3f(0, marker_length_, 0), cv::Point3f(0, 0, marker_length_)};
+  std::vector<cv::Point2f> projected;
+  for (const MarkerObservation& observation : observations) {
+    cv::fisheye::projectPoints(axes, projected, observation.rvec,
+                               observation.tvec,
+                               camera_parameters_.insintric_camera_parms,
+                               camera_parameters_.distortion_mat);
+    cv::line(image, projected[0], projected[1], cv::Scalar(0, 0, 255), 3);
+    cv::line(image, projected[0], projected[2], cv::Scalar(0, 255, 0), 3);
+    cv::line(image, projected[0], projected[3], cv::Scalar(255, 0, 0), 3);
+  }
+}
 
-  
-  return answer;
+// static
+PoseQualityOptions PoseQualityOptions::FromSettings(
+    const CalibrationSettings& s) {
+  PoseQualityOptions quality;
+  quality.min_pixel_area = s.qualityMinPixelArea;
+  quality.max_reprojection_error = s.qualityMaxReprojectionError;
+  quality.max_view_angle = s.qualityMaxViewAngle * CV_PI / 180;
+  quality.min_confidence = s.qualityMinConfidence;
+  return quality;
 }
 
+std::optional<PoseDetector> CreatePoseDetector(
+    CalibrationSettings& camera_settings, const cv::Size& capture_size,
+    bool allow_calibration) {
+  std::optional<cv::aruco::Dictionary> dictionary =
+      CreateArucoDict(camera_settings);
+  if (!dictionary.has_value()) {
+    std::cout << "Could not parse aruco dictionary." << std::endl;
+    return std::nullopt;
+  }
+  if (!CheckObjectIds(camera_settings.objects, dictionary->bytesList.rows)) {
+    return std::nullopt;
+  }
+  std::optional<CameraParameters> camera_params;
+  if (allow_calibration) {
+    std::cout << "Calibrating " << camera_settings.cameraName << "..."
+              << std::endl;
+    camera_params = CalulateCameraParameters(camera_settings);
+  } else {
+    camera_params = GetCameraParametersFromFile(camera_settings);
+  }
+  if (!camera_params.has_value()) {
+    std::cout << "Could not calculate camera calibrations values for "
+              << camera_settings.cameraName << std::endl;
+    return std::nullopt;
+  }
+  if (allow_calibration) {
+    std::cout << "Camera successfully calibrated!" << std::endl;
+  }
+
+  const cv::Size calibrated_size = camera_params->image_size;
+  camera_params = ScaleCameraParameters(camera_params.value(), capture_size);
+  if (!camera_params.has_value()) {
+    std::cout << "Capture resolution " << capture_size
+              << " does not match the aspect ratio of the calibrated resolution "
+              << calibrated_size << std::endl;
+    return std::nullopt;
+  }
+  if (calibrated_size.area() > 0 && capture_size.area() > 0 &&
+      calibrated_size != capture_size) {
+    std::cout << "Scaled calibration from " << calibrated_size << " to "
+              << capture_size << std::endl;
+  }
+
+  std::optional<cv::aruco::DetectorParameters> detection_params =
+      LoadDetectorParameters(camera_settings.detectorParamsFile);
+  if (!detection_params.has_value()) {
+    std::cout << "Could not read detector parameters from \""
+              << camera_settings.detectorParamsFile << "\"" << std::endl;
+    return std::nullopt;
+  }
+
+  TilingOptions tiling;
+  tiling.tiles_x = camera_settings.detectTilesX;
+  tiling.tiles_y = camera_settings.detectTilesY;
+  tiling.overlap = camera_settings.detectTileOverlap;
+
+  std::shared_ptr<const DetectionMask> mask;
+  if (!DetectionMask::FromSettings(camera_settings, capture_size, mask)) {
+    return std::nullopt;
+  }
+  return PoseDetector(camera_settings.poseMarkerSize, dictionary.value(),
+                      detection_params.value(), camera_params.value(),
+                      tiling, camera_settings.objects, mask,
+                      PoseQualityOptions::FromSettings(camera_settings));
 }
 
+}
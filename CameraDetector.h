@@ -3,37 +3,136 @@
 #include <opencv2/core.hpp>
 #include <opencv2/core/types.hpp>
 #include <opencv2/videoio.hpp>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <unordered_map>
 #include "CameraCalibratationUtils.h"
+#include "CornerUndistorter.h"
+#include "MarkerDetector.h"
+#include "RigidObject.h"
 #include <opencv2/aruco.hpp>
 #include <opencv2/calib3d/calib3d.hpp>
 
 namespace CameraMarkerServer {
+// A pose as the text protocol sends it, expanded from a PoseBatch row.
 struct Pose {
   cv::Vec3d forward;
   cv::Vec3d up;
   cv::Vec3d translation;
 };
 
+// A rigid camera-to-world transform, split out of its 4x4 matrix once.
+struct RigidTransform {
+  RigidTransform() {}
+  explicit RigidTransform(const cv::Matx44d& matrix);
+
+  cv::Matx33d rotation = cv::Matx33d::eye();
+  cv::Vec3d translation;
+  bool is_identity = true;  // Poses pass through unchanged
+};
+
+// Returns true if matrix is a rotation and translation without scale or
+// shear, within tolerance.
+bool IsRigidTransform(const cv::Matx44d& matrix, double tolerance = 1e-3);
+
+// A solved marker or object. The poses sent on are converted from rvec and
+// tvec for all markers of a frame at once, see PoseBatch.
+struct MarkerObservation {
+  int id;  // Marker id, or the object id for a rigid object
+  std::vector<cv::Point2f> corners;  // Image corners the pose was solved from,
+                                     // four per marker
+  // Camera frame solvePnP output
+  cv::Vec3d rvec;
+  cv::Vec3d tvec;
+  double reprojection_error;  // RMS in pixels over the corners
+  double pixel_area;          // Area of the marker in the image
+  // Radians between the marker normal and the line of sight, 0 facing the
+  // camera; for objects the best member's
+  double view_angle = 0;
+  // 0 to 1, falls for small, badly fitting and grazing markers
+  float confidence = 1;
+};
+
+// Gates on the quality of solved poses; poses failing one are dropped.
+// Zero turns a gate off.
+struct PoseQualityOptions {
+  // Also checked before the solve, for every marker of an object
+  double min_pixel_area = 0;
+  double max_reprojection_error = 0;  // Pixels
+  double max_view_angle = 0;          // Radians
+  double min_confidence = 0;
+
+  // The gates of the Quality_* settings, whose view angle is in degrees.
+  static PoseQualityOptions FromSettings(const CalibrationSettings& s);
+};
+
 class PoseDetector {
  public:
   PoseDetector(float marker_length, 
                cv::aruco::Dictionary dictionary,
                cv::aruco::DetectorParameters detection_params,
-               const CameraParameters calibration_params)
-      : aruco_detector_(dictionary, detection_params),
-        camera_parameters_(calibration_params),
-        marker_length_(marker_length) {}
-  std::optional<Pose> DetectPose(const cv::Mat camera_frame,
-                                 const bool draw_detected_image);
+               const CameraParameters calibration_params,
+               const TilingOptions tiling = TilingOptions(),
+               const std::vector<RigidObject>& objects =
+                   std::vector<RigidObject>(),
+               std::shared_ptr<const DetectionMask> mask = nullptr,
+               const PoseQualityOptions& quality = PoseQualityOptions());
+  // Returns one camera frame pose for every marker found in the frame that
+  // is not part of an object, and one for every object with at least one
+  // marker found.
+  std::vector<MarkerObservation> DetectPoses(
+      const cv::Mat& camera_frame,
+      const DetectionOptions& options = DetectionOptions()) const;
+  // Like DetectPoses, but only searches the given regions of the frame.
+  std::vector<MarkerObservation> DetectPoses(
+      const cv::Mat& camera_frame, const std::vector<cv::Rect>& regions,
+      const DetectionOptions& options = DetectionOptions()) const;
+  void DrawObservations(cv::Mat& image,
+                        const std::vector<MarkerObservation>& observations) const;
 
  private:
-  cv::aruco::ArucoDetector aruco_detector_;
+  // Object model points with the corners of every member marker.
+  struct ObjectModel {
+    int id;
+    std::vector<cv::Point3f> marker_corners;  // Four per member marker
+    std::vector<cv::Vec3d> marker_normals;    // One per member marker
+  };
+  struct ObjectMember {
+    size_t object;
+    size_t member;
+  };
+
+  std::vector<MarkerObservation> SolvePoses(
+      const std::vector<std::vector<cv::Point2f>>& corners,
+      const std::vector<int>& ids) const;
+  // Solves the pose of object_points seen at image_points and fills the
+  // solve results of observation. Returns false if PnP fails.
+  bool SolvePoints(const std::vector<cv::Point3f>& object_points,
+                   const std::vector<cv::Point2f>& image_points,
+                   MarkerObservation& observation) const;
+  // Fills the confidence of a solved observation. Returns false if it
+  // fails a quality gate.
+  bool RateObservation(MarkerObservation& observation) const;
+
+  MarkerDetector marker_detector_;
   const CameraParameters camera_parameters_;
+  // Shared between copies, the table is large. Null when the calibrated
+  // image size is unknown, in which case PnP undistorts per solve.
+  std::shared_ptr<const CornerUndistorter> undistorter_;
   float marker_length_;
-
+  PoseQualityOptions quality_;
+  std::vector<ObjectModel> objects_;
+  std::unordered_map<int, ObjectMember> object_members_;  // By marker id
 };
 
 
-	
+// Builds the detector for frames of capture_size. At startup a missing
+// calibration is created interactively; while running (allow_calibration
+// false) only the calibration file is read.
+std::optional<PoseDetector> CreatePoseDetector(
+    CalibrationSettings& camera_settings, const cv::Size& capture_size,
+    bool allow_calibration);
+
 }  // namespace CameraMarkerServer
-#endif     // CAMERA_DETECTOR_UTILS_H_CAMERA_DETECTOR_UTILS_H_
\ No newline at end of file
+#endif     // CAMERA_DETECTOR_UTILS_H_CAMERA_DETECTOR_UTILS_H_
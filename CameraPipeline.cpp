@@ -0,0 +1,360 @@
+#include "CameraPipeline.h"
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "FrameScheduler.h"
+#include "QualityGovernor.h"
+#include "ThreadUtils.h"
+#include "Tracing.h"
+
+namespace CameraMarkerServer {
+namespace {
+const std::chrono::milliseconds FRAME_WAIT_TIMEOUT(100);
+const std::chrono::milliseconds WATCHDOG_POLL_INTERVAL(50);
+// Time a retired capture thread gets to release the camera before reopening
+const std::chrono::milliseconds CAPTURE_RELEASE_TIMEOUT(500);
+// Live cameras may fail reads in a burst; this keeps them from spinning
+const std::chrono::milliseconds FAILED_READ_BACKOFF(5);
+// Reader slots of the detection config
+const int DETECT_READER = 0;
+const int PREVIEW_READER = 1;
+const int DETECTION_CONFIG_READERS = 2;
+// Frames in flight: capture, both mailboxes, detection, the send loop's
+// latest result, the preview and the flight recorder's mailbox and
+// encoder, plus slack
+const int FRAME_POOL_CAPACITY = 10;
+
+FlightRecorderOptions MakeFlightRecorderOptions(const CalibrationSettings& s) {
+  FlightRecorderOptions options;
+  options.history = std::chrono::milliseconds(
+      (int64_t)(s.flightRecorderSeconds * 1000));
+  options.scale = s.flightRecorderScale;
+  options.quality = s.flightRecorderQuality;
+  options.frame_time_limit = std::chrono::microseconds(
+      (int64_t)(s.flightRecorderFrameTimeMs * 1000));
+  options.marker_lost_limit = std::chrono::milliseconds(
+      (int64_t)s.flightRecorderMarkerLostMs);
+  options.directory = s.flightRecorderDirectory;
+  return options;
+}
+
+// Markers move at most about one side length between frames, so each
+// region pads the marker's bounding box by its size.
+std::vector<cv::Rect> RegionsAroundMarkers(
+    const std::vector<MarkerObservation>& observations) {
+  std::vector<cv::Rect> regions;
+  for (const MarkerObservation& observation : observations) {
+    cv::Rect box = cv::boundingRect(observation.corners);
+    int pad = std::max(box.width, box.height);
+    regions.push_back(cv::Rect(box.x - pad, box.y - pad, box.width + 2 * pad,
+                               box.height + 2 * pad));
+  }
+  return regions;
+}
+}  // namespace
+
+CameraPipeline::CameraPipeline(
+    int camera_index, const CalibrationSettings& settings,
+    std::shared_ptr<const DetectionConfig> detection_config,
+    SourceFactory reopen_source, std::function<void()> on_result)
+    : camera_index_(camera_index),
+      settings_(settings),
+      reopen_source_(std::move(reopen_source)),
+      detection_config_(std::move(detection_config), DETECTION_CONFIG_READERS),
+      camera_to_world_(settings.cameraToWorld),
+      running_(false),
+      frame_pool_(FRAME_POOL_CAPACITY),
+      frames_(!settings.isLiveInput()),
+      results_(!settings.isLiveInput(), std::move(on_result)),
+      flight_recorder_(settings.cameraName, MakeFlightRecorderOptions(settings)),
+      capture_generation_(0),
+      active_capture_threads_(0),
+      last_frame_time_(0),
+      tracking_lost_(false) {
+  if (!reopen_source_) {
+    reopen_source_ = [this]() {
+      return std::shared_ptr<FrameSource>(CreateFrameSource(settings_));
+    };
+  }
+}
+
+CameraPipeline::~CameraPipeline() { Stop(); }
+
+void CameraPipeline::DrawObservations(
+    cv::Mat& image, const std::vector<MarkerObservation>& observations) const {
+  SnapshotCell<DetectionConfig>::ReadGuard config =
+      detection_config_.Read(PREVIEW_READER);
+  config->detector->DrawObservations(image, observations);
+}
+
+void CameraPipeline::Start() {
+  if (!settings_.recordFileName.empty() &&
+      recorder_.Open(settings_.recordFileName)) {
+    std::cout << "Recording " << settings_.cameraName << " to "
+              << settings_.recordFileName << std::endl;
+  }
+  if (settings_.flightRecorderSeconds > 0) {
+    flight_recorder_.Start();
+  }
+  running_ = true;
+  last_frame_time_ = std::chrono::steady_clock::now().time_since_epoch().count();
+  // Counted before the thread starts so a reopen never misses it
+  active_capture_threads_++;
+  capture_thread_ = std::thread(&CameraPipeline::CaptureLoop, this,
+                                capture_generation_.load(),
+                                settings_.frameSource);
+  detect_thread_ = std::thread(&CameraPipeline::DetectLoop, this);
+  if (settings_.isLiveInput()) {
+    watchdog_thread_ = std::thread(&CameraPipeline::WatchdogLoop, this);
+  }
+}
+
+void CameraPipeline::Stop() {
+  running_ = false;
+  frames_.Close();
+  results_.Close();
+  if (watchdog_thread_.joinable()) watchdog_thread_.join();
+  if (capture_thread_.joinable()) capture_thread_.join();
+  for (std::thread& retired : retired_capture_threads_) {
+    if (retired.joinable()) retired.join();
+  }
+  retired_capture_threads_.clear();
+  if (detect_thread_.joinable()) detect_thread_.join();
+  flight_recorder_.Stop();
+  recorder_.Close();
+}
+
+std::chrono::steady_clock::duration CameraPipeline::TimeSinceLastFrame() const {
+  return std::chrono::steady_clock::now().time_since_epoch() -
+         std::chrono::steady_clock::duration(last_frame_time_.load());
+}
+
+void CameraPipeline::CaptureLoop(uint64_t generation,
+                                 std::shared_ptr<FrameSource> source) {
+  ConfigureCurrentThread(
+      "capture:" + settings_.cameraName,
+      MakeThreadOptions(settings_.threadCaptureCpus, settings_.threadRealtime));
+  bool end_of_input = false;
+  // Every frame is read into a pooled buffer of the previous frame's format.
+  // Sources that hand out their own memory, like raw recordings, replace
+  // the buffer; they are not offered one again.
+  cv::Size frame_size;
+  int frame_type = -1;
+  bool offer_pooled = true;
+  while (running_ && capture_generation_ == generation) {
+    CapturedFrame captured;
+    const bool offered = offer_pooled && frame_type >= 0;
+    if (offered) {
+      captured.frame.image = frame_pool_.Take(frame_size, frame_type);
+    }
+    bool has_frame;
+    {
+      TRACE_SPAN("capture");
+      has_frame = source->Read(captured.frame);
+      if (has_frame) {
+        TRACE_FRAME(captured.frame.index);
+      }
+    }
+    if (!has_frame) {
+      if (!source->IsLive()) {
+        std::cout << "End of input reached for " << settings_.cameraName
+                  << std::endl;
+        end_of_input = true;
+        break;
+      }
+      std::this_thread::sleep_for(FAILED_READ_BACKOFF);
+      continue;
+    }
+    frame_size = captured.frame.image.size();
+    frame_type = captured.frame.image.type();
+    if (offered && !frame_pool_.Owns(captured.frame.image)) {
+      offer_pooled = false;
+      frame_pool_.ReleaseUnused();
+    }
+    {
+      // The read may have blocked past a reopen; the new source owns the
+      // stream now.
+      std::lock_guard<std::mutex> fence(capture_fence_);
+      if (capture_generation_ != generation) {
+        break;
+      }
+      captured.capture_time = std::chrono::steady_clock::now();
+      last_frame_time_ = captured.capture_time.time_since_epoch().count();
+      if (recorder_.IsOpened()) {
+        TRACE_SPAN("record");
+        recorder_.Write(captured.frame);
+      }
+    }
+    if (!frames_.Put(std::move(captured))) {
+      break;
+    }
+  }
+  // Closed on this thread, a read may still have been running on it
+  source->Close();
+  if (end_of_input || !running_) {
+    frames_.Close();
+  }
+  active_capture_threads_--;
+}
+
+void CameraPipeline::WatchdogLoop() {
+  SetCurrentThreadName("watchdog:" + settings_.cameraName);
+  const std::chrono::milliseconds stall_timeout(settings_.watchdogStallMs);
+  const std::chrono::milliseconds reopen_interval(
+      settings_.watchdogReopenIntervalMs);
+  std::chrono::steady_clock::time_point last_reopen;
+  while (running_) {
+    std::this_thread::sleep_for(WATCHDOG_POLL_INTERVAL);
+    const std::chrono::steady_clock::duration since_last_frame =
+        TimeSinceLastFrame();
+    if (since_last_frame < stall_timeout) {
+      if (tracking_lost_.exchange(false)) {
+        std::cout << settings_.cameraName << " is delivering frames again"
+                  << std::endl;
+      }
+      continue;
+    }
+    if (!tracking_lost_.exchange(true)) {
+      std::cout << settings_.cameraName << " delivered no frame for "
+                << std::chrono::duration_cast<std::chrono::milliseconds>(
+                       since_last_frame)
+                       .count()
+                << " ms, tracking lost" << std::endl;
+      flight_recorder_.Trigger("stall");
+    }
+    if (std::chrono::steady_clock::now() - last_reopen >= reopen_interval) {
+      last_reopen = std::chrono::steady_clock::now();
+      ReopenSource();
+    }
+  }
+}
+
+void CameraPipeline::ReopenSource() {
+  // Retire the stalled capture thread. If its read returns it exits and
+  // releases the camera; if the read stays blocked, the reopen below fails
+  // and is retried on the next interval. Once the fence is passed the
+  // retired thread cannot write another frame.
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> fence(capture_fence_);
+    generation = ++capture_generation_;
+  }
+  if (capture_thread_.joinable()) {
+    retired_capture_threads_.push_back(std::move(capture_thread_));
+  }
+  std::chrono::steady_clock::time_point release_deadline =
+      std::chrono::steady_clock::now() + CAPTURE_RELEASE_TIMEOUT;
+  while (active_capture_threads_ > 0 &&
+         std::chrono::steady_clock::now() < release_deadline) {
+    std::this_thread::sleep_for(FAILED_READ_BACKOFF);
+  }
+  std::cout << "Reopening " << settings_.cameraName << std::endl;
+  std::shared_ptr<FrameSource> source = reopen_source_();
+  if (!source || !source->Open()) {
+    std::cout << "Could not reopen " << settings_.cameraName << ", retrying"
+              << std::endl;
+    return;
+  }
+  active_capture_threads_++;
+  capture_thread_ =
+      std::thread(&CameraPipeline::CaptureLoop, this, generation, source);
+}
+
+void CameraPipeline::DetectLoop() {
+  ConfigureCurrentThread(
+      "detect:" + settings_.cameraName,
+      MakeThreadOptions(settings_.threadDetectCpus, settings_.threadRealtime));
+  CapturedFrame captured;
+  FrameScheduler detect_budget(settings_.framePeriod());
+  std::vector<MarkerObservation> previous_observations;
+  int frames_since_full_pass = 0;
+  GovernorOptions governor_options;
+  governor_options.latency_target =
+      settings_.governorTargetMs > 0
+          ? std::chrono::microseconds((int64_t)(settings_.governorTargetMs * 1000))
+          : settings_.framePeriod();
+  governor_options.step_down_frames = settings_.governorStepDownFrames;
+  governor_options.step_up_frames = settings_.governorStepUpFrames;
+  governor_options.headroom = settings_.governorHeadroom;
+  QualityGovernor governor(settings_.cameraName, governor_options);
+  int64_t frame_number = 0;
+  while (running_) {
+    if (!frames_.Take(captured, FRAME_WAIT_TIMEOUT)) {
+      if (frames_.IsClosedAndEmpty()) {
+        break;
+      }
+      continue;
+    }
+    TRACE_FRAME(captured.frame.index);
+    // Held for this frame only, a swapped config applies from the next one
+    SnapshotCell<DetectionConfig>::ReadGuard config =
+        detection_config_.Read(DETECT_READER);
+    const PoseDetector& detector = *config->detector;
+    if (config->frame_period != detect_budget.period()) {
+      detect_budget.set_period(config->frame_period);
+    }
+    const QualityLevel quality = settings_.governorEnabled
+                                     ? governor.current()
+                                     : QualityLevel();
+    if (frame_number++ % quality.detection_cadence != 0) {
+      continue;
+    }
+    DetectionOptions options;
+    options.downscale = quality.downscale;
+    options.use_tiling = quality.use_tiling;
+    options.refine_corners = quality.refine_corners;
+
+    CameraResult result;
+    result.camera_index = camera_index_;
+    result.capture_time = captured.capture_time;
+    const bool regions_only = detect_budget.IsOverBudget() &&
+                              !previous_observations.empty() &&
+                              frames_since_full_pass < settings_.roiFullFrameInterval;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (regions_only) {
+      result.observations = detector.DetectPoses(
+          captured.frame.image, RegionsAroundMarkers(previous_observations),
+          options);
+      frames_since_full_pass++;
+    } else {
+      result.observations = detector.DetectPoses(captured.frame.image, options);
+      // Only full passes feed the budget and the governor, otherwise the
+      // cheap region passes would flip detection back to full frames and
+      // full quality straight away.
+      const std::chrono::steady_clock::duration work =
+          std::chrono::steady_clock::now() - start;
+      detect_budget.RecordWork(work);
+      if (settings_.governorEnabled) {
+        governor.RecordFrame(work);
+      }
+      frames_since_full_pass = 0;
+    }
+    const std::chrono::steady_clock::time_point detected =
+        std::chrono::steady_clock::now();
+    previous_observations = result.observations;
+    if (settings_.flightRecorderSeconds > 0) {
+      FrameTimings timings;
+      timings.capture_time = captured.capture_time;
+      timings.queue_wait = std::chrono::duration_cast<std::chrono::microseconds>(
+          start - captured.capture_time);
+      timings.detection = std::chrono::duration_cast<std::chrono::microseconds>(
+          detected - start);
+      timings.regions_only = regions_only;
+      // Camera frame poses, as a replay of the dump detects them
+      flight_recorder_.Record(captured.frame, result.observations, timings);
+    }
+    result.poses.SetFromObservations(result.observations,
+                                     captured.capture_time);
+    result.poses.Transform(camera_to_world_);
+    result.frame = std::move(captured.frame);
+    if (!results_.Put(std::move(result))) {
+      break;
+    }
+  }
+  results_.Close();
+}
+
+}  // namespace CameraMarkerServer
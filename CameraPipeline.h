@@ -0,0 +1,137 @@
+#ifndef CAMERA_PIPELINE_H_
+#define CAMERA_PIPELINE_H_
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CalibrationSettings.h"
+#include "CameraDetector.h"
+#include "FlightRecorder.h"
+#include "FramePool.h"
+#include "FrameSource.h"
+#include "Mailbox.h"
+#include "PoseBatch.h"
+#include "RawFrameRecording.h"
+#include "SnapshotCell.h"
+
+namespace CameraMarkerServer {
+struct CameraResult {
+  int camera_index = 0;
+  std::chrono::steady_clock::time_point capture_time;
+  Frame frame;
+  // Camera frame solves, for drawing and the regions of the next frame
+  std::vector<MarkerObservation> observations;
+  // World frame poses, row i from observations[i]
+  PoseBatch poses;
+};
+
+// What detection reads every frame. The control channel replaces it whole,
+// detection picks the new one up with the next frame.
+struct DetectionConfig {
+  std::shared_ptr<const PoseDetector> detector;
+  std::chrono::microseconds frame_period;  // Target period of the server
+};
+
+// Capture and detection for one camera, each on its own thread. Live
+// cameras drop frames the detector has no time for; recorded inputs hand
+// over every frame so that runs are repeatable. When full frame detection
+// does not fit in the frame period, detection is limited to the regions
+// around the markers of the previous frame.
+//
+// Frames are read into buffers of a per camera pool and shared by
+// reference from capture through detection and recording to the preview.
+// A flight recorder, if enabled, keeps the last seconds of detected frames
+// and dumps them when a frame is slow, a marker is lost or the camera
+// stalls.
+//
+// A watchdog thread watches live cameras. When no frame arrives for the
+// stall timeout the camera is reported as tracking lost and reopened in
+// the background while detection keeps waiting for frames. A capture
+// thread stuck in a blocking read is retired rather than waited for; it
+// exits once its read returns.
+//
+// The detection config can be swapped while running. Detection reads it
+// once per frame through a SnapshotCell, without taking a lock.
+class CameraPipeline {
+ public:
+  // Creates the unopened source a reopen switches to.
+  typedef std::function<std::shared_ptr<FrameSource>()> SourceFactory;
+
+  // Capture starts on settings.frameSource. Reopens after a stall use
+  // reopen_source, by default CreateFrameSource on the settings. on_result,
+  // if set, is called on the detect thread after every result handed over.
+  CameraPipeline(int camera_index, const CalibrationSettings& settings,
+                 std::shared_ptr<const DetectionConfig> detection_config,
+                 SourceFactory reopen_source = SourceFactory(),
+                 std::function<void()> on_result = nullptr);
+  ~CameraPipeline();
+  CameraPipeline(const CameraPipeline&) = delete;
+  CameraPipeline& operator=(const CameraPipeline&) = delete;
+
+  void Start();
+  void Stop();
+  // True once a recorded input has ended and its last result was taken.
+  bool IsFinished() const { return results_.IsClosedAndEmpty(); }
+  bool TryTakeResult(CameraResult& result) { return results_.TryTake(result); }
+  // True while a live camera is stalled and being reopened.
+  bool IsTrackingLost() const { return tracking_lost_; }
+
+  const std::string& name() const { return settings_.cameraName; }
+  // Safe to call from any thread while the pipeline runs.
+  void SetDetectionConfig(std::shared_ptr<const DetectionConfig> config) {
+    detection_config_.Publish(std::move(config));
+  }
+  std::shared_ptr<const DetectionConfig> detection_config() const {
+    return detection_config_.Current();
+  }
+  // Frees replaced configs the frame loops no longer read.
+  void ReclaimDetectionConfigs() { detection_config_.Reclaim(); }
+  // Draws with the current detector. Called from one preview thread only.
+  void DrawObservations(cv::Mat& image,
+                        const std::vector<MarkerObservation>& observations) const;
+
+ private:
+  struct CapturedFrame {
+    Frame frame;
+    std::chrono::steady_clock::time_point capture_time;
+  };
+  void CaptureLoop(uint64_t generation, std::shared_ptr<FrameSource> source);
+  void DetectLoop();
+  void WatchdogLoop();
+  void ReopenSource();
+  std::chrono::steady_clock::duration TimeSinceLastFrame() const;
+
+  const int camera_index_;
+  CalibrationSettings settings_;
+  SourceFactory reopen_source_;
+  SnapshotCell<DetectionConfig> detection_config_;
+  const RigidTransform camera_to_world_;
+  std::atomic<bool> running_;
+  // Declared before everything holding frames, so it is destroyed last
+  FramePool frame_pool_;
+  Mailbox<CapturedFrame> frames_;
+  Mailbox<CameraResult> results_;
+  RawFrameRecorder recorder_;
+  FlightRecorder flight_recorder_;
+  std::thread capture_thread_;
+  std::thread detect_thread_;
+  std::thread watchdog_thread_;
+  // Capture threads replaced after a stall, joined on Stop
+  std::vector<std::thread> retired_capture_threads_;
+  // Bumped on every reopen; capture threads of older generations exit
+  std::atomic<uint64_t> capture_generation_;
+  // Held to bump the generation and, by capture threads, to check it and
+  // write the recording, so a retired thread never writes after a reopen
+  std::mutex capture_fence_;
+  std::atomic<int> active_capture_threads_;
+  std::atomic<std::chrono::steady_clock::rep> last_frame_time_;
+  std::atomic<bool> tracking_lost_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // CAMERA_PIPELINE_H_
@@ -1,108 +1,343 @@
 #include "Client.h"
 
+#include <algorithm>
 #include <iostream>
 #include <asio/io_service.hpp>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <optional>
+#include <vector>
 #include "CalibrationSettings.h"
-#include "CameraCalibratationUtils.h"
 #include "CameraDetector.h"
+#include "CameraPipeline.h"
+#include "ControlChannel.h"
+#include "ControlCommands.h"
+#include "FrameScheduler.h"
+#include "FrameSource.h"
+#include "PoseBatch.h"
+#include "PoseEncoding.h"
+#include "PoseFilter.h"
+#include "PoseMerger.h"
+#include "PoseOutput.h"
+#include "SnapshotCell.h"
+#include "ThreadUtils.h"
+#include "Tracing.h"
 #include <opencv2/core.hpp>
 #include <opencv2/core/utility.hpp>
 #include <opencv2/videoio.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 namespace CameraMarkerServer {
 const std::string ADDRESS = "localhost";
 const std::string PORT = "7777";
 const std::string CALIBRATION_SETTINGS_FILE = "Calibration/calibration_settings.xml";
+const std::chrono::seconds STATS_LOG_INTERVAL(10);
+// Tracking lost packets repeat at this interval, UDP may drop the first one
+const std::chrono::seconds STATUS_REPEAT_INTERVAL(1);
+// Longest the unpaced send loop waits for a result before it checks the
+// tracking status and the end of the inputs
+const std::chrono::milliseconds RESULT_WAIT_TIMEOUT(100);
 namespace {
+// The send loop's reader slot of the server config
+const int SEND_READER = 0;
 
+bool SameFilterOptions(const std::optional<PoseFilterOptions>& a,
+                       const std::optional<PoseFilterOptions>& b) {
+  if (!a.has_value() || !b.has_value()) {
+    return a.has_value() == b.has_value();
+  }
+  return a->min_cutoff_hz == b->min_cutoff_hz &&
+         a->translation_beta == b->translation_beta &&
+         a->rotation_beta == b->rotation_beta &&
+         a->derivative_cutoff_hz == b->derivative_cutoff_hz &&
+         a->prediction == b->prediction &&
+         a->max_extrapolation == b->max_extrapolation;
+}
+
+bool SameEncodingOptions(const std::optional<PoseEncodingOptions>& a,
+                         const std::optional<PoseEncodingOptions>& b) {
+  if (!a.has_value() || !b.has_value()) {
+    return a.has_value() == b.has_value();
+  }
+  return a->resolution == b->resolution &&
+         a->delta_min_markers == b->delta_min_markers &&
+         a->keyframe_interval == b->keyframe_interval;
+}
 
-std::optional<CalibrationSettings> ReadCalibrationSettings(
-    const std::string settings_file_path) {
-    CalibrationSettings s;
-    cv::FileStorage fs(settings_file_path,
-                            cv::FileStorage::READ);  // Read the settings
-    if (!fs.isOpened()) {
-        std::cout << "Could not open the configuration file: \""
-                    << settings_file_path << "\"" << std::endl;
-        return std::nullopt;
+// Brings the send loop's state in line with a new config. The filter keeps
+// its state unless its options changed. The encoder restarts with a key
+// packet when the outputs change, so new receivers can decode right away.
+void ApplyServerConfig(const ServerConfig& config, const ServerConfig& applied,
+                       asio::io_service& io_service, FrameScheduler& scheduler,
+                       Outputs& outputs, std::optional<PoseFilter>& filter,
+                       std::optional<PoseEncoder>& encoder) {
+  scheduler.set_period(config.frame_period);
+  if (config.outputs != applied.outputs) {
+    outputs.clear();
+    for (const udp::endpoint& endpoint : config.outputs) {
+      outputs.push_back(std::make_unique<UDPClient>(io_service));
+      outputs.back()->OpenConnection(endpoint);
     }
-    try {
-        fs["Settings"] >> s;
-    } catch (...) {
-        std::cout << "Invalid server settings file" << std::endl;
-        return std::nullopt;
+  }
+  if (!SameFilterOptions(config.filter, applied.filter)) {
+    filter.reset();
+    if (config.filter.has_value()) {
+      filter.emplace(config.filter.value());
+    }
+  }
+  if (!SameEncodingOptions(config.encoding, applied.encoding) ||
+      config.outputs != applied.outputs) {
+    encoder.reset();
+    if (config.encoding.has_value()) {
+      encoder.emplace(config.encoding.value());
     }
-      
-    fs.release();  // close Settings file
-    return s;
+  }
 }
+
+// Wakes the send loop when a camera hands over a result. Recorded inputs
+// are not paced to the frame period, the loop runs as results arrive.
+class ResultSignal {
+ public:
+  void Notify() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ = true;
+    }
+    cv_.notify_one();
+  }
+  // Waits up to timeout for a result handed over since the last wait.
+  void Wait(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, timeout, [this] { return pending_; });
+    pending_ = false;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool pending_ = false;
+};
+
+// Status packets start with "status" where pose packets start with the
+// marker id.
+void SendTrackingStatus(Outputs& outputs, const std::string& camera_name,
+                        bool tracking_lost) {
+  SendToAll(outputs, "status_" + camera_name +
+                         (tracking_lost ? "_tracking_lost" : "_tracking_ok"));
 }
+}  // namespace
 
 bool Client::SetupSocket() {}
 
 void Client::Run() {
   isRunning = true;
   asio::io_service io_service;
-  UDPClient client(io_service);
-  if (!client.OpenConnection(ADDRESS, PORT)) {
+  std::optional<udp::endpoint> default_output =
+      ResolveEndpoint(io_service, ADDRESS, PORT);
+  if (!default_output.has_value()) {
+    std::cout << "Could not resolve " << ADDRESS << ":" << PORT << std::endl;
     return;
   }
   std::cout << "Loading Server settings..." << std::endl;
-  std::optional<CalibrationSettings> optional_settings =
+  std::optional<std::vector<CalibrationSettings>> optional_settings =
       ReadCalibrationSettings(CALIBRATION_SETTINGS_FILE);
-  if (!optional_settings.has_value()) {
-    return;
-  }
-  CalibrationSettings camera_settings = optional_settings.value();
-  if (camera_settings.inputType != CalibrationSettings::InputType::CAMERA) {
-    std::cout << "invalid input type. Only camera is supported." << std::endl;
-    return;
-  }
-  std::optional<cv::aruco::Dictionary> dictionary =
-      CreateArucoDict(camera_settings);
-  if (!dictionary.has_value()) {
-    std::cout << "Could not parse aruco dictionary." << std::endl;
+  if (!optional_settings.has_value() || optional_settings->empty()) {
     return;
   }
+  std::vector<CalibrationSettings>& camera_settings = optional_settings.value();
   std::cout << "Server settings successfully loaded!" << std::endl;
-  std::cout << "Calibrating Camera..." << std::endl;
-  std::optional<CameraParameters> camera_params =
-      CalulateCameraParameters(camera_settings);
-  if (!camera_params.has_value()) {
-    std::cout << "Could not calculate camera calibrations values exiting server"
-              << std::endl;
-    return;
+
+  // Outlives the pipelines, which notify it from their detect threads
+  ResultSignal result_signal;
+  std::vector<std::unique_ptr<CameraPipeline>> pipelines;
+  std::vector<cv::Size> capture_sizes;
+  // With only recorded inputs the loop is not paced to Target_FrameRate;
+  // they hand over every result, so pacing would slow a MAX_SPEED replay
+  // down to the live frame rate
+  bool paced = false;
+  for (size_t i = 0; i < camera_settings.size(); i++) {
+    if (!camera_settings[i].frameSource) {
+      std::cout << "Could not open input \"" << camera_settings[i].input
+                << "\"" << std::endl;
+      return;
+    }
+    capture_sizes.push_back(camera_settings[i].frameSource->FrameSize());
+    std::optional<PoseDetector> detector =
+        CreatePoseDetector(camera_settings[i], capture_sizes[i], true);
+    if (!detector.has_value()) {
+      return;
+    }
+    pipelines.push_back(std::make_unique<CameraPipeline>(
+        (int)i, camera_settings[i],
+        std::make_shared<const DetectionConfig>(DetectionConfig{
+            std::make_shared<const PoseDetector>(detector.value()),
+            camera_settings[i].framePeriod()}),
+        CameraPipeline::SourceFactory(),
+        [&result_signal]() { result_signal.Notify(); }));
+    paced = paced || camera_settings[i].isLiveInput();
   }
 
-  std::cout << "Camera successfully calibrated!" << std::endl;
- 
-  PoseDetector detector(camera_settings.poseMarkerSize,
-                        dictionary.value(),
-                        cv::aruco::DetectorParameters(), camera_params.value());
+  const CalibrationSettings& server_settings = camera_settings.front();
+  PoseMerger merger(std::chrono::milliseconds(server_settings.mergeMaxAgeMs));
+  std::vector<std::optional<CameraResult>> latest_results(pipelines.size());
+  // Copies of the frames the preview draws on, allocated once per camera
+  std::vector<cv::Mat> preview_images(pipelines.size());
+  ServerConfig initial_config =
+      MakeServerConfig(server_settings, {default_output.value()});
+  initial_config.version = 1;
+  SnapshotCell<ServerConfig> server_config(
+      std::make_shared<const ServerConfig>(initial_config), 1);
+  // The send loop's own state, brought in line with each new config
+  ServerConfig applied_config;
+  FrameScheduler scheduler(server_settings.framePeriod());
+  Outputs outputs;
+  std::optional<PoseFilter> filter;
+  // Reused every frame, they keep their allocation
+  PoseBatch merged_poses;
+  PoseBatch filtered_poses;
+  std::optional<PoseEncoder> encoder;
+  std::vector<bool> reported_lost(pipelines.size(), false);
+  std::vector<std::chrono::steady_clock::time_point> last_status_time(
+      pipelines.size());
+  std::chrono::steady_clock::time_point last_stats_time =
+      std::chrono::steady_clock::now();
   const char ESC_KEY = 27;
-  std::cout << "Running pose estimation..." << std::endl;
-  
+  std::cout << "Running pose estimation on " << pipelines.size()
+            << " camera(s)..." << std::endl;
+  for (std::unique_ptr<CameraPipeline>& pipeline : pipelines) {
+    pipeline->Start();
+  }
+  ControlCommands control_commands(CALIBRATION_SETTINGS_FILE, camera_settings,
+                                   capture_sizes, pipelines, server_config);
+  SetTracingEnabled(server_settings.traceEnabled);
+  std::unique_ptr<ControlChannel> control_channel;
+  if (server_settings.controlPort > 0) {
+    control_channel = std::make_unique<ControlChannel>(
+        server_settings.controlPort,
+        [&control_commands](const std::vector<std::string>& words) {
+          return control_commands.Handle(words);
+        });
+    // The server runs on without it
+    control_channel->Start();
+  }
+  // This thread merges the camera results and sends the poses
+  ConfigureCurrentThread("send", MakeThreadOptions(server_settings.threadSendCpus,
+                                                   server_settings.threadRealtime));
+
   while (isRunning) {
-    cv::Mat frame;
-    camera_settings.inputCapture.read(frame);
+    if (paced) {
+      scheduler.WaitForNextFrame();
+    } else {
+      result_signal.Wait(RESULT_WAIT_TIMEOUT);
+    }
+    std::chrono::steady_clock::time_point work_start =
+        std::chrono::steady_clock::now();
+    {
+      SnapshotCell<ServerConfig>::ReadGuard config =
+          server_config.Read(SEND_READER);
+      if (config->version != applied_config.version) {
+        ApplyServerConfig(*config, applied_config, io_service, scheduler,
+                          outputs, filter, encoder);
+        applied_config = *config;
+      }
+    }
+    // The preview is the first thing to go when the loop runs over budget
+    const bool show_preview =
+        server_settings.showPreview && !scheduler.IsOverBudget();
+    bool has_new_results = false;
+    bool all_finished = true;
+    for (size_t i = 0; i < pipelines.size(); i++) {
+      CameraResult result;
+      if (pipelines[i]->TryTakeResult(result)) {
+        // The send loop's spans carry the camera frame they handle, the
+        // newest one when several cameras deliver
+        TRACE_FRAME(result.frame.index);
+        if (show_preview) {
+          TRACE_SPAN("preview");
+          // Drawn on a copy, the pooled frame is still shared with the
+          // recorders and must stay as captured
+          const cv::Mat& frame = result.frame.image;
+          if (frame.channels() == 1) {
+            cv::cvtColor(frame, preview_images[i], cv::COLOR_GRAY2BGR);
+          } else {
+            frame.copyTo(preview_images[i]);
+          }
+          pipelines[i]->DrawObservations(preview_images[i],
+                                         result.observations);
+          cv::imshow("CameraServer " + pipelines[i]->name(), preview_images[i]);
+        }
+        latest_results[i] = std::move(result);
+        has_new_results = true;
+      }
+      all_finished = all_finished && pipelines[i]->IsFinished();
+    }
 
-    std::optional<Pose> pose_optional = detector.DetectPose(frame, true);
-    if (pose_optional.has_value()) {
-      Pose pose = pose_optional.value();
-      std::ostringstream os;
-      os << pose.forward << "_" << pose.up << "_" << pose.translation;
-      client.Send(os.str());
-      std::cout << os.str() << std::endl;
+    for (size_t i = 0; i < pipelines.size(); i++) {
+      const bool lost = pipelines[i]->IsTrackingLost();
+      if (lost != reported_lost[i] ||
+          (lost && work_start - last_status_time[i] > STATUS_REPEAT_INTERVAL)) {
+        SendTrackingStatus(outputs, pipelines[i]->name(), lost);
+        reported_lost[i] = lost;
+        last_status_time[i] = work_start;
+      }
     }
-    char key = cv::waitKey(camera_settings.delay);
-    if (key == ESC_KEY) {
+
+    if (has_new_results) {
+      TRACE_SPAN("track");
+      merger.Merge(latest_results, std::chrono::steady_clock::now(),
+                   merged_poses);
+      if (filter.has_value()) {
+        filter->Update(merged_poses);
+      } else {
+        SendPoses(outputs, encoder, applied_config.text_version, merged_poses);
+      }
+    }
+    // Filtered poses go out every frame, predicted to the send time
+    if (filter.has_value()) {
+      TRACE_SPAN("track");
+      filter->Predict(std::chrono::steady_clock::now(), filtered_poses);
+      SendPoses(outputs, encoder, applied_config.text_version, filtered_poses);
+    }
+    FlushPoses(outputs, encoder);
+    if (show_preview) {
+      // Pumps the HighGUI event loop; without a window there is nothing to
+      // wait for.
+      TRACE_SPAN("preview");
+      char key = cv::waitKey(1);
+      if (key == ESC_KEY) {
+        isRunning = false;
+      }
+    }
+    if (all_finished) {
       isRunning = false;
     }
-    
-    //std::cout << "Hello!" << std::endl;
+    scheduler.RecordWork(std::chrono::steady_clock::now() - work_start);
+
+    if (paced && std::chrono::steady_clock::now() - last_stats_time >
+                     STATS_LOG_INTERVAL) {
+      JitterStats stats = scheduler.jitter_stats();
+      std::cout << "Frames: " << stats.frames
+                << " missed deadlines: " << stats.missed_deadlines
+                << " lateness mean/stddev/max (us): " << stats.mean_lateness_us
+                << "/" << stats.stddev_lateness_us << "/"
+                << stats.max_lateness_us << " budget used: "
+                << scheduler.budget_usage() * 100 << "%" << std::endl;
+      scheduler.ResetJitterStats();
+      last_stats_time = std::chrono::steady_clock::now();
+    }
+  }
+  // The control commands reach into the pipelines, so they stop first
+  if (control_channel) {
+    control_channel->Stop();
+  }
+  for (std::unique_ptr<CameraPipeline>& pipeline : pipelines) {
+    pipeline->Stop();
+  }
+  if (IsTracingEnabled()) {
+    WriteChromeTrace(server_settings.traceOutputFile);
   }
 }
 }  // namespace CameraMarkerServer
@@ -0,0 +1,93 @@
+#include "ControlChannel.h"
+#include <array>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include "ThreadUtils.h"
+
+namespace CameraMarkerServer {
+namespace {
+const std::chrono::milliseconds COMMAND_POLL_INTERVAL(50);
+const size_t MAX_COMMAND_SIZE = 1024;
+
+std::vector<std::string> SplitWords(const std::string& line) {
+  std::vector<std::string> words;
+  std::istringstream is(line);
+  std::string word;
+  while (is >> word) {
+    words.push_back(word);
+  }
+  return words;
+}
+}  // namespace
+
+ControlChannel::ControlChannel(int port, Handler handler)
+    : port_(port),
+      handler_(std::move(handler)),
+      socket_(io_service_),
+      running_(false) {}
+
+ControlChannel::~ControlChannel() { Stop(); }
+
+bool ControlChannel::Start() {
+  using asio::ip::udp;
+  asio::error_code error;
+  socket_.open(udp::v4(), error);
+  if (!error) {
+    socket_.bind(udp::endpoint(asio::ip::address_v4::loopback(),
+                               (unsigned short)port_),
+                 error);
+  }
+  // Polled, so Stop does not have to interrupt a blocking receive
+  if (!error) {
+    socket_.non_blocking(true, error);
+  }
+  if (error) {
+    std::cout << "Could not open the control port " << port_ << ": "
+              << error.message() << std::endl;
+    socket_.close(error);
+    return false;
+  }
+  std::cout << "Listening for control commands on 127.0.0.1:" << port_
+            << std::endl;
+  running_ = true;
+  thread_ = std::thread(&ControlChannel::Loop, this);
+  return true;
+}
+
+void ControlChannel::Stop() {
+  running_ = false;
+  if (thread_.joinable()) thread_.join();
+  asio::error_code error;
+  socket_.close(error);
+}
+
+void ControlChannel::Loop() {
+  SetCurrentThreadName("control");
+  std::array<char, MAX_COMMAND_SIZE> buffer;
+  while (running_) {
+    asio::ip::udp::endpoint sender;
+    asio::error_code error;
+    const size_t size =
+        socket_.receive_from(asio::buffer(buffer), sender, 0, error);
+    if (error == asio::error::would_block) {
+      std::this_thread::sleep_for(COMMAND_POLL_INTERVAL);
+      continue;
+    }
+    if (error) {
+      continue;
+    }
+    const std::string line(buffer.data(), size);
+    const std::vector<std::string> words = SplitWords(line);
+    if (words.empty()) {
+      continue;
+    }
+    std::cout << "Control command: " << line << std::endl;
+    const std::string reply = handler_(words);
+    std::cout << "Control reply: " << reply << std::endl;
+    socket_.send_to(asio::buffer(reply), sender, 0, error);
+  }
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,43 @@
+#ifndef CONTROL_CHANNEL_H_
+#define CONTROL_CHANNEL_H_
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <asio/io_service.hpp>
+#include <asio/ip/udp.hpp>
+
+namespace CameraMarkerServer {
+// Local command socket of a running server. Every datagram sent to
+// 127.0.0.1 on the control port is one command line; its words go to the
+// handler on the channel's own thread and the handler's reply is sent back
+// to the sender. Only loopback is bound, the channel is not reachable from
+// the network.
+class ControlChannel {
+ public:
+  using Handler =
+      std::function<std::string(const std::vector<std::string>& words)>;
+
+  ControlChannel(int port, Handler handler);
+  ~ControlChannel();
+  ControlChannel(const ControlChannel&) = delete;
+  ControlChannel& operator=(const ControlChannel&) = delete;
+
+  // Returns false if the port cannot be bound.
+  bool Start();
+  void Stop();
+
+ private:
+  void Loop();
+
+  const int port_;
+  const Handler handler_;
+  asio::io_service io_service_;
+  asio::ip::udp::socket socket_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // CONTROL_CHANNEL_H_
@@ -0,0 +1,336 @@
+#include "ControlCommands.h"
+#include <algorithm>
+#include <sstream>
+#include <utility>
+#include "Tracing.h"
+
+namespace CameraMarkerServer {
+namespace {
+PoseFilterOptions FilterOptions(const CalibrationSettings& s) {
+  PoseFilterOptions options;
+  options.min_cutoff_hz = s.filterMinCutoffHz;
+  options.translation_beta = s.filterTranslationBeta;
+  options.rotation_beta = s.filterRotationBeta;
+  options.derivative_cutoff_hz = s.filterDerivativeCutoffHz;
+  options.prediction =
+      std::chrono::microseconds((int64_t)(s.filterPredictionMs * 1000));
+  options.max_extrapolation =
+      std::chrono::microseconds((int64_t)(s.filterMaxExtrapolationMs * 1000));
+  return options;
+}
+
+PoseEncodingOptions EncodingOptions(const CalibrationSettings& s) {
+  PoseEncodingOptions options;
+  options.resolution = s.encodingResolution;
+  options.delta_min_markers = s.encodingDeltaMinMarkers;
+  options.keyframe_interval = s.encodingKeyframeInterval;
+  return options;
+}
+
+// Adds the settings that differ between running and reread but that the
+// running server only reads at startup, each name once.
+void AddRestartOnlyChanges(const CalibrationSettings& running,
+                           const CalibrationSettings& reread,
+                           std::vector<std::string>& changed) {
+  const std::pair<const char*, bool> settings[] = {
+      {"Show_Preview", running.showPreview != reread.showPreview},
+      {"Roi_FullFrameInterval",
+       running.roiFullFrameInterval != reread.roiFullFrameInterval},
+      {"Governor_Enabled", running.governorEnabled != reread.governorEnabled},
+      {"Governor_TargetMs",
+       running.governorTargetMs != reread.governorTargetMs},
+      {"Governor_StepDownFrames",
+       running.governorStepDownFrames != reread.governorStepDownFrames},
+      {"Governor_StepUpFrames",
+       running.governorStepUpFrames != reread.governorStepUpFrames},
+      {"Governor_Headroom",
+       running.governorHeadroom != reread.governorHeadroom},
+      {"Input_ReplayMode", running.replayMode != reread.replayMode},
+      {"Capture_Width", running.captureWidth != reread.captureWidth},
+      {"Capture_Height", running.captureHeight != reread.captureHeight},
+      {"Capture_FPS", running.captureFps != reread.captureFps},
+      {"Capture_FourCC", running.captureFourcc != reread.captureFourcc},
+      {"Capture_BufferSize",
+       running.captureBufferSize != reread.captureBufferSize},
+      {"Capture_Grayscale",
+       running.captureGrayscale != reread.captureGrayscale},
+      {"Record_OutputFileName",
+       running.recordFileName != reread.recordFileName},
+      {"Camera_Name", running.cameraName != reread.cameraName},
+      {"Camera_To_World", running.cameraToWorld != reread.cameraToWorld},
+      {"Merge_MaxAgeMs", running.mergeMaxAgeMs != reread.mergeMaxAgeMs},
+      {"Thread_CaptureCpus",
+       running.threadCaptureCpus != reread.threadCaptureCpus},
+      {"Thread_DetectCpus",
+       running.threadDetectCpus != reread.threadDetectCpus},
+      {"Thread_SendCpus", running.threadSendCpus != reread.threadSendCpus},
+      {"Thread_RealTime", running.threadRealtime != reread.threadRealtime},
+      {"Watchdog_StallMs", running.watchdogStallMs != reread.watchdogStallMs},
+      {"Watchdog_ReopenIntervalMs",
+       running.watchdogReopenIntervalMs != reread.watchdogReopenIntervalMs},
+      {"Fault_Mode", running.faultMode != reread.faultMode},
+      {"Fault_StallAfterFrames",
+       running.faultStallAfterFrames != reread.faultStallAfterFrames},
+      {"Fault_StallMs", running.faultStallMs != reread.faultStallMs},
+      {"Control_Port", running.controlPort != reread.controlPort},
+      {"Trace_Enabled", running.traceEnabled != reread.traceEnabled},
+      {"FlightRecorder_Seconds",
+       running.flightRecorderSeconds != reread.flightRecorderSeconds},
+      {"FlightRecorder_Scale",
+       running.flightRecorderScale != reread.flightRecorderScale},
+      {"FlightRecorder_Quality",
+       running.flightRecorderQuality != reread.flightRecorderQuality},
+      {"FlightRecorder_FrameTimeMs",
+       running.flightRecorderFrameTimeMs != reread.flightRecorderFrameTimeMs},
+      {"FlightRecorder_MarkerLostMs",
+       running.flightRecorderMarkerLostMs != reread.flightRecorderMarkerLostMs},
+      {"FlightRecorder_Directory",
+       running.flightRecorderDirectory != reread.flightRecorderDirectory}};
+  for (const std::pair<const char*, bool>& setting : settings) {
+    if (setting.second && std::find(changed.begin(), changed.end(),
+                                    setting.first) == changed.end()) {
+      changed.push_back(setting.first);
+    }
+  }
+}
+}  // namespace
+
+ServerConfig MakeServerConfig(const CalibrationSettings& s,
+                              const std::vector<udp::endpoint>& outputs) {
+  ServerConfig config;
+  config.frame_period = s.framePeriod();
+  config.outputs = outputs;
+  if (s.filterEnabled) {
+    config.filter = FilterOptions(s);
+  }
+  if (s.encodingMode == "QUANTIZED") {
+    config.encoding = EncodingOptions(s);
+  }
+  config.text_version = s.encodingTextVersion;
+  return config;
+}
+
+ControlCommands::ControlCommands(
+    const std::string& settings_file,
+    const std::vector<CalibrationSettings>& camera_settings,
+    const std::vector<cv::Size>& capture_sizes,
+    std::vector<std::unique_ptr<CameraPipeline>>& pipelines,
+    SnapshotCell<ServerConfig>& server_config)
+    : settings_file_(settings_file),
+      startup_settings_(camera_settings),
+      camera_settings_(camera_settings),
+      capture_sizes_(capture_sizes),
+      pipelines_(pipelines),
+      server_config_(server_config) {}
+
+std::string ControlCommands::Handle(const std::vector<std::string>& words) {
+  const std::string reply = Dispatch(words);
+  // Snapshots a frame loop still held while they were replaced are only
+  // freed by a later publish; commands are rare, so free them here.
+  server_config_.Reclaim();
+  for (std::unique_ptr<CameraPipeline>& pipeline : pipelines_) {
+    pipeline->ReclaimDetectionConfigs();
+  }
+  return reply;
+}
+
+std::string ControlCommands::Dispatch(const std::vector<std::string>& words) {
+  const std::string& command = words[0];
+  if (command == "reload" && words.size() == 1) {
+    return Reload();
+  }
+  if (command == "detector_params" && words.size() == 2) {
+    return SwapDetectorParameters(words[1]);
+  }
+  if (command == "rate" && words.size() == 2) {
+    return SetRate(words[1]);
+  }
+  if (command == "add_output" && words.size() == 3) {
+    return AddOutput(words[1], words[2]);
+  }
+  if (command == "remove_output" && words.size() == 3) {
+    return RemoveOutput(words[1], words[2]);
+  }
+  if (command == "recalibrate" && words.size() == 2) {
+    return Recalibrate(words[1]);
+  }
+  if (command == "trace" && words.size() == 2 &&
+      (words[1] == "on" || words[1] == "off")) {
+    SetTracingEnabled(words[1] == "on");
+    return "ok";
+  }
+  if (command == "trace_dump" && words.size() <= 2) {
+    const std::string file = words.size() == 2
+                                 ? words[1]
+                                 : camera_settings_.front().traceOutputFile;
+    return WriteChromeTrace(file) ? "ok"
+                                  : "error: could not write " + file;
+  }
+  return "error: unknown command or wrong arguments";
+}
+
+std::string ControlCommands::Reload() {
+  std::optional<std::vector<CalibrationSettings>> reread =
+      ReadCalibrationSettings(settings_file_, false);
+  if (!reread.has_value()) {
+    return "error: could not read " + settings_file_;
+  }
+  if (reread->size() != camera_settings_.size()) {
+    return "error: the number of cameras changed, restart to apply";
+  }
+  for (size_t i = 0; i < reread->size(); i++) {
+    const CalibrationSettings& s = (*reread)[i];
+    if (!s.goodInput || !s.objectsGood) {
+      return "error: invalid settings for " + s.cameraName;
+    }
+    if (s.input != camera_settings_[i].input) {
+      return "error: the input of " + s.cameraName +
+             " changed, restart to apply";
+    }
+  }
+  std::vector<std::shared_ptr<const PoseDetector>> detectors;
+  if (!BuildDetectors(reread.value(), detectors)) {
+    return "error: could not build the detectors";
+  }
+  // Compared with the startup values, so a later reload still names them
+  std::vector<std::string> restart_only;
+  for (size_t i = 0; i < reread->size(); i++) {
+    AddRestartOnlyChanges(startup_settings_[i], (*reread)[i], restart_only);
+  }
+  camera_settings_ = reread.value();
+  PublishDetectors(detectors);
+  PublishServerConfig(MakeServerConfig(camera_settings_.front(),
+                                       server_config_.Current()->outputs));
+  if (restart_only.empty()) {
+    return "ok";
+  }
+  std::string reply = "ok, restart to apply";
+  for (const std::string& name : restart_only) {
+    reply += " " + name;
+  }
+  return reply;
+}
+
+std::string ControlCommands::SwapDetectorParameters(const std::string& file) {
+  if (!LoadDetectorParameters(file).has_value()) {
+    return "error: could not read detector parameters from " + file;
+  }
+  std::vector<CalibrationSettings> changed = camera_settings_;
+  for (CalibrationSettings& s : changed) {
+    s.detectorParamsFile = file;
+  }
+  std::vector<std::shared_ptr<const PoseDetector>> detectors;
+  if (!BuildDetectors(changed, detectors)) {
+    return "error: could not build the detectors";
+  }
+  camera_settings_ = changed;
+  PublishDetectors(detectors);
+  return "ok";
+}
+
+std::string ControlCommands::SetRate(const std::string& rate) {
+  double fps = 0;
+  std::istringstream is(rate);
+  if (!(is >> fps) || !(fps > 0)) {
+    return "error: invalid rate " + rate;
+  }
+  for (size_t i = 0; i < camera_settings_.size(); i++) {
+    camera_settings_[i].targetFrameRate = fps;
+    DetectionConfig config = *pipelines_[i]->detection_config();
+    config.frame_period = camera_settings_[i].framePeriod();
+    pipelines_[i]->SetDetectionConfig(
+        std::make_shared<const DetectionConfig>(config));
+  }
+  ServerConfig config = *server_config_.Current();
+  config.frame_period = camera_settings_.front().framePeriod();
+  PublishServerConfig(config);
+  return "ok";
+}
+
+std::string ControlCommands::AddOutput(const std::string& host,
+                                       const std::string& port) {
+  std::optional<udp::endpoint> endpoint =
+      ResolveEndpoint(io_service_, host, port);
+  if (!endpoint.has_value()) {
+    return "error: could not resolve " + host + ":" + port;
+  }
+  ServerConfig config = *server_config_.Current();
+  if (std::find(config.outputs.begin(), config.outputs.end(),
+                endpoint.value()) != config.outputs.end()) {
+    return "error: already sending to " + host + ":" + port;
+  }
+  config.outputs.push_back(endpoint.value());
+  PublishServerConfig(config);
+  return "ok";
+}
+
+std::string ControlCommands::RemoveOutput(const std::string& host,
+                                          const std::string& port) {
+  std::optional<udp::endpoint> endpoint =
+      ResolveEndpoint(io_service_, host, port);
+  ServerConfig config = *server_config_.Current();
+  std::vector<udp::endpoint>::iterator it =
+      endpoint.has_value() ? std::find(config.outputs.begin(),
+                                       config.outputs.end(), endpoint.value())
+                           : config.outputs.end();
+  if (it == config.outputs.end()) {
+    return "error: not sending to " + host + ":" + port;
+  }
+  config.outputs.erase(it);
+  PublishServerConfig(config);
+  return "ok";
+}
+
+// Calibrating needs the board shown to the camera and an interactive
+// window, which a running server cannot offer. This picks up a calibration
+// redone with the calibration tool and rebuilds the camera's undistortion.
+std::string ControlCommands::Recalibrate(const std::string& camera_name) {
+  for (size_t i = 0; i < camera_settings_.size(); i++) {
+    if (camera_settings_[i].cameraName != camera_name) {
+      continue;
+    }
+    std::optional<PoseDetector> detector =
+        CreatePoseDetector(camera_settings_[i], capture_sizes_[i], false);
+    if (!detector.has_value()) {
+      return "error: could not load the calibration of " + camera_name;
+    }
+    DetectionConfig config = *pipelines_[i]->detection_config();
+    config.detector = std::make_shared<const PoseDetector>(detector.value());
+    pipelines_[i]->SetDetectionConfig(
+        std::make_shared<const DetectionConfig>(config));
+    return "ok";
+  }
+  return "error: no camera named " + camera_name;
+}
+
+bool ControlCommands::BuildDetectors(
+    std::vector<CalibrationSettings>& settings,
+    std::vector<std::shared_ptr<const PoseDetector>>& detectors) {
+  detectors.clear();
+  for (size_t i = 0; i < settings.size(); i++) {
+    std::optional<PoseDetector> detector =
+        CreatePoseDetector(settings[i], capture_sizes_[i], false);
+    if (!detector.has_value()) {
+      return false;
+    }
+    detectors.push_back(
+        std::make_shared<const PoseDetector>(detector.value()));
+  }
+  return true;
+}
+
+void ControlCommands::PublishDetectors(
+    const std::vector<std::shared_ptr<const PoseDetector>>& detectors) {
+  for (size_t i = 0; i < detectors.size(); i++) {
+    pipelines_[i]->SetDetectionConfig(
+        std::make_shared<const DetectionConfig>(DetectionConfig{
+            detectors[i], camera_settings_[i].framePeriod()}));
+  }
+}
+
+void ControlCommands::PublishServerConfig(ServerConfig config) {
+  config.version = server_config_.Current()->version + 1;
+  server_config_.Publish(std::make_shared<const ServerConfig>(config));
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,82 @@
+#ifndef CONTROL_COMMANDS_H_
+#define CONTROL_COMMANDS_H_
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <asio/io_service.hpp>
+#include <opencv2/core.hpp>
+#include "CalibrationSettings.h"
+#include "CameraDetector.h"
+#include "CameraPipeline.h"
+#include "PoseEncoding.h"
+#include "PoseFilter.h"
+#include "PoseOutput.h"
+#include "SnapshotCell.h"
+#include "UdpServerConnection.h"
+
+namespace CameraMarkerServer {
+// What the send loop applies, replaced whole by control commands.
+struct ServerConfig {
+  uint64_t version = 0;  // Bumped on every publish
+  std::chrono::microseconds frame_period{0};
+  std::vector<udp::endpoint> outputs;
+  std::optional<PoseFilterOptions> filter;
+  std::optional<PoseEncodingOptions> encoding;
+  int text_version = MAX_TEXT_VERSION;  // Of text packets, see PoseOutput.h
+};
+
+// The parts of the settings the send loop applies.
+ServerConfig MakeServerConfig(const CalibrationSettings& s,
+                              const std::vector<udp::endpoint>& outputs);
+
+// Applies control commands on the control channel's thread. It keeps its
+// own copy of the settings and builds every change in full before
+// publishing it, so the frame loops only ever see complete snapshots and a
+// failed command changes nothing.
+//
+// Commands: reload, detector_params <file>, rate <fps>,
+// add_output <host> <port>, remove_output <host> <port>,
+// recalibrate <camera>, trace on|off and trace_dump [file].
+class ControlCommands {
+ public:
+  ControlCommands(const std::string& settings_file,
+                  const std::vector<CalibrationSettings>& camera_settings,
+                  const std::vector<cv::Size>& capture_sizes,
+                  std::vector<std::unique_ptr<CameraPipeline>>& pipelines,
+                  SnapshotCell<ServerConfig>& server_config);
+
+  // Returns the reply, "ok" or "error: " and the reason. A reload that
+  // changes settings only read at startup still applies the rest and
+  // answers "ok, restart to apply" followed by their names.
+  std::string Handle(const std::vector<std::string>& words);
+
+ private:
+  std::string Dispatch(const std::vector<std::string>& words);
+  std::string Reload();
+  std::string SwapDetectorParameters(const std::string& file);
+  std::string SetRate(const std::string& rate);
+  std::string AddOutput(const std::string& host, const std::string& port);
+  std::string RemoveOutput(const std::string& host, const std::string& port);
+  std::string Recalibrate(const std::string& camera_name);
+  bool BuildDetectors(
+      std::vector<CalibrationSettings>& settings,
+      std::vector<std::shared_ptr<const PoseDetector>>& detectors);
+  void PublishDetectors(
+      const std::vector<std::shared_ptr<const PoseDetector>>& detectors);
+  void PublishServerConfig(ServerConfig config);
+
+  const std::string settings_file_;
+  // As the server started, for settings it never reapplies
+  const std::vector<CalibrationSettings> startup_settings_;
+  std::vector<CalibrationSettings> camera_settings_;
+  const std::vector<cv::Size> capture_sizes_;
+  std::vector<std::unique_ptr<CameraPipeline>>& pipelines_;
+  SnapshotCell<ServerConfig>& server_config_;
+  asio::io_service io_service_;  // For resolving outputs
+};
+
+}  // namespace CameraMarkerServer
+#endif  // CONTROL_COMMANDS_H_
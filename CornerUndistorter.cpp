@@ -0,0 +1,54 @@
+#include "CornerUndistorter.h"
+#include <algorithm>
+#include <cmath>
+#include <opencv2/calib3d.hpp>
+
+namespace CameraMarkerServer {
+
+CornerUndistorter::CornerUndistorter(const CameraParameters& camera_parameters,
+                                     const cv::Size& image_size)
+    : image_size_(image_size) {
+  std::vector<cv::Point2f> pixels;
+  pixels.reserve((size_t)image_size.area());
+  for (int y = 0; y < image_size.height; y++) {
+    for (int x = 0; x < image_size.width; x++) {
+      pixels.emplace_back((float)x, (float)y);
+    }
+  }
+  if (camera_parameters.fisheye) {
+    cv::fisheye::undistortPoints(pixels, table_,
+                                 camera_parameters.insintric_camera_parms,
+                                 camera_parameters.distortion_mat);
+  } else {
+    // Paid once, so the inversion can afford more iterations than the
+    // per solve default.
+    cv::undistortPoints(
+        pixels, table_, camera_parameters.insintric_camera_parms,
+        camera_parameters.distortion_mat, cv::noArray(), cv::noArray(),
+        cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20,
+                         1e-9));
+  }
+}
+
+void CornerUndistorter::Undistort(const std::vector<cv::Point2f>& pixels,
+                                  std::vector<cv::Point2f>& normalized) const {
+  normalized.resize(pixels.size());
+  const int width = image_size_.width;
+  const float max_x = (float)(image_size_.width - 1);
+  const float max_y = (float)(image_size_.height - 1);
+  for (size_t i = 0; i < pixels.size(); i++) {
+    // Sub pixel corners may sit slightly outside the frame
+    const float x = std::min(std::max(pixels[i].x, 0.f), max_x);
+    const float y = std::min(std::max(pixels[i].y, 0.f), max_y);
+    const int x0 = std::min((int)x, width - 2);
+    const int y0 = std::min((int)y, image_size_.height - 2);
+    const float fx = x - x0;
+    const float fy = y - y0;
+    const cv::Point2f* row0 = &table_[(size_t)y0 * width + x0];
+    const cv::Point2f* row1 = row0 + width;
+    normalized[i] = (row0[0] * (1.f - fx) + row0[1] * fx) * (1.f - fy) +
+                    (row1[0] * (1.f - fx) + row1[1] * fx) * fy;
+  }
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,29 @@
+#ifndef CORNER_UNDISTORTER_H_
+#define CORNER_UNDISTORTER_H_
+#include <vector>
+#include <opencv2/core.hpp>
+#include "CameraCalibratationUtils.h"
+
+namespace CameraMarkerServer {
+// Maps distorted pixel coordinates to normalized camera coordinates
+// (x/z, y/z) through a lookup table built once for every pixel of the
+// frame. Both the pinhole and the fisheye distortion model are inverted
+// while building the table, so per frame undistortion is a bilinear lookup
+// and PnP can be solved with an identity camera matrix and no distortion.
+class CornerUndistorter {
+ public:
+  CornerUndistorter(const CameraParameters& camera_parameters,
+                    const cv::Size& image_size);
+
+  void Undistort(const std::vector<cv::Point2f>& pixels,
+                 std::vector<cv::Point2f>& normalized) const;
+
+  const cv::Size& image_size() const { return image_size_; }
+
+ private:
+  cv::Size image_size_;
+  std::vector<cv::Point2f> table_;  // Row major, one entry per pixel
+};
+
+}  // namespace CameraMarkerServer
+#endif  // CORNER_UNDISTORTER_H_
@@ -0,0 +1,138 @@
+#include "DetectionMask.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "CalibrationSettings.h"
+
+namespace CameraMarkerServer {
+namespace {
+// Polygons drawn on a frame of another aspect ratio would be stretched
+const double MAX_ASPECT_DIFFERENCE = 0.01;
+
+// Grows overlapping rectangles into their union until none overlap, so no
+// pixel is searched twice.
+void MergeOverlapping(std::vector<cv::Rect>& rects) {
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (size_t i = 0; i < rects.size() && !merged; i++) {
+      for (size_t j = i + 1; j < rects.size(); j++) {
+        if ((rects[i] & rects[j]).area() > 0) {
+          rects[i] |= rects[j];
+          rects.erase(rects.begin() + j);
+          merged = true;
+          break;
+        }
+      }
+    }
+  }
+}
+}  // namespace
+
+std::optional<DetectionMask> DetectionMask::Create(
+    const DetectionMaskOptions& options, const cv::Size& frame_size) {
+  DetectionMask mask;
+  mask.frame_size_ = frame_size;
+  mask.mask_ = cv::Mat::zeros(frame_size, CV_8UC1);
+  if (!options.image_file.empty()) {
+    cv::Mat painted = cv::imread(options.image_file, cv::IMREAD_GRAYSCALE);
+    if (painted.empty()) {
+      std::cout << "Could not read mask image \"" << options.image_file << "\""
+                << std::endl;
+      return std::nullopt;
+    }
+    cv::resize(painted, painted, frame_size, 0, 0, cv::INTER_NEAREST);
+    cv::threshold(painted, mask.mask_, 0, 255, cv::THRESH_BINARY);
+  }
+  double sx = 1;
+  double sy = 1;
+  if (!options.polygons.empty() && options.polygon_frame_size.area() > 0) {
+    sx = (double)frame_size.width / options.polygon_frame_size.width;
+    sy = (double)frame_size.height / options.polygon_frame_size.height;
+    if (std::abs(sx - sy) > MAX_ASPECT_DIFFERENCE * std::max(sx, sy)) {
+      std::cout << "Mask polygons drawn on " << options.polygon_frame_size
+                << " do not fit the aspect ratio of " << frame_size
+                << " frames" << std::endl;
+      return std::nullopt;
+    }
+  }
+  std::vector<std::vector<cv::Point>> polygons;
+  for (const std::vector<int>& flat : options.polygons) {
+    std::vector<cv::Point> polygon;
+    for (size_t i = 0; i + 1 < flat.size(); i += 2) {
+      polygon.push_back(cv::Point(cvRound(flat[i] * sx),
+                                  cvRound(flat[i + 1] * sy)));
+    }
+    polygons.push_back(polygon);
+  }
+  if (!polygons.empty()) {
+    cv::fillPoly(mask.mask_, polygons, cv::Scalar(255));
+  }
+
+  cv::Mat labels;
+  cv::Mat stats;
+  cv::Mat centroids;
+  const int count =
+      cv::connectedComponentsWithStats(mask.mask_, labels, stats, centroids);
+  const cv::Rect frame_rect(cv::Point(0, 0), frame_size);
+  // Label 0 is the inactive background
+  for (int label = 1; label < count; label++) {
+    cv::Rect area(stats.at<int>(label, cv::CC_STAT_LEFT),
+                  stats.at<int>(label, cv::CC_STAT_TOP),
+                  stats.at<int>(label, cv::CC_STAT_WIDTH),
+                  stats.at<int>(label, cv::CC_STAT_HEIGHT));
+    area -= cv::Point(options.margin, options.margin);
+    area += cv::Size(2 * options.margin, 2 * options.margin);
+    mask.regions_.push_back(area & frame_rect);
+  }
+  MergeOverlapping(mask.regions_);
+  if (mask.regions_.empty()) {
+    std::cout << "Detection mask has no active area, no markers will be found"
+              << std::endl;
+  }
+  return mask;
+}
+
+// static
+bool DetectionMask::FromSettings(const CalibrationSettings& settings,
+                                 const cv::Size& frame_size,
+                                 std::shared_ptr<const DetectionMask>& mask) {
+  mask.reset();
+  DetectionMaskOptions options;
+  options.image_file = settings.maskImageFile;
+  options.polygons = settings.maskPolygons;
+  options.polygon_frame_size =
+      cv::Size(settings.maskPolygonWidth, settings.maskPolygonHeight);
+  options.margin = settings.maskMargin;
+  if (!options.IsEnabled()) {
+    return true;
+  }
+  std::optional<DetectionMask> created = Create(options, frame_size);
+  if (!created.has_value()) {
+    return false;
+  }
+  std::cout << "Detection mask leaves " << created->SearchedFraction() * 100
+            << "% of the frame to search in " << created->regions().size()
+            << " region(s)" << std::endl;
+  mask = std::make_shared<const DetectionMask>(created.value());
+  return true;
+}
+
+bool DetectionMask::Contains(const cv::Point2f& point) const {
+  const int x = cvFloor(point.x);
+  const int y = cvFloor(point.y);
+  return x >= 0 && y >= 0 && x < mask_.cols && y < mask_.rows &&
+         mask_.at<uint8_t>(y, x) != 0;
+}
+
+double DetectionMask::SearchedFraction() const {
+  double area = 0;
+  for (const cv::Rect& region : regions_) {
+    area += region.area();
+  }
+  return area / std::max(frame_size_.area(), 1);
+}
+
+}  // namespace CameraMarkerServer
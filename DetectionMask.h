@@ -0,0 +1,61 @@
+#ifndef DETECTION_MASK_H_
+#define DETECTION_MASK_H_
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace CameraMarkerServer {
+class CalibrationSettings;
+
+// Where markers can appear in a camera's view. Everything else, such as
+// scoreboards, LED walls and the crowd, is never searched.
+struct DetectionMaskOptions {
+  // Painted mask, non-zero pixels are active. Scaled to the frame size.
+  std::string image_file;
+  // Active polygons as flat x y lists in pixels of polygon_frame_size,
+  // added to the image
+  std::vector<std::vector<int>> polygons;
+  // Frame the polygons were drawn on, scaled to the frame size. Empty when
+  // they are in pixels of the frame itself.
+  cv::Size polygon_frame_size;
+  // Pixels searched around the active areas, so markers on their edge are
+  // seen whole and the adaptive threshold has context
+  int margin = 32;
+
+  bool IsEnabled() const { return !image_file.empty() || !polygons.empty(); }
+};
+
+// A static mask precomputed once per camera: a bitmask of the active pixels
+// and the padded bounding rectangles of its connected areas, merged where
+// they overlap. Detection runs only inside the rectangles and drops markers
+// whose center is outside the bitmask.
+class DetectionMask {
+ public:
+  // Returns nullopt if the mask image cannot be read or the polygons were
+  // drawn on a frame of another aspect ratio.
+  static std::optional<DetectionMask> Create(
+      const DetectionMaskOptions& options, const cv::Size& frame_size);
+  // Builds the mask of the Mask_* settings for frames of frame_size. mask is
+  // null when none is configured. Returns false if it cannot be created.
+  static bool FromSettings(const CalibrationSettings& settings,
+                           const cv::Size& frame_size,
+                           std::shared_ptr<const DetectionMask>& mask);
+
+  const std::vector<cv::Rect>& regions() const { return regions_; }
+  const cv::Size& frame_size() const { return frame_size_; }
+  bool Contains(const cv::Point2f& point) const;
+  // Share of the frame covered by regions, what detection still searches
+  double SearchedFraction() const;
+
+ private:
+  DetectionMask() {}
+
+  cv::Mat mask_;  // CV_8UC1, 255 where markers may appear
+  cv::Size frame_size_;
+  std::vector<cv::Rect> regions_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // DETECTION_MASK_H_
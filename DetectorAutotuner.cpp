@@ -0,0 +1,396 @@
+#include "DetectorAutotuner.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "CalibrationSettings.h"
+#include "CameraCalibratationUtils.h"
+#include "CameraDetector.h"
+
+namespace CameraMarkerServer {
+namespace {
+const std::string SETTINGS_FILE = "Calibration/calibration_settings.xml";
+const int MAX_TUNING_FRAMES = 150;
+const int SYNTHETIC_FRAMES = 120;
+const cv::Size SYNTHETIC_FRAME_SIZE(1280, 720);
+const int SYNTHETIC_MARKERS = 8;
+const double SYNTHETIC_FOCAL_LENGTH = 1000.0;
+// Candidates this close to the best recall and jitter count as equally
+// accurate; the fastest of them wins.
+const double RECALL_TOLERANCE = 0.01;
+const double JITTER_TOLERANCE = 1.25;
+
+struct TuningClip {
+  std::vector<cv::Mat> frames;
+  // Markers in each frame; empty for recorded clips, which have no ground
+  // truth
+  std::vector<std::vector<int>> expected_ids;
+  CameraParameters camera_parameters;
+};
+
+struct Candidate {
+  cv::aruco::DetectorParameters params;
+  std::string description;
+  double mean_latency_ms = 0;
+  double recall = 0;
+  double jitter = std::numeric_limits<double>::infinity();
+  std::vector<std::vector<int>> found_ids;
+  bool pareto = false;
+};
+
+std::vector<Candidate> CandidateGrid() {
+  const int WIN_MIN[] = {3, 5};
+  const int WIN_MAX[] = {23, 35, 53};
+  const int WIN_STEP[] = {6, 10};
+  const cv::aruco::CornerRefineMethod REFINEMENT[] = {
+      cv::aruco::CORNER_REFINE_NONE, cv::aruco::CORNER_REFINE_SUBPIX,
+      cv::aruco::CORNER_REFINE_CONTOUR};
+  const char* REFINEMENT_NAMES[] = {"none", "subpix", "contour"};
+  const double MIN_PERIMETER[] = {0.02, 0.03};
+
+  std::vector<Candidate> candidates;
+  for (int win_min : WIN_MIN) {
+    for (int win_max : WIN_MAX) {
+      for (int win_step : WIN_STEP) {
+        for (int r = 0; r < 3; r++) {
+          for (double min_perimeter : MIN_PERIMETER) {
+            Candidate candidate;
+            candidate.params.adaptiveThreshWinSizeMin = win_min;
+            candidate.params.adaptiveThreshWinSizeMax = win_max;
+            candidate.params.adaptiveThreshWinSizeStep = win_step;
+            candidate.params.cornerRefinementMethod = REFINEMENT[r];
+            candidate.params.minMarkerPerimeterRate = min_perimeter;
+            std::ostringstream os;
+            os << "window " << win_min << "-" << win_max << "/" << win_step
+               << " refine " << REFINEMENT_NAMES[r] << " perimeter "
+               << min_perimeter;
+            candidate.description = os.str();
+            candidates.push_back(candidate);
+          }
+        }
+      }
+    }
+  }
+  return candidates;
+}
+
+std::optional<TuningClip> LoadRecordedClip(CalibrationSettings s,
+                                           const std::string& clip) {
+  s.input = clip;
+  s.replayMode = "MAX_SPEED";
+  s.recordFileName = "";
+  s.faultMode = "NONE";
+  s.validate();
+  if (!s.frameSource || s.isLiveInput()) {
+    std::cout << "Could not open clip \"" << clip << "\"" << std::endl;
+    return std::nullopt;
+  }
+  std::optional<CameraParameters> camera_params =
+      GetCameraParametersFromFile(s);
+  if (!camera_params.has_value() ||
+      camera_params->insintric_camera_parms.empty()) {
+    std::cout << "Could not read camera parameters from \""
+              << s.outputFileName << "\", calibrate the camera first"
+              << std::endl;
+    return std::nullopt;
+  }
+  camera_params = ScaleCameraParameters(camera_params.value(),
+                                        s.frameSource->FrameSize());
+  if (!camera_params.has_value()) {
+    std::cout << "Clip resolution does not match the aspect ratio of the "
+                 "calibration"
+              << std::endl;
+    return std::nullopt;
+  }
+  TuningClip tuning_clip;
+  tuning_clip.camera_parameters = camera_params.value();
+  Frame frame;
+  while ((int)tuning_clip.frames.size() < MAX_TUNING_FRAMES &&
+         s.frameSource->Read(frame)) {
+    // Frames may point into the source's buffers
+    tuning_clip.frames.push_back(frame.image.clone());
+  }
+  return tuning_clip;
+}
+
+// Renders markers drifting, turning and tilting over a noisy gradient.
+// Drift and turn are linear in time; the tilt follows a slow sinusoid whose
+// second difference is below 1e-4 of the marker size per frame. Pose
+// jitter therefore measures detection noise, not motion.
+TuningClip MakeSyntheticClip(const cv::aruco::Dictionary& dictionary) {
+  TuningClip clip;
+  cv::Mat camera_matrix = (cv::Mat_<double>(3, 3) << SYNTHETIC_FOCAL_LENGTH, 0,
+                           SYNTHETIC_FRAME_SIZE.width / 2.0 - 0.5, 0,
+                           SYNTHETIC_FOCAL_LENGTH,
+                           SYNTHETIC_FRAME_SIZE.height / 2.0 - 0.5, 0, 0, 1);
+  clip.camera_parameters.insintric_camera_parms = camera_matrix;
+  clip.camera_parameters.distortion_mat = cv::Mat::zeros(1, 5, CV_64F);
+  clip.camera_parameters.image_size = SYNTHETIC_FRAME_SIZE;
+
+  const int MARKER_PIXELS = 240;
+  const int QUIET_ZONE = MARKER_PIXELS / 6;
+  const int marker_count =
+      std::min(SYNTHETIC_MARKERS, dictionary.bytesList.rows);
+  std::vector<cv::Mat> marker_images(marker_count);
+  for (int id = 0; id < marker_count; id++) {
+    cv::Mat marker;
+    cv::aruco::generateImageMarker(dictionary, id, MARKER_PIXELS, marker, 1);
+    cv::copyMakeBorder(marker, marker_images[id], QUIET_ZONE, QUIET_ZONE,
+                       QUIET_ZONE, QUIET_ZONE, cv::BORDER_CONSTANT,
+                       cv::Scalar(255));
+  }
+  const float side = (float)marker_images.front().cols;
+  const std::vector<cv::Point2f> source_quad = {
+      cv::Point2f(0, 0), cv::Point2f(side, 0), cv::Point2f(side, side),
+      cv::Point2f(0, side)};
+
+  cv::Mat background(SYNTHETIC_FRAME_SIZE, CV_8UC1);
+  for (int y = 0; y < background.rows; y++) {
+    background.row(y).setTo(cv::Scalar(60 + 120 * y / background.rows));
+  }
+  cv::RNG rng(7);
+  for (int f = 0; f < SYNTHETIC_FRAMES; f++) {
+    cv::Mat frame = background.clone();
+    std::vector<int> expected;
+    for (int id = 0; id < marker_count; id++) {
+      // Each marker gets its own lane, size, drift and tilt
+      const float t = (float)f / SYNTHETIC_FRAMES;
+      const float size = 50.f + 25.f * id;
+      const cv::Point2f center(
+          SYNTHETIC_FRAME_SIZE.width *
+              (0.15f + 0.7f * (0.5f * id / marker_count + 0.4f * t)),
+          SYNTHETIC_FRAME_SIZE.height * (0.15f + 0.7f * id / marker_count));
+      const float angle = 0.4f * id + 1.5f * t;
+      const float tilt = 0.25f * std::sin(0.7f * id + 2.f * t);
+      std::vector<cv::Point2f> quad(4);
+      for (int c = 0; c < 4; c++) {
+        const float corner_angle =
+            angle + (float)CV_PI / 4 + c * (float)CV_PI / 2;
+        // Tilt shrinks one side of the marker, like a perspective view
+        const float radius =
+            size * std::sqrt(0.5f) * (1.f + (c < 2 ? tilt : -tilt));
+        quad[c] = center + radius * cv::Point2f(std::cos(corner_angle),
+                                                std::sin(corner_angle));
+      }
+      cv::Mat warp = cv::getPerspectiveTransform(source_quad, quad);
+      cv::warpPerspective(marker_images[id], frame, warp, frame.size(),
+                          cv::INTER_LINEAR, cv::BORDER_TRANSPARENT);
+      const cv::Rect2f inside(0, 0, (float)frame.cols, (float)frame.rows);
+      if (std::all_of(quad.begin(), quad.end(), [&](const cv::Point2f& p) {
+            return inside.contains(p);
+          })) {
+        expected.push_back(id);
+      }
+    }
+    cv::Mat noise(frame.size(), CV_16SC1);
+    rng.fill(noise, cv::RNG::NORMAL, 0, 6);
+    frame.convertTo(frame, CV_16SC1);
+    frame += noise;
+    frame.convertTo(frame, CV_8UC1);
+    cv::GaussianBlur(frame, frame, cv::Size(3, 3), 0.8);
+    clip.frames.push_back(frame);
+    clip.expected_ids.push_back(expected);
+  }
+  return clip;
+}
+
+void Evaluate(const TuningClip& clip, const cv::aruco::Dictionary& dictionary,
+              float marker_length, const TilingOptions& tiling,
+              Candidate& candidate) {
+  PoseDetector detector(marker_length, dictionary, candidate.params,
+                        clip.camera_parameters, tiling);
+  struct Track {
+    int last_frame = -1;
+    int run = 0;  // Consecutive frames the marker was found in
+    cv::Vec3d last;
+    cv::Vec3d previous;
+  };
+  std::map<int, Track> tracks;
+  double total_ms = 0;
+  double second_difference_sum = 0;
+  int second_difference_count = 0;
+  candidate.found_ids.assign(clip.frames.size(), std::vector<int>());
+  for (int f = 0; f < (int)clip.frames.size(); f++) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    std::vector<MarkerObservation> observations =
+        detector.DetectPoses(clip.frames[f]);
+    total_ms += std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    for (const MarkerObservation& observation : observations) {
+      candidate.found_ids[f].push_back(observation.id);
+      Track& track = tracks[observation.id];
+      const cv::Vec3d& t = observation.tvec;
+      track.run = track.last_frame == f - 1 ? track.run + 1 : 1;
+      if (track.run >= 3) {
+        // Over three consecutive frames the second difference removes steady
+        // motion and leaves the noise
+        const cv::Vec3d d2 = t - 2 * track.last + track.previous;
+        second_difference_sum += d2.dot(d2);
+        second_difference_count++;
+      }
+      track.previous = track.last;
+      track.last = t;
+      track.last_frame = f;
+    }
+    std::sort(candidate.found_ids[f].begin(), candidate.found_ids[f].end());
+  }
+  candidate.mean_latency_ms =
+      total_ms / std::max<size_t>(clip.frames.size(), 1);
+  if (second_difference_count > 0) {
+    candidate.jitter =
+        std::sqrt(second_difference_sum / second_difference_count);
+  }
+}
+
+// Recall against the ground truth, or for recorded clips against the union
+// of what all candidates found in each frame.
+void ScoreRecall(const TuningClip& clip, std::vector<Candidate>& candidates) {
+  std::vector<std::vector<int>> reference = clip.expected_ids;
+  if (reference.empty()) {
+    reference.resize(clip.frames.size());
+    for (const Candidate& candidate : candidates) {
+      for (size_t f = 0; f < reference.size(); f++) {
+        std::vector<int> merged;
+        std::set_union(reference[f].begin(), reference[f].end(),
+                       candidate.found_ids[f].begin(),
+                       candidate.found_ids[f].end(),
+                       std::back_inserter(merged));
+        reference[f].swap(merged);
+      }
+    }
+  }
+  size_t expected = 0;
+  for (const std::vector<int>& ids : reference) {
+    expected += ids.size();
+  }
+  for (Candidate& candidate : candidates) {
+    size_t found = 0;
+    for (size_t f = 0; f < reference.size(); f++) {
+      std::vector<int> matched;
+      std::set_intersection(reference[f].begin(), reference[f].end(),
+                            candidate.found_ids[f].begin(),
+                            candidate.found_ids[f].end(),
+                            std::back_inserter(matched));
+      found += matched.size();
+    }
+    candidate.recall = expected > 0 ? (double)found / expected : 0;
+  }
+}
+
+bool Dominates(const Candidate& a, const Candidate& b) {
+  return a.mean_latency_ms <= b.mean_latency_ms && a.recall >= b.recall &&
+         a.jitter <= b.jitter &&
+         (a.mean_latency_ms < b.mean_latency_ms || a.recall > b.recall ||
+          a.jitter < b.jitter);
+}
+
+void MarkParetoFront(std::vector<Candidate>& candidates) {
+  for (Candidate& candidate : candidates) {
+    candidate.pareto = std::none_of(
+        candidates.begin(), candidates.end(),
+        [&](const Candidate& other) { return Dominates(other, candidate); });
+  }
+}
+
+const Candidate& ChooseBest(const std::vector<Candidate>& candidates) {
+  double best_recall = 0;
+  for (const Candidate& candidate : candidates) {
+    if (candidate.pareto) best_recall = std::max(best_recall, candidate.recall);
+  }
+  double best_jitter = std::numeric_limits<double>::infinity();
+  for (const Candidate& candidate : candidates) {
+    if (candidate.pareto && candidate.recall >= best_recall - RECALL_TOLERANCE)
+      best_jitter = std::min(best_jitter, candidate.jitter);
+  }
+  const Candidate* best = nullptr;
+  for (const Candidate& candidate : candidates) {
+    if (!candidate.pareto ||
+        candidate.recall < best_recall - RECALL_TOLERANCE ||
+        candidate.jitter > best_jitter * JITTER_TOLERANCE) {
+      continue;
+    }
+    if (!best || candidate.mean_latency_ms < best->mean_latency_ms) {
+      best = &candidate;
+    }
+  }
+  return best ? *best : candidates.front();
+}
+}  // namespace
+
+int RunDetectorAutotune(const std::string& clip, const std::string& output_file) {
+  cv::FileStorage settings_fs(SETTINGS_FILE, cv::FileStorage::READ);
+  if (!settings_fs.isOpened()) {
+    std::cout << "Could not open the configuration file: \"" << SETTINGS_FILE
+              << "\"" << std::endl;
+    return 1;
+  }
+  CalibrationSettings s;
+  s.readFields(settings_fs["Settings"]);
+  std::optional<cv::aruco::Dictionary> dictionary = CreateArucoDict(s);
+  if (!dictionary.has_value()) {
+    std::cout << "Could not parse aruco dictionary." << std::endl;
+    return 1;
+  }
+  std::optional<TuningClip> tuning_clip =
+      clip == SYNTHETIC_CLIP ? MakeSyntheticClip(dictionary.value())
+                             : LoadRecordedClip(s, clip);
+  if (!tuning_clip.has_value() || tuning_clip->frames.empty()) {
+    return 1;
+  }
+  TilingOptions tiling;
+  tiling.tiles_x = s.detectTilesX;
+  tiling.tiles_y = s.detectTilesY;
+  tiling.overlap = s.detectTileOverlap;
+
+  std::vector<Candidate> candidates = CandidateGrid();
+  std::cout << "Tuning " << candidates.size() << " parameter sets on "
+            << tuning_clip->frames.size() << " frames" << std::endl;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    Evaluate(tuning_clip.value(), dictionary.value(), s.poseMarkerSize, tiling,
+             candidates[i]);
+    std::cout << "\r  " << i + 1 << "/" << candidates.size() << std::flush;
+  }
+  std::cout << std::endl;
+  ScoreRecall(tuning_clip.value(), candidates);
+  MarkParetoFront(candidates);
+  const Candidate& best = ChooseBest(candidates);
+
+  std::cout << "Pareto front (latency ms, recall, jitter):" << std::endl;
+  for (const Candidate& candidate : candidates) {
+    if (!candidate.pareto) continue;
+    std::cout << (&candidate == &best ? "* " : "  ") << std::fixed
+              << std::setprecision(2) << candidate.mean_latency_ms << "  "
+              << std::setprecision(3) << candidate.recall << "  "
+              << std::setprecision(4) << candidate.jitter << "  "
+              << candidate.description << std::endl;
+  }
+  std::cout.unsetf(std::ios::floatfield);
+
+  cv::FileStorage out(output_file, cv::FileStorage::WRITE);
+  if (!out.isOpened()) {
+    std::cout << "Could not write \"" << output_file << "\"" << std::endl;
+    return 1;
+  }
+  std::ostringstream summary;
+  summary << "Tuned on " << clip << ": " << best.description << ", "
+          << best.mean_latency_ms << " ms, recall " << best.recall
+          << ", jitter " << best.jitter;
+  out.writeComment(summary.str());
+  cv::aruco::DetectorParameters params = best.params;
+  params.writeDetectorParameters(out);
+  std::cout << "Wrote " << output_file
+            << ", set Detector_ParamsFile to use it" << std::endl;
+  return 0;
+}
+
+}  // namespace CameraMarkerServer
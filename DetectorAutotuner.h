@@ -0,0 +1,24 @@
+#ifndef DETECTOR_AUTOTUNER_H_
+#define DETECTOR_AUTOTUNER_H_
+#include <string>
+
+namespace CameraMarkerServer {
+// Name of the clip argument that makes the autotuner render its own frames.
+const std::string SYNTHETIC_CLIP = "synthetic";
+
+// Searches ArUco detector parameters on a clip and writes the best set to
+// output_file, which the server loads through Detector_ParamsFile.
+//
+// clip is a video, image list or raw recording, or SYNTHETIC_CLIP for
+// rendered frames with known markers. Every candidate parameter set is run
+// over the clip and measured for mean detection latency, recall and pose
+// jitter (RMS second difference of marker translations between frames).
+// Recorded clips have no ground truth, so recall there is relative to the
+// markers any candidate found in a frame. Of the Pareto front, the fastest
+// set within a small tolerance of the best recall and jitter is written.
+//
+// Command line entry, see Main.cpp. Returns the process exit code.
+int RunDetectorAutotune(const std::string& clip, const std::string& output_file);
+
+}  // namespace CameraMarkerServer
+#endif  // DETECTOR_AUTOTUNER_H_
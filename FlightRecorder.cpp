@@ -0,0 +1,257 @@
+#include "FlightRecorder.h"
+#include <algorithm>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "OfflineExtraction.h"
+#include "PoseBatch.h"
+#include "RawFrameRecording.h"
+#include "ThreadUtils.h"
+
+namespace CameraMarkerServer {
+namespace {
+const std::chrono::milliseconds PENDING_WAIT_TIMEOUT(100);
+// Fastest zlib level, lossless frames only need to keep up with capture
+const int PNG_COMPRESSION = 1;
+// Recorded frames in a row a marker has to be seen in before losing it
+// fires marker_lost, so a single frame false positive does not
+const int MARKER_LOST_ARM_FRAMES = 3;
+
+std::string LocalTimeString() {
+  const std::time_t now =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  std::tm local = {};
+#ifdef _WIN32
+  localtime_s(&local, &now);
+#else
+  localtime_r(&now, &local);
+#endif
+  std::ostringstream os;
+  os << std::put_time(&local, "%Y%m%d_%H%M%S");
+  return os.str();
+}
+}  // namespace
+
+FlightRecorder::FlightRecorder(const std::string& camera_name,
+                               const FlightRecorderOptions& options)
+    : camera_name_(camera_name),
+      options_(options),
+      pending_(false),
+      dumps_(false),
+      requested_reason_(nullptr),
+      running_(false) {}
+
+FlightRecorder::~FlightRecorder() { Stop(); }
+
+void FlightRecorder::Start() {
+  running_ = true;
+  thread_ = std::thread(&FlightRecorder::Loop, this);
+  dump_thread_ = std::thread(&FlightRecorder::DumpLoop, this);
+}
+
+void FlightRecorder::Stop() {
+  running_ = false;
+  pending_.Close();
+  if (thread_.joinable()) thread_.join();
+  // A dump already requested is still written
+  dumps_.Close();
+  if (dump_thread_.joinable()) dump_thread_.join();
+}
+
+void FlightRecorder::Record(const Frame& frame,
+                            const std::vector<MarkerObservation>& observations,
+                            const FrameTimings& timings) {
+  Pending pending;
+  pending.frame = frame;
+  pending.observations = observations;
+  pending.timings = timings;
+  pending_.Put(std::move(pending));
+  // Checked here for every frame, the recorder thread may skip this one
+  if (options_.frame_time_limit.count() > 0 &&
+      timings.Total() > options_.frame_time_limit) {
+    Trigger("frame_time");
+  }
+}
+
+void FlightRecorder::Trigger(const char* reason) { requested_reason_ = reason; }
+
+void FlightRecorder::Loop() {
+  SetCurrentThreadName("flight:" + camera_name_);
+  Pending pending;
+  while (running_) {
+    if (pending_.Take(pending, PENDING_WAIT_TIMEOUT)) {
+      Add(pending);
+      // Drops the frame's buffer before the next wait
+      pending = Pending();
+    }
+    if (const char* reason = requested_reason_.exchange(nullptr)) {
+      RequestDump(reason);
+    }
+  }
+}
+
+void FlightRecorder::DumpLoop() {
+  SetCurrentThreadName("flight_dump:" + camera_name_);
+  DumpRequest request;
+  while (true) {
+    if (!dumps_.Take(request, PENDING_WAIT_TIMEOUT)) {
+      if (dumps_.IsClosedAndEmpty()) {
+        break;
+      }
+      continue;
+    }
+    Dump(request);
+    // Drops the dumped entries, unless they are still in the history
+    request = DumpRequest();
+  }
+}
+
+void FlightRecorder::Add(Pending& pending) {
+  if (pending.frame.image.empty()) {
+    return;
+  }
+  cv::Mat image = pending.frame.image;
+  if (options_.scale < 1) {
+    cv::resize(pending.frame.image, image, cv::Size(), options_.scale,
+               options_.scale, cv::INTER_AREA);
+  }
+  std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+  const bool encoded =
+      options_.quality > 0
+          ? cv::imencode(".jpg", image, entry->image,
+                         {cv::IMWRITE_JPEG_QUALITY, options_.quality})
+          : cv::imencode(".png", image, entry->image,
+                         {cv::IMWRITE_PNG_COMPRESSION, PNG_COMPRESSION});
+  if (!encoded) {
+    return;
+  }
+  entry->frame_index = pending.frame.index;
+  entry->timestamp_us = pending.frame.timestamp_us;
+  entry->observations = std::move(pending.observations);
+  entry->timings = pending.timings;
+  history_.push_back(std::move(entry));
+  const std::chrono::steady_clock::time_point newest =
+      history_.back()->timings.capture_time;
+  while (newest - history_.front()->timings.capture_time > options_.history) {
+    history_.pop_front();
+  }
+  if (const char* reason = CheckTriggers(*history_.back())) {
+    RequestDump(reason);
+  }
+}
+
+const char* FlightRecorder::CheckTriggers(const Entry& entry) {
+  if (options_.marker_lost_limit.count() == 0) {
+    return nullptr;
+  }
+  const std::chrono::steady_clock::time_point now = entry.timings.capture_time;
+  checked_entries_++;
+  for (const MarkerObservation& observation : entry.observations) {
+    MarkerTrack& track = markers_[observation.id];
+    track.consecutive =
+        track.last_entry == checked_entries_ - 1 ? track.consecutive + 1 : 1;
+    track.last_entry = checked_entries_;
+    track.last_seen = now;
+    if (track.consecutive >= MARKER_LOST_ARM_FRAMES) {
+      track.armed = true;
+    }
+  }
+  // Markers gone for longer than this can no longer fire and are forgotten
+  const std::chrono::steady_clock::duration forget_after =
+      std::max<std::chrono::steady_clock::duration>(
+          options_.history, options_.marker_lost_limit);
+  const char* reason = nullptr;
+  for (auto it = markers_.begin(); it != markers_.end();) {
+    MarkerTrack& track = it->second;
+    const std::chrono::steady_clock::duration unseen = now - track.last_seen;
+    // Every loss is reported once, the marker has to be tracked again to
+    // rearm the trigger
+    if (track.armed && unseen > options_.marker_lost_limit) {
+      track.armed = false;
+      if (reason == nullptr) {
+        reason = "marker_lost";
+      }
+    }
+    if (unseen > forget_after) {
+      it = markers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return reason;
+}
+
+void FlightRecorder::RequestDump(const char* reason) {
+  const std::chrono::steady_clock::time_point now =
+      std::chrono::steady_clock::now();
+  // One dump per history length, so a burst of slow frames writes one dump
+  // instead of many overlapping ones
+  if (history_.empty() ||
+      (last_dump_ != std::chrono::steady_clock::time_point() &&
+       now - last_dump_ < options_.history)) {
+    return;
+  }
+  last_dump_ = now;
+  DumpRequest request;
+  request.reason = reason;
+  request.history = history_;
+  dumps_.Put(std::move(request));
+}
+
+void FlightRecorder::Dump(const DumpRequest& request) {
+  const char* reason = request.reason;
+  std::error_code error;
+  std::filesystem::create_directories(options_.directory, error);
+  const std::string base = options_.directory + "/" + camera_name_ + "_" +
+                           LocalTimeString() + "_" + reason;
+  RawFrameRecorder frames;
+  std::ofstream timings(base + "_timings.csv", std::ios::trunc);
+  if (!frames.Open(base + RAW_RECORDING_EXTENSION) || !timings.is_open()) {
+    std::cout << "Could not write the flight recorder dump " << base
+              << std::endl;
+    return;
+  }
+  timings << "frame,camera_frame,timestamp_us,queue_wait_us,detection_us,"
+             "total_us,regions_only,markers\n";
+  // Frames are numbered by their position in the dump, as a replay of it
+  // numbers them
+  PoseTable poses;
+  PoseBatch frame_poses;
+  for (const std::shared_ptr<const Entry>& entry_ptr : request.history) {
+    const Entry& entry = *entry_ptr;
+    Frame frame;
+    frame.image = cv::imdecode(entry.image, cv::IMREAD_UNCHANGED);
+    frame.timestamp_us = entry.timestamp_us;
+    frame.index = poses.frame_count;
+    // Frames of a format other than the first one's are dropped
+    if (frame.image.empty() || !frames.Write(frame)) {
+      continue;
+    }
+    frame_poses.SetFromObservations(entry.observations);
+    poses.Append(frame.index, frame.timestamp_us, frame_poses);
+    poses.frame_count++;
+    const FrameTimings& t = entry.timings;
+    timings << frame.index << "," << entry.frame_index << ","
+            << entry.timestamp_us << "," << t.queue_wait.count() << ","
+            << t.detection.count() << "," << t.Total().count() << ","
+            << t.regions_only << "," << entry.observations.size() << "\n";
+  }
+  const bool written = frames.Close() && timings.good() &&
+                       WritePoseTable(base + POSE_TABLE_EXTENSION, poses);
+  if (!written) {
+    std::cout << "Could not write the flight recorder dump " << base
+              << std::endl;
+    return;
+  }
+  std::cout << "Flight recorder of " << camera_name_ << " triggered by "
+            << reason << ", wrote the last " << poses.frame_count
+            << " frames to " << base << RAW_RECORDING_EXTENSION << std::endl;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,121 @@
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "CameraDetector.h"
+#include "FrameSource.h"
+#include "Mailbox.h"
+
+namespace CameraMarkerServer {
+struct FlightRecorderOptions {
+  std::chrono::milliseconds history{0};  // Recent history kept, 0 disables
+  double scale = 0.5;                    // Kept frame size relative to capture
+  int quality = 90;                      // JPEG quality, 0 keeps lossless PNG
+  // Triggers, zero turns one off
+  std::chrono::microseconds frame_time_limit{0};  // Capture to pose
+  std::chrono::milliseconds marker_lost_limit{0};
+  std::string directory = "flight";
+
+  bool IsEnabled() const { return history.count() > 0; }
+};
+
+// Stage timings of one detected frame.
+struct FrameTimings {
+  std::chrono::steady_clock::time_point capture_time;
+  std::chrono::microseconds queue_wait{0};  // Capture until detection started
+  std::chrono::microseconds detection{0};   // Detection and pose estimation
+  bool regions_only = false;  // Only searched around the previous markers
+
+  std::chrono::microseconds Total() const { return queue_wait + detection; }
+};
+
+// Keeps the last few seconds of one camera in memory: the frames,
+// downscaled and compressed to bound memory, with their camera frame
+// detections and stage timings. When a trigger fires the history is dumped
+// to disk as a raw recording that offline extraction replays through
+// PoseDetector, the live poses as a pose table to compare the replay
+// against, and the timings as CSV.
+//
+// Compression and trigger checks run on the recorder's own thread, dumps
+// on a second one so that recording goes on while a dump is written.
+// Record never blocks detection; frames that arrive while the previous one
+// is still being compressed are left out of the history, but their frame
+// time is still checked.
+class FlightRecorder {
+ public:
+  FlightRecorder(const std::string& camera_name,
+                 const FlightRecorderOptions& options);
+  ~FlightRecorder();
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  void Start();
+  void Stop();
+  // Shares the frame's buffer until it is compressed; captured frames are
+  // not written to, the preview draws on a copy.
+  void Record(const Frame& frame,
+              const std::vector<MarkerObservation>& observations,
+              const FrameTimings& timings);
+  // Dumps the history from any thread, e.g. when the camera stalls. reason
+  // names the dump and must outlive it, in practice a string literal.
+  void Trigger(const char* reason);
+
+ private:
+  struct Pending {
+    Frame frame;
+    std::vector<MarkerObservation> observations;
+    FrameTimings timings;
+  };
+  struct Entry {
+    int64_t frame_index = 0;
+    int64_t timestamp_us = 0;
+    std::vector<uchar> image;  // Encoded frame
+    std::vector<MarkerObservation> observations;
+    FrameTimings timings;
+  };
+  // Entries are immutable once added and shared with the dump thread
+  typedef std::deque<std::shared_ptr<const Entry>> History;
+  struct MarkerTrack {
+    std::chrono::steady_clock::time_point last_seen;
+    int64_t last_entry = -1;  // Checked entry it was last seen in
+    int consecutive = 0;      // Checked entries in a row it was seen in
+    bool armed = false;       // Losing it fires marker_lost
+  };
+  struct DumpRequest {
+    const char* reason = nullptr;
+    History history;
+  };
+  void Loop();
+  void DumpLoop();
+  void Add(Pending& pending);
+  // The marker lost trigger the newest entry fires, or nullptr.
+  const char* CheckTriggers(const Entry& entry);
+  // Hands the history to the dump thread, at most once per history length.
+  void RequestDump(const char* reason);
+  void Dump(const DumpRequest& request);
+
+  const std::string camera_name_;
+  const FlightRecorderOptions options_;
+  Mailbox<Pending> pending_;
+  Mailbox<DumpRequest> dumps_;
+  std::atomic<const char*> requested_reason_;
+  std::atomic<bool> running_;
+  std::thread thread_;
+  std::thread dump_thread_;
+  // Touched by the recorder thread only
+  History history_;
+  // Markers seen within the history or the marker lost limit
+  std::unordered_map<int, MarkerTrack> markers_;
+  int64_t checked_entries_ = 0;
+  std::chrono::steady_clock::time_point last_dump_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // FLIGHT_RECORDER_H_
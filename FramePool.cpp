@@ -0,0 +1,153 @@
+#include "FramePool.h"
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+namespace CameraMarkerServer {
+// Hands out the pooled buffers as cv::MatAllocator, so OpenCV's own
+// reference counting decides when a buffer is free again. Laid out like
+// OpenCV's default allocator; the interface is const, hence the mutable
+// state.
+class FramePool::Allocator : public cv::MatAllocator {
+ public:
+  explicit Allocator(int capacity) : capacity_(capacity) {}
+  ~Allocator() { FreeUnused(); }
+
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data0,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage_flags) const override {
+    // Wrapping memory the caller owns has nothing to pool
+    if (data0) {
+      return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data0,
+                                                  step, flags, usage_flags);
+    }
+    size_t total = CV_ELEM_SIZE(type);
+    for (int i = dims - 1; i >= 0; i--) {
+      if (step) {
+        step[i] = total;
+      }
+      total *= sizes[i];
+    }
+    uchar* data;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (total == buffer_size_ && !free_.empty()) {
+        data = free_.back();
+        free_.pop_back();
+      } else {
+        if (total == buffer_size_ && !grown_) {
+          grown_ = true;
+          std::cout << "All " << capacity_
+                    << " pooled frame buffers are in use, allocating more"
+                    << std::endl;
+        }
+        data = (uchar*)cv::fastMalloc(total);
+      }
+      outstanding_++;
+    }
+    cv::UMatData* u = new cv::UMatData(this);
+    u->data = u->origdata = data;
+    u->size = total;
+    return u;
+  }
+
+  bool allocate(cv::UMatData* data, cv::AccessFlag /*access_flags*/,
+                cv::UMatUsageFlags /*usage_flags*/) const override {
+    return data != nullptr;
+  }
+
+  void deallocate(cv::UMatData* u) const override {
+    if (!u) {
+      return;
+    }
+    CV_Assert(u->urefcount == 0);
+    CV_Assert(u->refcount == 0);
+    bool last_of_orphan;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // Buffers of an old format, or past the capacity grown into, go away
+      if (!orphaned_ && u->size == buffer_size_ &&
+          free_.size() < (size_t)capacity_) {
+        free_.push_back(u->origdata);
+      } else {
+        cv::fastFree(u->origdata);
+      }
+      u->origdata = 0;
+      outstanding_--;
+      last_of_orphan = orphaned_ && outstanding_ == 0;
+    }
+    delete u;
+    // The pool is gone and this was the last frame out
+    if (last_of_orphan) {
+      delete this;
+    }
+  }
+
+  void Reserve(size_t buffer_size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffer_size == buffer_size_) {
+      return;
+    }
+    FreeUnusedLocked();
+    buffer_size_ = buffer_size;
+    grown_ = false;
+    for (int i = 0; i < capacity_; i++) {
+      free_.push_back((uchar*)cv::fastMalloc(buffer_size_));
+    }
+  }
+
+  void FreeUnused() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeUnusedLocked();
+  }
+
+  // Called by the destroyed pool. Returns true if no buffer is out and the
+  // allocator can be deleted; otherwise the buffers still out are freed as
+  // they come back and the last one deletes the allocator.
+  bool Orphan() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeUnusedLocked();
+    orphaned_ = true;
+    return outstanding_ == 0;
+  }
+
+ private:
+  void FreeUnusedLocked() {
+    for (uchar* buffer : free_) {
+      cv::fastFree(buffer);
+    }
+    free_.clear();
+  }
+
+  const int capacity_;
+  mutable std::mutex mutex_;
+  mutable std::vector<uchar*> free_;
+  mutable size_t buffer_size_ = 0;
+  mutable int outstanding_ = 0;  // Buffers allocated and not released
+  mutable bool grown_ = false;
+  mutable bool orphaned_ = false;
+};
+
+FramePool::FramePool(int capacity) : allocator_(new Allocator(capacity)) {}
+
+FramePool::~FramePool() {
+  if (allocator_->Orphan()) {
+    delete allocator_;
+  }
+}
+
+cv::Mat FramePool::Take(const cv::Size& size, int type) {
+  allocator_->Reserve((size_t)size.area() * CV_ELEM_SIZE(type));
+  cv::Mat image;
+  image.allocator = allocator_;
+  image.create(size, type);
+  return image;
+}
+
+bool FramePool::Owns(const cv::Mat& image) const {
+  return image.u != nullptr && image.u->currAllocator == allocator_;
+}
+
+void FramePool::ReleaseUnused() { allocator_->FreeUnused(); }
+
+}  // namespace CameraMarkerServer
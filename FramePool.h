@@ -0,0 +1,41 @@
+#ifndef FRAME_POOL_H_
+#define FRAME_POOL_H_
+#include <opencv2/core.hpp>
+
+namespace CameraMarkerServer {
+// Preallocated frame buffers for one camera. Frames taken from the pool are
+// ordinary cv::Mat whose buffer goes back to the pool when the last Mat
+// sharing it is released. Capture, detection, recording and preview thus
+// share one buffer per frame by reference, and steady state capture
+// allocates nothing.
+//
+// Buffers may be released on any thread. Frames still alive when the pool
+// is destroyed stay valid; their buffers are freed as they are released.
+class FramePool {
+ public:
+  // capacity buffers are kept per format, enough for every frame in flight
+  // between capture and the send loop.
+  explicit FramePool(int capacity);
+  ~FramePool();
+  FramePool(const FramePool&) = delete;
+  FramePool& operator=(const FramePool&) = delete;
+
+  // A frame of size and type in a pooled buffer. The first frame of a new
+  // format frees the buffers of the old one and preallocates capacity
+  // buffers. When all are in use the pool grows and logs it once.
+  cv::Mat Take(const cv::Size& size, int type);
+  // True if image's buffer came from this pool.
+  bool Owns(const cv::Mat& image) const;
+  // Frees the buffers not in use, e.g. once it is clear the source hands
+  // out frames in its own memory.
+  void ReleaseUnused();
+
+ private:
+  class Allocator;
+  // Left alive past the pool while frames are still out, deleted with the
+  // last of them
+  Allocator* allocator_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // FRAME_POOL_H_
@@ -0,0 +1,79 @@
+#include "FrameScheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include "ThreadUtils.h"
+
+namespace CameraMarkerServer {
+namespace {
+// OS sleeps can overshoot by a scheduler tick, so the last stretch before a
+// deadline is spent yielding instead, except on real-time threads.
+const std::chrono::microseconds SPIN_MARGIN(2000);
+}  // namespace
+
+FrameScheduler::FrameScheduler(std::chrono::microseconds period)
+    : period_(std::max(period, std::chrono::microseconds(1))) {}
+
+void FrameScheduler::set_period(std::chrono::microseconds period) {
+  period_ = std::max(period, std::chrono::microseconds(1));
+}
+
+void FrameScheduler::WaitForNextFrame() {
+  using std::chrono::steady_clock;
+  steady_clock::time_point now = steady_clock::now();
+  if (!started_) {
+    started_ = true;
+    realtime_ = IsCurrentThreadRealtime();
+    next_deadline_ = now + period_;
+    return;
+  }
+  if (now > next_deadline_ + period_) {
+    int64_t missed = (now - next_deadline_) / period_;
+    missed_deadlines_ += missed;
+    next_deadline_ += period_ * missed;
+  }
+  if (realtime_) {
+    std::this_thread::sleep_until(next_deadline_);
+  } else if (next_deadline_ - now > SPIN_MARGIN) {
+    std::this_thread::sleep_until(next_deadline_ - SPIN_MARGIN);
+  }
+  while ((now = steady_clock::now()) < next_deadline_) {
+    std::this_thread::yield();
+  }
+
+  double lateness_us =
+      std::chrono::duration<double, std::micro>(now - next_deadline_).count();
+  frames_++;
+  double delta = lateness_us - lateness_mean_us_;
+  lateness_mean_us_ += delta / frames_;
+  lateness_m2_ += delta * (lateness_us - lateness_mean_us_);
+  max_lateness_us_ = std::max(max_lateness_us_, lateness_us);
+  next_deadline_ += period_;
+}
+
+void FrameScheduler::RecordWork(std::chrono::steady_clock::duration work) {
+  double usage = std::chrono::duration<double>(work).count() /
+                 std::chrono::duration<double>(period_).count();
+  budget_usage_ += BUDGET_SMOOTHING * (usage - budget_usage_);
+}
+
+JitterStats FrameScheduler::jitter_stats() const {
+  JitterStats stats;
+  stats.frames = frames_;
+  stats.missed_deadlines = missed_deadlines_;
+  stats.mean_lateness_us = lateness_mean_us_;
+  stats.stddev_lateness_us =
+      frames_ > 1 ? std::sqrt(lateness_m2_ / (frames_ - 1)) : 0;
+  stats.max_lateness_us = max_lateness_us_;
+  return stats;
+}
+
+void FrameScheduler::ResetJitterStats() {
+  frames_ = 0;
+  missed_deadlines_ = 0;
+  lateness_mean_us_ = 0;
+  lateness_m2_ = 0;
+  max_lateness_us_ = 0;
+}
+
+}  // namespace CameraMarkerServer
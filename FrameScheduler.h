@@ -0,0 +1,58 @@
+#ifndef FRAME_SCHEDULER_H_
+#define FRAME_SCHEDULER_H_
+#include <chrono>
+#include <cstdint>
+
+namespace CameraMarkerServer {
+struct JitterStats {
+  int64_t frames = 0;
+  int64_t missed_deadlines = 0;  // Deadlines skipped because work overran
+  double mean_lateness_us = 0;   // How late the loop woke up past a deadline
+  double stddev_lateness_us = 0;
+  double max_lateness_us = 0;
+};
+
+// Paces a loop against a fixed frame period instead of sleeping a fixed
+// delay on top of the work, and tracks how much of each period the work
+// uses so callers can shed optional work when they run over.
+class FrameScheduler {
+ public:
+  explicit FrameScheduler(std::chrono::microseconds period);
+
+  // Sleeps until the next deadline. When the work overran by whole periods
+  // the missed deadlines are dropped instead of bursting to catch up. On a
+  // real-time thread the whole wait is slept, a yield loop there would keep
+  // lower priority threads on the same CPU from running.
+  void WaitForNextFrame();
+  // Records how long the work for one frame took.
+  void RecordWork(std::chrono::steady_clock::duration work);
+
+  // Smoothed share of the period used by the work, 1.0 is the whole budget.
+  double budget_usage() const { return budget_usage_; }
+  bool IsOverBudget() const { return budget_usage_ > OVER_BUDGET_USAGE; }
+  std::chrono::microseconds period() const { return period_; }
+  void set_period(std::chrono::microseconds period);
+
+  JitterStats jitter_stats() const;
+  void ResetJitterStats();
+
+ private:
+  // Some headroom is kept for the scheduler's own wake up latency
+  static constexpr double OVER_BUDGET_USAGE = 0.9;
+  static constexpr double BUDGET_SMOOTHING = 0.1;
+
+  std::chrono::microseconds period_;
+  std::chrono::steady_clock::time_point next_deadline_;
+  bool started_ = false;
+  bool realtime_ = false;  // Of the waiting thread, checked on the first wait
+  double budget_usage_ = 0;
+
+  int64_t frames_ = 0;
+  int64_t missed_deadlines_ = 0;
+  double lateness_mean_us_ = 0;
+  double lateness_m2_ = 0;  // Running sum of squared deviations (Welford)
+  double max_lateness_us_ = 0;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // FRAME_SCHEDULER_H_
@@ -0,0 +1,287 @@
+#include "FrameSource.h"
+#include <initializer_list>
+#include <iostream>
+#include <thread>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "CalibrationSettings.h"
+#include "RawFrameRecording.h"
+
+namespace CameraMarkerServer {
+namespace {
+bool IsFourcc(int fourcc, std::initializer_list<const char*> codes) {
+  for (const char* code : codes) {
+    if (fourcc == cv::VideoWriter::fourcc(code[0], code[1], code[2], code[3])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Packed 4:2:2 formats that lead with chroma, so luminance is the second
+// byte of every pixel
+int PackedLumaChannel(int fourcc) {
+  return IsFourcc(fourcc, {"UYVY", "UYNV", "Y422", "HDYC"}) ? 1 : 0;
+}
+}  // namespace
+
+void ToGrayscale(const cv::Mat& image, cv::Mat& gray, int luma_channel) {
+  switch (image.channels()) {
+    case 1:
+      gray = image;
+      break;
+    case 2:
+      // Packed YUV 4:2:2, luminance is every other byte
+      cv::extractChannel(image, gray, luma_channel);
+      break;
+    case 3:
+      cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+      break;
+    default:
+      cv::cvtColor(image, gray, cv::COLOR_BGRA2GRAY);
+      break;
+  }
+}
+
+bool CameraFrameSource::Open() {
+  if (!capture_.open(camera_id_)) {
+    return false;
+  }
+  // The pixel format has to be chosen before the resolution, some drivers
+  // only offer high resolutions in compressed formats.
+  if (options_.fourcc.size() == 4) {
+    capture_.set(cv::CAP_PROP_FOURCC,
+                 cv::VideoWriter::fourcc(options_.fourcc[0], options_.fourcc[1],
+                                         options_.fourcc[2], options_.fourcc[3]));
+  }
+  if (options_.width > 0) capture_.set(cv::CAP_PROP_FRAME_WIDTH, options_.width);
+  if (options_.height > 0)
+    capture_.set(cv::CAP_PROP_FRAME_HEIGHT, options_.height);
+  if (options_.fps > 0) capture_.set(cv::CAP_PROP_FPS, options_.fps);
+  if (options_.buffer_size > 0)
+    capture_.set(cv::CAP_PROP_BUFFERSIZE, options_.buffer_size);
+  // Backends that honour this hand out the packed YUV frame, which holds
+  // the luminance plane without a BGR conversion
+  if (options_.grayscale) capture_.set(cv::CAP_PROP_CONVERT_RGB, 0);
+  fourcc_ = (int)capture_.get(cv::CAP_PROP_FOURCC);
+  luma_channel_ = PackedLumaChannel(fourcc_);
+  frame_size_ = FrameSize();
+  std::cout << "Camera " << camera_id_ << " capturing " << FrameSize()
+            << " at " << capture_.get(cv::CAP_PROP_FPS) << " fps" << std::endl;
+  start_time_ = std::chrono::steady_clock::now();
+  next_index_ = 0;
+  return true;
+}
+
+bool CameraFrameSource::Read(Frame& frame) {
+  if (options_.grayscale) {
+    if (!capture_.read(raw_) || raw_.empty()) {
+      return false;
+    }
+    // Without RGB conversion some backends hand out the driver buffer as a
+    // single row of bytes. JPEG decodes straight to its luminance plane;
+    // raw formats are only given their frame shape.
+    if (raw_.rows == 1 && IsFourcc(fourcc_, {"MJPG", "JPEG"})) {
+      cv::imdecode(raw_, cv::IMREAD_GRAYSCALE, &frame.image);
+      if (frame.image.empty()) {
+        return false;
+      }
+    } else if (raw_.rows == 1) {
+      const int channels = IsFourcc(fourcc_, {"GREY", "Y800"}) ? 1 : 2;
+      const size_t frame_bytes = (size_t)frame_size_.area() * channels;
+      if (frame_bytes == 0 || raw_.total() * raw_.elemSize() < frame_bytes) {
+        return false;
+      }
+      // Drivers may pad the buffer past the frame
+      ToGrayscale(raw_.colRange(0, (int)frame_bytes)
+                      .reshape(channels, frame_size_.height),
+                  frame.image, luma_channel_);
+    } else {
+      ToGrayscale(raw_, frame.image, luma_channel_);
+    }
+    // A gray driver frame is handed out as is and must not be reused
+    if (frame.image.data == raw_.data) raw_.release();
+  } else if (!capture_.read(frame.image) || frame.image.empty()) {
+    return false;
+  }
+  frame.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                           std::chrono::steady_clock::now() - start_time_)
+                           .count();
+  frame.index = next_index_++;
+  return true;
+}
+
+cv::Size CameraFrameSource::FrameSize() const {
+  return cv::Size((int)capture_.get(cv::CAP_PROP_FRAME_WIDTH),
+                  (int)capture_.get(cv::CAP_PROP_FRAME_HEIGHT));
+}
+
+bool VideoFileFrameSource::Open() {
+  next_index_ = 0;
+  return capture_.open(path_);
+}
+
+bool VideoFileFrameSource::Read(Frame& frame) {
+  if (!capture_.read(frame.image) || frame.image.empty()) {
+    return false;
+  }
+  frame.timestamp_us =
+      static_cast<int64_t>(capture_.get(cv::CAP_PROP_POS_MSEC) * 1000.0);
+  frame.index = next_index_++;
+  return true;
+}
+
+cv::Size VideoFileFrameSource::FrameSize() const {
+  return cv::Size((int)capture_.get(cv::CAP_PROP_FRAME_WIDTH),
+                  (int)capture_.get(cv::CAP_PROP_FRAME_HEIGHT));
+}
+
+bool VideoFileFrameSource::Reopen() {
+  next_index_ = 0;
+  return capture_.open(path_);
+}
+
+bool VideoFileFrameSource::Seek(int64_t frame_index) {
+  if (!capture_.isOpened()) {
+    return false;
+  }
+  if (frame_index == next_index_) {
+    return true;
+  }
+  if (seekable_) {
+    capture_.set(cv::CAP_PROP_POS_FRAMES, (double)frame_index);
+    if ((int64_t)capture_.get(cv::CAP_PROP_POS_FRAMES) == frame_index) {
+      next_index_ = frame_index;
+      return true;
+    }
+    // The failed seek may have left the decoder anywhere
+    seekable_ = false;
+    if (!Reopen()) {
+      return false;
+    }
+  }
+  if (frame_index < next_index_ && !Reopen()) {
+    return false;
+  }
+  for (; next_index_ < frame_index; next_index_++) {
+    if (!capture_.grab()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int64_t VideoFileFrameSource::FrameCount() const {
+  return (int64_t)capture_.get(cv::CAP_PROP_FRAME_COUNT);
+}
+
+cv::Size ImageListFrameSource::FrameSize() const {
+  // Images are assumed to share the size of the first one
+  if (image_list_.empty()) {
+    return cv::Size();
+  }
+  return cv::imread(image_list_.front(), cv::IMREAD_UNCHANGED).size();
+}
+
+bool ImageListFrameSource::Read(Frame& frame) {
+  if (!is_opened_ || at_image_ >= image_list_.size()) {
+    return false;
+  }
+  frame.image = cv::imread(image_list_[at_image_], cv::IMREAD_COLOR);
+  if (frame.image.empty()) {
+    std::cout << "Could not read image: \"" << image_list_[at_image_] << "\""
+              << std::endl;
+  }
+  frame.index = static_cast<int64_t>(at_image_);
+  frame.timestamp_us =
+      static_cast<int64_t>(at_image_) * frame_interval_ms_ * 1000;
+  at_image_++;
+  return !frame.image.empty();
+}
+
+bool GrayscaleFrameSource::Read(Frame& frame) {
+  if (!source_->Read(source_frame_)) {
+    return false;
+  }
+  ToGrayscale(source_frame_.image, frame.image);
+  if (frame.image.data == source_frame_.image.data) {
+    source_frame_.image.release();
+  }
+  frame.timestamp_us = source_frame_.timestamp_us;
+  frame.index = source_frame_.index;
+  return true;
+}
+
+bool FaultInjectingFrameSource::Open() {
+  frames_read_ = 0;
+  return source_->Open();
+}
+
+bool FaultInjectingFrameSource::Read(Frame& frame) {
+  if (options_.mode != FaultOptions::NONE &&
+      frames_read_ == options_.stall_after_frames) {
+    if (options_.mode == FaultOptions::EMPTY) {
+      return false;
+    }
+    std::cout << "Injected fault: blocking read for "
+              << options_.stall_duration.count() << " ms" << std::endl;
+    std::this_thread::sleep_for(options_.stall_duration);
+  }
+  if (!source_->Read(frame)) {
+    return false;
+  }
+  frames_read_++;
+  return true;
+}
+
+namespace {
+std::unique_ptr<FrameSource> CreateColorFrameSource(
+    const CalibrationSettings& s) {
+  switch (s.inputType) {
+    case CalibrationSettings::CAMERA:
+    {
+      CaptureOptions options;
+      options.width = s.captureWidth;
+      options.height = s.captureHeight;
+      options.fps = s.captureFps;
+      options.fourcc = s.captureFourcc;
+      options.buffer_size = s.captureBufferSize;
+      options.grayscale = s.captureGrayscale;
+      return std::make_unique<CameraFrameSource>(s.cameraID, options);
+    }
+    case CalibrationSettings::VIDEO_FILE:
+      return std::make_unique<VideoFileFrameSource>(s.input);
+    case CalibrationSettings::IMAGE_LIST:
+      return std::make_unique<ImageListFrameSource>(s.imageList, s.delay);
+    case CalibrationSettings::RAW_RECORDING:
+      return std::make_unique<RawRecordingFrameSource>(
+          s.input, s.replayMode == "MAX_SPEED"
+                       ? RawRecordingFrameSource::MAX_SPEED
+                       : RawRecordingFrameSource::REAL_TIME);
+    default:
+      return nullptr;
+  }
+}
+}  // namespace
+
+std::unique_ptr<FrameSource> CreateFrameSource(const CalibrationSettings& s) {
+  std::unique_ptr<FrameSource> source = CreateColorFrameSource(s);
+  if (!source) {
+    return nullptr;
+  }
+  if (s.captureGrayscale && s.inputType != CalibrationSettings::CAMERA) {
+    source = std::make_unique<GrayscaleFrameSource>(std::move(source));
+  }
+  if (s.faultMode == "BLOCK" || s.faultMode == "EMPTY") {
+    FaultOptions options;
+    options.mode =
+        s.faultMode == "BLOCK" ? FaultOptions::BLOCK : FaultOptions::EMPTY;
+    options.stall_after_frames = s.faultStallAfterFrames;
+    options.stall_duration = std::chrono::milliseconds(s.faultStallMs);
+    source = std::make_unique<FaultInjectingFrameSource>(std::move(source),
+                                                         options);
+  }
+  return source;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,186 @@
+#ifndef FRAME_SOURCE_H_
+#define FRAME_SOURCE_H_
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/videoio.hpp>
+
+namespace CameraMarkerServer {
+class CalibrationSettings;
+
+struct Frame {
+  cv::Mat image;             // BGR, or single channel luminance when the
+                             // source was opened for grayscale capture
+  int64_t timestamp_us = 0;  // Capture time relative to the start of the source
+  int64_t index = 0;         // Sequential frame number within the source
+};
+
+// A source of frames for the server or for calibration. Implementations hide
+// whether the frames come from a live camera, a decoded file, a list of
+// images or a raw recording.
+class FrameSource {
+ public:
+  virtual ~FrameSource() {}
+  virtual bool Open() = 0;
+  virtual bool IsOpened() const = 0;
+  // Reads the next frame. Returns false when no frame could be produced,
+  // which for non-live sources means the end of the input was reached.
+  virtual bool Read(Frame& frame) = 0;
+  // Live sources produce frames in real time and may hiccup; non-live
+  // sources can be read as fast as the consumer wants and eventually end.
+  virtual bool IsLive() const = 0;
+  // Resolution of the frames the opened source delivers.
+  virtual cv::Size FrameSize() const = 0;
+  virtual void Close() = 0;
+};
+
+// Capture format requested from a camera. Zero or empty fields keep the
+// driver's default.
+struct CaptureOptions {
+  int width = 0;
+  int height = 0;
+  double fps = 0;
+  std::string fourcc;   // Pixel format, e.g. "MJPG" or "YUYV"
+  int buffer_size = 0;  // Frames queued by the driver
+  bool grayscale = false;  // Deliver only the luminance plane
+};
+
+// Converts image to a single channel in gray. The Y plane of packed YUV
+// frames is extracted without a color conversion, from luma_channel: 0 for
+// YUYV, 1 for UYVY. Gray input is returned as a header without copying.
+// Otherwise gray is written in place when it already has the frame's size,
+// as the pooled buffers the camera pipeline reads frames into do.
+void ToGrayscale(const cv::Mat& image, cv::Mat& gray, int luma_channel = 0);
+
+class CameraFrameSource : public FrameSource {
+ public:
+  CameraFrameSource(int camera_id,
+                    const CaptureOptions& options = CaptureOptions())
+      : camera_id_(camera_id), options_(options) {}
+  bool Open() override;
+  bool IsOpened() const override { return capture_.isOpened(); }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return true; }
+  cv::Size FrameSize() const override;
+  void Close() override { capture_.release(); }
+
+ private:
+  int camera_id_;
+  CaptureOptions options_;
+  cv::VideoCapture capture_;
+  cv::Mat raw_;  // Driver frame before the grayscale conversion
+  int fourcc_ = 0;        // Pixel format the driver delivers
+  int luma_channel_ = 0;  // Of packed YUV driver frames
+  cv::Size frame_size_;   // Of the undecoded driver buffers
+  std::chrono::steady_clock::time_point start_time_;
+  int64_t next_index_ = 0;
+};
+
+class VideoFileFrameSource : public FrameSource {
+ public:
+  VideoFileFrameSource(const std::string& path) : path_(path) {}
+  bool Open() override;
+  bool IsOpened() const override { return capture_.isOpened(); }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return false; }
+  cv::Size FrameSize() const override;
+  void Close() override { capture_.release(); }
+
+  // Positions the source so that the next Read returns frame frame_index.
+  // Once the backend failed to seek frame accurately, the source decodes
+  // forward from its current frame instead, reopening the file only to go
+  // back, so the frames read are the same as without seeking.
+  bool Seek(int64_t frame_index);
+  // False once a seek was found not to be frame accurate.
+  bool IsSeekable() const { return seekable_; }
+  // Frame count reported by the container, which may be an estimate.
+  int64_t FrameCount() const;
+
+ private:
+  bool Reopen();
+
+  std::string path_;
+  cv::VideoCapture capture_;
+  int64_t next_index_ = 0;
+  bool seekable_ = true;
+};
+
+class ImageListFrameSource : public FrameSource {
+ public:
+  // Images carry no timestamps, so they are spaced frame_interval_ms apart.
+  ImageListFrameSource(const std::vector<std::string>& image_list,
+                       int frame_interval_ms)
+      : image_list_(image_list), frame_interval_ms_(frame_interval_ms) {}
+  bool Open() override { return is_opened_ = true; }
+  bool IsOpened() const override { return is_opened_; }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return false; }
+  cv::Size FrameSize() const override;
+  void Close() override { is_opened_ = false; }
+
+ private:
+  std::vector<std::string> image_list_;
+  int frame_interval_ms_;
+  size_t at_image_ = 0;
+  bool is_opened_ = false;
+};
+
+// Wraps another source and delivers its frames as grayscale, converting
+// each frame exactly once. Frames that already are gray pass through.
+class GrayscaleFrameSource : public FrameSource {
+ public:
+  GrayscaleFrameSource(std::unique_ptr<FrameSource> source)
+      : source_(std::move(source)) {}
+  bool Open() override { return source_->Open(); }
+  bool IsOpened() const override { return source_->IsOpened(); }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return source_->IsLive(); }
+  cv::Size FrameSize() const override { return source_->FrameSize(); }
+  void Close() override { source_->Close(); }
+
+ private:
+  std::unique_ptr<FrameSource> source_;
+  Frame source_frame_;
+};
+
+// Misbehaviour injected by FaultInjectingFrameSource.
+struct FaultOptions {
+  enum Mode {
+    NONE,
+    BLOCK,  // Read blocks for stall_duration, then frames flow again
+    EMPTY   // Read fails until the source is reopened
+  };
+  Mode mode = NONE;
+  int64_t stall_after_frames = 0;  // Good frames before the fault
+  std::chrono::milliseconds stall_duration{0};
+};
+
+// Wraps another source and makes it stall like a flaky USB camera, to
+// exercise the camera watchdog. The fault repeats for every opened source.
+class FaultInjectingFrameSource : public FrameSource {
+ public:
+  FaultInjectingFrameSource(std::unique_ptr<FrameSource> source,
+                            const FaultOptions& options)
+      : source_(std::move(source)), options_(options) {}
+  bool Open() override;
+  bool IsOpened() const override { return source_->IsOpened(); }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return source_->IsLive(); }
+  cv::Size FrameSize() const override { return source_->FrameSize(); }
+  void Close() override { source_->Close(); }
+
+ private:
+  std::unique_ptr<FrameSource> source_;
+  FaultOptions options_;
+  int64_t frames_read_ = 0;
+};
+
+// Creates the source described by the Input settings. The returned source is
+// not opened yet. Returns nullptr for an invalid input type.
+std::unique_ptr<FrameSource> CreateFrameSource(const CalibrationSettings& s);
+
+}  // namespace CameraMarkerServer
+#endif  // FRAME_SOURCE_H_
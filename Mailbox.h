@@ -0,0 +1,93 @@
+#ifndef MAILBOX_H_
+#define MAILBOX_H_
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+namespace CameraMarkerServer {
+// Single slot handoff between two pipeline stages. A lossy mailbox keeps
+// only the newest value, so a slow consumer always sees the latest frame. A
+// lossless mailbox makes the producer wait for the consumer instead, which
+// is what recorded inputs want so that every frame is processed.
+template <typename T>
+class Mailbox {
+ public:
+  explicit Mailbox(bool lossless, std::function<void()> on_put = nullptr)
+      : lossless_(lossless), on_put_(std::move(on_put)) {}
+
+  // Returns false if the mailbox was closed.
+  bool Put(T value) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (lossless_) {
+        space_cv_.wait(lock, [this] { return !slot_.has_value() || closed_; });
+      }
+      if (closed_) {
+        return false;
+      }
+      slot_ = std::move(value);
+    }
+    value_cv_.notify_one();
+    if (on_put_) {
+      on_put_();
+    }
+    return true;
+  }
+
+  // Waits up to timeout for a value. Returns false on timeout or once the
+  // mailbox is closed and drained.
+  bool Take(T& value, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!value_cv_.wait_for(lock, timeout,
+                            [this] { return slot_.has_value() || closed_; }) ||
+        !slot_.has_value()) {
+      return false;
+    }
+    return TakeLocked(value, lock);
+  }
+
+  bool TryTake(T& value) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!slot_.has_value()) {
+      return false;
+    }
+    return TakeLocked(value, lock);
+  }
+
+  // Wakes up all waiters. A value already in the slot can still be taken.
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    value_cv_.notify_all();
+    space_cv_.notify_all();
+  }
+
+  bool IsClosedAndEmpty() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return closed_ && !slot_.has_value();
+  }
+
+ private:
+  bool TakeLocked(T& value, std::unique_lock<std::mutex>& lock) {
+    value = std::move(*slot_);
+    slot_.reset();
+    lock.unlock();
+    space_cv_.notify_one();
+    return true;
+  }
+
+  const bool lossless_;
+  std::function<void()> on_put_;
+  mutable std::mutex mutex_;
+  std::condition_variable value_cv_;
+  std::condition_variable space_cv_;
+  std::optional<T> slot_;
+  bool closed_ = false;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // MAILBOX_H_
@@ -1,18 +1,153 @@
 // CameraMarkerClient.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include <asio.hpp>
 #include <opencv2/core/cuda.hpp>
+#include "Benchmarks.h"
 #include "Client.h"
+#include "DetectorAutotuner.h"
+#include "OfflineExtraction.h"
+#include "PoseLoadTest.h"
+#include "SelfTests.h"
 
-int main() {
+namespace {
+const std::string DEFAULT_CALIBRATION_FILE = "out_camera_data.xml";
+const std::string DEFAULT_DETECTOR_PARAMS_FILE = "detector_params.yml";
+
+void PrintUsage() {
+  std::cout << "Usage:" << std::endl
+            << "  CameraMarkerClient                      run the server"
+            << std::endl
+            << "  CameraMarkerClient --bench-undistortion [calibration.xml]"
+            << std::endl
+            << "  CameraMarkerClient --bench-pose-batch" << std::endl
+            << "  CameraMarkerClient --bench-calibration [calibration.xml]"
+            << std::endl
+            << "  CameraMarkerClient --offline <video|recording.vgraw> <poses.vgpose> "
+               "[--csv poses.csv] [--workers N] [--verify]"
+            << std::endl
+            << "    --verify checks the result against a sequential pass"
+            << std::endl
+            << "  CameraMarkerClient --autotune <clip|synthetic> "
+               "[detector_params.yml]"
+            << std::endl
+            << "  CameraMarkerClient --loadtest [--markers N] [--rate HZ] "
+               "[--subscribers N] [--encoding text|quantized] [--seconds S] "
+               "[--report S]"
+            << std::endl
+            << "    --seconds 0 soaks until stopped" << std::endl
+            << "  CameraMarkerClient --selftest-tiling" << std::endl
+            << "  CameraMarkerClient --selftest-watchdog" << std::endl;
+}
+
+// Parses the arguments following --offline. Returns false on bad usage.
+bool RunOffline(int argc, char** argv, int& exit_code) {
+  if (argc < 4) {
+    return false;
+  }
+  std::string csv_file;
+  CameraMarkerServer::OfflineOptions options;
+  for (int i = 4; i < argc; i++) {
+    const std::string flag = argv[i];
+    if (flag == "--verify") {
+      options.verify = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    if (flag == "--csv") {
+      csv_file = argv[++i];
+    } else if (flag == "--workers") {
+      options.workers = std::atoi(argv[++i]);
+    } else {
+      return false;
+    }
+  }
+  exit_code = CameraMarkerServer::RunOfflineExtraction(argv[2], argv[3],
+                                                       csv_file, options);
+  return true;
+}
+// Parses the arguments following --loadtest. Returns false on bad usage.
+bool RunLoadTest(int argc, char** argv, int& exit_code) {
+  CameraMarkerServer::PoseLoadTestOptions options;
+  for (int i = 2; i < argc; i++) {
+    const std::string flag = argv[i];
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const std::string value = argv[++i];
+    if (flag == "--markers") {
+      options.markers = std::atoi(value.c_str());
+    } else if (flag == "--rate") {
+      options.rate_hz = std::atof(value.c_str());
+    } else if (flag == "--subscribers") {
+      options.subscribers = std::atoi(value.c_str());
+    } else if (flag == "--encoding" && value == "quantized") {
+      options.encoding = CameraMarkerServer::PoseEncodingOptions();
+    } else if (flag == "--encoding" && value == "text") {
+      options.encoding.reset();
+    } else if (flag == "--seconds") {
+      options.duration = std::chrono::seconds(std::atoi(value.c_str()));
+    } else if (flag == "--report") {
+      options.report_interval = std::chrono::seconds(std::atoi(value.c_str()));
+    } else {
+      return false;
+    }
+  }
+  exit_code = CameraMarkerServer::RunPoseLoadTest(options);
+  return true;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
   // std::cout << "Hello World!\n";
   // asio::error_code ec;
   // asio::io_context context;
   //
   // asio::ip::udp::endpoint endpoint(asio::ip::make_address(ADDRESS, ec),
   // PORT);
+  const std::string mode = argc > 1 ? argv[1] : "";
+  if (mode == "--bench-undistortion") {
+    return CameraMarkerServer::RunUndistortionBenchmark(
+        argc > 2 ? argv[2] : DEFAULT_CALIBRATION_FILE);
+  }
+  if (mode == "--bench-pose-batch") {
+    return CameraMarkerServer::RunPoseBatchBenchmark();
+  }
+  if (mode == "--bench-calibration") {
+    return CameraMarkerServer::RunCalibrationBenchmark(
+        argc > 2 ? argv[2] : DEFAULT_CALIBRATION_FILE);
+  }
+  if (mode == "--selftest-tiling") {
+    return CameraMarkerServer::RunTiledDetectionSelfTest();
+  }
+  if (mode == "--selftest-watchdog") {
+    return CameraMarkerServer::RunWatchdogSelfTest();
+  }
+  if (mode == "--offline") {
+    int exit_code = 1;
+    if (RunOffline(argc, argv, exit_code)) {
+      return exit_code;
+    }
+  }
+  if (mode == "--loadtest") {
+    int exit_code = 1;
+    if (RunLoadTest(argc, argv, exit_code)) {
+      return exit_code;
+    }
+  }
+  if (mode == "--autotune" && argc > 2) {
+    return CameraMarkerServer::RunDetectorAutotune(
+        argv[2], argc > 3 ? argv[3] : DEFAULT_DETECTOR_PARAMS_FILE);
+  }
+  if (!mode.empty()) {
+    PrintUsage();
+    return 1;
+  }
   CameraMarkerServer::Client client;
   client.Run();
 }
@@ -0,0 +1,290 @@
+#include "MarkerDetector.h"
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+#include "FrameSource.h"
+
+namespace CameraMarkerServer {
+namespace {
+struct TileCandidate {
+  int id;
+  std::vector<cv::Point2f> corners;
+  cv::Point2f center;
+  float margin;  // Distance to the closest inner tile edge
+};
+
+cv::Point2f MarkerCenter(const std::vector<cv::Point2f>& corners) {
+  cv::Point2f sum(0.f, 0.f);
+  for (const cv::Point2f& corner : corners) {
+    sum += corner;
+  }
+  return sum * (1.f / corners.size());
+}
+
+// Distance from the marker to the tile edges that border another tile.
+// Edges on the image border do not count, a full frame pass is clipped there
+// as well.
+float InnerEdgeMargin(const std::vector<cv::Point2f>& corners,
+                      const cv::Rect& tile, const cv::Size& image_size) {
+  float margin = std::numeric_limits<float>::max();
+  for (const cv::Point2f& corner : corners) {
+    if (tile.x > 0) margin = std::min(margin, corner.x - tile.x);
+    if (tile.y > 0) margin = std::min(margin, corner.y - tile.y);
+    if (tile.x + tile.width < image_size.width)
+      margin = std::min(margin, tile.x + tile.width - corner.x);
+    if (tile.y + tile.height < image_size.height)
+      margin = std::min(margin, tile.y + tile.height - corner.y);
+  }
+  return margin;
+}
+
+void SortById(std::vector<std::vector<cv::Point2f>>& corners,
+              std::vector<int>& ids) {
+  std::vector<size_t> order(ids.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    if (ids[a] != ids[b]) return ids[a] < ids[b];
+    return corners[a].front().x < corners[b].front().x;
+  });
+  std::vector<std::vector<cv::Point2f>> sorted_corners(ids.size());
+  std::vector<int> sorted_ids(ids.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    sorted_corners[i] = std::move(corners[order[i]]);
+    sorted_ids[i] = ids[order[i]];
+  }
+  corners.swap(sorted_corners);
+  ids.swap(sorted_ids);
+}
+
+// ArUco converts every image it is given to gray. Converting once up front
+// keeps tiles, regions and the downscale from each converting a color copy.
+const cv::Mat& Grayscale(const cv::Mat& image, cv::Mat& gray) {
+  if (image.channels() == 1) {
+    return image;
+  }
+  ToGrayscale(image, gray);
+  return gray;
+}
+
+// Returns the image to search, resized into scaled when downscale < 1.
+const cv::Mat& Downscale(const cv::Mat& image, double downscale,
+                         cv::Mat& scaled) {
+  if (downscale >= 1.0) {
+    return image;
+  }
+  cv::resize(image, scaled, cv::Size(), downscale, downscale, cv::INTER_AREA);
+  return scaled;
+}
+
+void UpscaleCorners(std::vector<std::vector<cv::Point2f>>& corners,
+                    double downscale) {
+  if (downscale >= 1.0) {
+    return;
+  }
+  const float factor = (float)(1.0 / downscale);
+  for (std::vector<cv::Point2f>& marker : corners) {
+    for (cv::Point2f& corner : marker) {
+      corner *= factor;
+    }
+  }
+}
+
+cv::aruco::DetectorParameters WithoutCornerRefinement(
+    cv::aruco::DetectorParameters detection_params) {
+  detection_params.cornerRefinementMethod = cv::aruco::CORNER_REFINE_NONE;
+  return detection_params;
+}
+}  // namespace
+
+std::optional<cv::aruco::DetectorParameters> LoadDetectorParameters(
+    const std::string& file_name) {
+  cv::aruco::DetectorParameters detection_params;
+  if (file_name.empty()) {
+    return detection_params;
+  }
+  cv::FileStorage fs(file_name, cv::FileStorage::READ);
+  if (!fs.isOpened() || !detection_params.readDetectorParameters(fs.root())) {
+    return std::nullopt;
+  }
+  return detection_params;
+}
+
+MarkerDetector::MarkerDetector(
+    const cv::aruco::Dictionary& dictionary,
+    const cv::aruco::DetectorParameters& detection_params,
+    const TilingOptions& tiling, std::shared_ptr<const DetectionMask> mask)
+    : aruco_detector_(dictionary, detection_params),
+      unrefined_detector_(dictionary, WithoutCornerRefinement(detection_params)),
+      tiling_(tiling),
+      mask_(mask) {
+  tiling_.tiles_x = std::max(tiling_.tiles_x, 1);
+  tiling_.tiles_y = std::max(tiling_.tiles_y, 1);
+  tiling_.overlap = std::max(tiling_.overlap, 0);
+}
+
+void MarkerDetector::Detect(const cv::Mat& image,
+                            std::vector<std::vector<cv::Point2f>>& corners,
+                            std::vector<int>& ids,
+                            const DetectionOptions& options) const {
+  if (mask_) {
+    // The regions are searched in parallel like tiles, clipped to the tiles
+    // so a tiled setup keeps its work split
+    const std::vector<cv::Rect> tiles =
+        tiling_.IsTiled() && options.use_tiling
+            ? TileRects(image.size())
+            : std::vector<cv::Rect>{cv::Rect(cv::Point(0, 0), image.size())};
+    std::vector<cv::Rect> regions;
+    for (const cv::Rect& tile : tiles) {
+      for (const cv::Rect& region : mask_->regions()) {
+        const cv::Rect clipped = tile & region;
+        if (!clipped.empty()) {
+          regions.push_back(clipped);
+        }
+      }
+    }
+    DetectInRegions(image, regions, corners, ids, options);
+    return;
+  }
+  corners.clear();
+  ids.clear();
+  const cv::aruco::ArucoDetector& aruco_detector =
+      options.refine_corners ? aruco_detector_ : unrefined_detector_;
+  // Per thread, so the conversions reuse their buffers from frame to frame
+  thread_local cv::Mat gray;
+  thread_local cv::Mat scaled;
+  const cv::Mat& search_image =
+      Downscale(Grayscale(image, gray), options.downscale, scaled);
+  if (tiling_.IsTiled() && options.use_tiling) {
+    DetectRegions(search_image, TileRects(search_image.size()), aruco_detector,
+                  corners, ids);
+  } else {
+    aruco_detector.detectMarkers(search_image, corners, ids);
+  }
+  UpscaleCorners(corners, options.downscale);
+  SortById(corners, ids);
+}
+
+void MarkerDetector::DetectInRegions(
+    const cv::Mat& image, const std::vector<cv::Rect>& regions,
+    std::vector<std::vector<cv::Point2f>>& corners,
+    std::vector<int>& ids, const DetectionOptions& options) const {
+  corners.clear();
+  ids.clear();
+  thread_local cv::Mat gray;
+  thread_local cv::Mat scaled;
+  const cv::Mat& search_image =
+      Downscale(Grayscale(image, gray), options.downscale, scaled);
+  const double scale = std::min(options.downscale, 1.0);
+  const cv::Rect image_rect(cv::Point(0, 0), search_image.size());
+  std::vector<cv::Rect> clipped;
+  for (const cv::Rect& region : regions) {
+    cv::Rect scaled_region(cvFloor(region.x * scale), cvFloor(region.y * scale),
+                           cvCeil(region.width * scale),
+                           cvCeil(region.height * scale));
+    cv::Rect inside = scaled_region & image_rect;
+    if (!inside.empty()) {
+      clipped.push_back(inside);
+    }
+  }
+  DetectRegions(search_image, clipped,
+                options.refine_corners ? aruco_detector_ : unrefined_detector_,
+                corners, ids);
+  UpscaleCorners(corners, options.downscale);
+  RemoveMasked(corners, ids);
+  SortById(corners, ids);
+}
+
+void MarkerDetector::RemoveMasked(
+    std::vector<std::vector<cv::Point2f>>& corners,
+    std::vector<int>& ids) const {
+  if (!mask_) {
+    return;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (mask_->Contains(MarkerCenter(corners[i]))) {
+      corners[kept] = std::move(corners[i]);
+      ids[kept] = ids[i];
+      kept++;
+    }
+  }
+  corners.resize(kept);
+  ids.resize(kept);
+}
+
+std::vector<cv::Rect> MarkerDetector::TileRects(
+    const cv::Size& image_size) const {
+  std::vector<cv::Rect> tiles;
+  const cv::Rect image_rect(cv::Point(0, 0), image_size);
+  for (int ty = 0; ty < tiling_.tiles_y; ty++) {
+    for (int tx = 0; tx < tiling_.tiles_x; tx++) {
+      int x0 = image_size.width * tx / tiling_.tiles_x;
+      int x1 = image_size.width * (tx + 1) / tiling_.tiles_x;
+      int y0 = image_size.height * ty / tiling_.tiles_y;
+      int y1 = image_size.height * (ty + 1) / tiling_.tiles_y;
+      cv::Rect tile(cv::Point(x0 - tiling_.overlap, y0 - tiling_.overlap),
+                    cv::Point(x1 + tiling_.overlap, y1 + tiling_.overlap));
+      tiles.push_back(tile & image_rect);
+    }
+  }
+  return tiles;
+}
+
+void MarkerDetector::DetectRegions(
+    const cv::Mat& image, const std::vector<cv::Rect>& tiles,
+    const cv::aruco::ArucoDetector& aruco_detector,
+    std::vector<std::vector<cv::Point2f>>& corners,
+    std::vector<int>& ids) const {
+  std::vector<std::vector<TileCandidate>> tile_candidates(tiles.size());
+
+  cv::parallel_for_(cv::Range(0, (int)tiles.size()), [&](const cv::Range& range) {
+    for (int t = range.start; t < range.end; t++) {
+      const cv::Rect& tile = tiles[t];
+      std::vector<std::vector<cv::Point2f>> tile_corners;
+      std::vector<int> tile_ids;
+      // ROI views share the frame's pixels, nothing is copied per tile
+      aruco_detector.detectMarkers(image(tile), tile_corners, tile_ids);
+      const cv::Point2f offset((float)tile.x, (float)tile.y);
+      for (size_t i = 0; i < tile_ids.size(); i++) {
+        TileCandidate candidate;
+        candidate.id = tile_ids[i];
+        candidate.corners = std::move(tile_corners[i]);
+        for (cv::Point2f& corner : candidate.corners) {
+          corner += offset;
+        }
+        candidate.center = MarkerCenter(candidate.corners);
+        candidate.margin =
+            InnerEdgeMargin(candidate.corners, tile, image.size());
+        tile_candidates[t].push_back(std::move(candidate));
+      }
+    }
+  });
+
+  std::vector<TileCandidate> merged;
+  for (std::vector<TileCandidate>& candidates : tile_candidates) {
+    for (TileCandidate& candidate : candidates) {
+      // Two detections are the same marker when they share an id and their
+      // centers are closer than half the marker's side.
+      const float side = (float)cv::norm(candidate.corners[0] - candidate.corners[1]);
+      auto duplicate = std::find_if(
+          merged.begin(), merged.end(), [&](const TileCandidate& other) {
+            return other.id == candidate.id &&
+                   cv::norm(other.center - candidate.center) < side * 0.5f;
+          });
+      if (duplicate == merged.end()) {
+        merged.push_back(std::move(candidate));
+      } else if (candidate.margin > duplicate->margin) {
+        *duplicate = std::move(candidate);
+      }
+    }
+  }
+
+  for (TileCandidate& candidate : merged) {
+    ids.push_back(candidate.id);
+    corners.push_back(std::move(candidate.corners));
+  }
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,89 @@
+#ifndef MARKER_DETECTOR_H_
+#define MARKER_DETECTOR_H_
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/aruco.hpp>
+#include "DetectionMask.h"
+
+namespace CameraMarkerServer {
+// How a frame is split for tiled detection. A grid of 1x1 tiles runs a
+// single full frame pass.
+struct TilingOptions {
+  int tiles_x = 1;
+  int tiles_y = 1;
+  int overlap = 0;  // Pixels each tile extends into its neighbours
+
+  bool IsTiled() const { return tiles_x * tiles_y > 1; }
+};
+
+// Per call switches used to trade accuracy for speed.
+struct DetectionOptions {
+  double downscale = 1.0;      // Detect on a resized frame, corners are
+                               // reported in full resolution coordinates
+  bool use_tiling = true;      // Use the tile grid, if one is configured
+  bool refine_corners = true;  // Use the configured corner refinement
+};
+
+// Reads detector parameters written by the autotuner (--autotune). An empty
+// file name gives OpenCV's defaults. Returns nullopt if the file cannot be
+// read.
+std::optional<cv::aruco::DetectorParameters> LoadDetectorParameters(
+    const std::string& file_name);
+
+// Finds ArUco markers in a frame, either in one pass or by running the
+// tiles of the frame in parallel on OpenCV's thread pool. Markers that
+// straddle a seam are found by several tiles; only the copy that lies
+// furthest from its tile's inner edges is kept, which is the copy that saw
+// the same pixel neighbourhood as a full frame pass would.
+//
+// With a detection mask, only the mask's regions (clipped to the tiles, if
+// tiled) are searched and markers centered outside the mask are dropped.
+class MarkerDetector {
+ public:
+  MarkerDetector(const cv::aruco::Dictionary& dictionary,
+                 const cv::aruco::DetectorParameters& detection_params,
+                 const TilingOptions& tiling,
+                 std::shared_ptr<const DetectionMask> mask = nullptr);
+
+  // Accepts BGR or single channel frames; gray frames are searched without
+  // any conversion. Output is sorted by id, then by the x coordinate of the
+  // first corner.
+  void Detect(const cv::Mat& image,
+              std::vector<std::vector<cv::Point2f>>& corners,
+              std::vector<int>& ids,
+              const DetectionOptions& options = DetectionOptions()) const;
+
+  // Only searches the given regions of the frame, e.g. around the markers
+  // found in the previous frame. Markers found by several overlapping
+  // regions are reported once.
+  void DetectInRegions(const cv::Mat& image,
+                       const std::vector<cv::Rect>& regions,
+                       std::vector<std::vector<cv::Point2f>>& corners,
+                       std::vector<int>& ids,
+                       const DetectionOptions& options = DetectionOptions()) const;
+
+  const TilingOptions& tiling() const { return tiling_; }
+
+ private:
+  void DetectRegions(const cv::Mat& image, const std::vector<cv::Rect>& regions,
+                     const cv::aruco::ArucoDetector& aruco_detector,
+                     std::vector<std::vector<cv::Point2f>>& corners,
+                     std::vector<int>& ids) const;
+  std::vector<cv::Rect> TileRects(const cv::Size& image_size) const;
+  // Removes markers whose center lies outside the mask.
+  void RemoveMasked(std::vector<std::vector<cv::Point2f>>& corners,
+                    std::vector<int>& ids) const;
+
+  cv::aruco::ArucoDetector aruco_detector_;
+  // Same parameters without corner refinement
+  cv::aruco::ArucoDetector unrefined_detector_;
+  TilingOptions tiling_;
+  // Shared between copies, null without a mask
+  std::shared_ptr<const DetectionMask> mask_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // MARKER_DETECTOR_H_
@@ -0,0 +1,374 @@
+#include "OfflineExtraction.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <opencv2/core/utility.hpp>
+#include "CalibrationSettings.h"
+#include "CameraCalibratationUtils.h"
+#include "DetectionMask.h"
+#include "FrameSource.h"
+#include "RawFrameRecording.h"
+
+namespace CameraMarkerServer {
+namespace {
+const std::string SETTINGS_FILE = "Calibration/calibration_settings.xml";
+const uint32_t POSE_TABLE_VERSION = 2;
+const int64_t MIN_CHUNK_FRAMES = 120;
+// Chunks per worker, more chunks even out workers that hit slow stretches
+const int64_t CHUNKS_PER_WORKER = 8;
+
+template <typename T>
+void WriteColumn(std::ofstream& out, const std::vector<T>& column) {
+  out.write(reinterpret_cast<const char*>(column.data()),
+            column.size() * sizeof(T));
+}
+
+// Splits [0, frame_count) into chunks. The last chunk runs to the end of the
+// file, the container's frame count may be short.
+std::vector<std::pair<int64_t, int64_t>> SplitIntoChunks(int64_t frame_count,
+                                                         int64_t chunk_frames) {
+  std::vector<std::pair<int64_t, int64_t>> chunks;
+  for (int64_t start = 0; start < frame_count; start += chunk_frames) {
+    chunks.push_back(std::make_pair(start, start + chunk_frames));
+  }
+  if (chunks.empty()) {
+    chunks.push_back(std::make_pair(0, 0));
+  }
+  chunks.back().second = std::numeric_limits<int64_t>::max();
+  return chunks;
+}
+
+// A recorded input that seeks frame accurately: a video file, or a raw
+// recording such as a flight recorder dump.
+class ClipSource {
+ public:
+  explicit ClipSource(const std::string& path) {
+    if (CalibrationSettings::isRawRecording(path)) {
+      raw_ = std::make_unique<RawRecordingFrameSource>(
+          path, RawRecordingFrameSource::MAX_SPEED);
+    } else {
+      video_ = std::make_unique<VideoFileFrameSource>(path);
+    }
+  }
+  bool Open() { return source().Open(); }
+  bool Read(Frame& frame) { return source().Read(frame); }
+  cv::Size FrameSize() const { return source().FrameSize(); }
+  void Close() { source().Close(); }
+  bool Seek(int64_t frame_index) {
+    return raw_ ? raw_->Seek(frame_index) : video_->Seek(frame_index);
+  }
+  int64_t FrameCount() const {
+    return raw_ ? raw_->frame_count() : video_->FrameCount();
+  }
+  bool IsSeekable() const { return raw_ || video_->IsSeekable(); }
+
+ private:
+  FrameSource& source() const {
+    return raw_ ? static_cast<FrameSource&>(*raw_) : *video_;
+  }
+  std::unique_ptr<VideoFileFrameSource> video_;
+  std::unique_ptr<RawRecordingFrameSource> raw_;
+};
+
+std::optional<PoseDetector> CreateOfflineDetector(const cv::Size& frame_size) {
+  cv::FileStorage fs(SETTINGS_FILE, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    std::cout << "Could not open the configuration file: \"" << SETTINGS_FILE
+              << "\"" << std::endl;
+    return std::nullopt;
+  }
+  // Only the detector fields are needed, the configured input is not opened
+  CalibrationSettings s;
+  s.readFields(fs["Settings"]);
+  std::optional<cv::aruco::Dictionary> dictionary = CreateArucoDict(s);
+  if (!dictionary.has_value()) {
+    std::cout << "Could not parse aruco dictionary." << std::endl;
+    return std::nullopt;
+  }
+  if (!s.objectsGood ||
+      !CheckObjectIds(s.objects, dictionary->bytesList.rows)) {
+    std::cout << "Invalid Objects list in the configuration file" << std::endl;
+    return std::nullopt;
+  }
+  std::optional<CameraParameters> camera_params =
+      GetCameraParametersFromFile(s);
+  if (!camera_params.has_value() ||
+      camera_params->insintric_camera_parms.empty()) {
+    std::cout << "Could not read camera parameters from \""
+              << s.outputFileName << "\", calibrate the camera first"
+              << std::endl;
+    return std::nullopt;
+  }
+  camera_params = ScaleCameraParameters(camera_params.value(), frame_size);
+  if (!camera_params.has_value()) {
+    std::cout << "Video resolution " << frame_size
+              << " does not match the aspect ratio of the calibration"
+              << std::endl;
+    return std::nullopt;
+  }
+  std::optional<cv::aruco::DetectorParameters> detection_params =
+      LoadDetectorParameters(s.detectorParamsFile);
+  if (!detection_params.has_value()) {
+    std::cout << "Could not read detector parameters from \""
+              << s.detectorParamsFile << "\"" << std::endl;
+    return std::nullopt;
+  }
+
+  TilingOptions tiling;
+  tiling.tiles_x = s.detectTilesX;
+  tiling.tiles_y = s.detectTilesY;
+  tiling.overlap = s.detectTileOverlap;
+
+  std::shared_ptr<const DetectionMask> mask;
+  if (!DetectionMask::FromSettings(s, frame_size, mask)) {
+    return std::nullopt;
+  }
+  return PoseDetector(s.poseMarkerSize, dictionary.value(),
+                      detection_params.value(), camera_params.value(),
+                      tiling, s.objects, mask,
+                      PoseQualityOptions::FromSettings(s));
+}
+}  // namespace
+
+void PoseTable::Append(int64_t frame, int64_t timestamp,
+                       const PoseBatch& poses) {
+  for (size_t row = 0; row < poses.size(); row++) {
+    frame_index.push_back(frame);
+    timestamp_us.push_back(timestamp);
+    marker_id.push_back(poses.ids[row]);
+    const Pose p = poses.ExpandPose(row);
+    const double values[POSE_VALUE_COUNT] = {
+        p.translation[0], p.translation[1], p.translation[2],
+        p.forward[0],     p.forward[1],     p.forward[2],
+        p.up[0],          p.up[1],          p.up[2]};
+    for (size_t i = 0; i < POSE_VALUE_COUNT; i++) {
+      pose[i].push_back(values[i]);
+    }
+    confidence.push_back(poses.confidence[row]);
+  }
+}
+
+void PoseTable::Append(const PoseTable& other) {
+  frame_index.insert(frame_index.end(), other.frame_index.begin(),
+                     other.frame_index.end());
+  timestamp_us.insert(timestamp_us.end(), other.timestamp_us.begin(),
+                      other.timestamp_us.end());
+  marker_id.insert(marker_id.end(), other.marker_id.begin(),
+                   other.marker_id.end());
+  for (size_t i = 0; i < POSE_VALUE_COUNT; i++) {
+    pose[i].insert(pose[i].end(), other.pose[i].begin(), other.pose[i].end());
+  }
+  confidence.insert(confidence.end(), other.confidence.begin(),
+                    other.confidence.end());
+  frame_count += other.frame_count;
+}
+
+bool WritePoseTable(const std::string& path, const PoseTable& table) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+  PoseTableHeader header = {};
+  std::copy(POSE_TABLE_MAGIC, POSE_TABLE_MAGIC + 8, header.magic);
+  header.version = POSE_TABLE_VERSION;
+  header.pose_column_count = POSE_VALUE_COUNT;
+  header.frame_count = table.frame_count;
+  header.row_count = table.size();
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  WriteColumn(out, table.frame_index);
+  WriteColumn(out, table.timestamp_us);
+  WriteColumn(out, table.marker_id);
+  for (const std::vector<double>& column : table.pose) {
+    WriteColumn(out, column);
+  }
+  WriteColumn(out, table.confidence);
+  return out.good();
+}
+
+bool WritePoseCsv(const std::string& path, const PoseTable& table) {
+  std::ofstream out(path, std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+  out << "frame,timestamp_us,id";
+  for (const char* name : POSE_COLUMN_NAMES) {
+    out << "," << name;
+  }
+  out << ",confidence\n";
+  // Enough digits for the values to read back bit exact
+  out << std::setprecision(std::numeric_limits<double>::max_digits10);
+  for (size_t row = 0; row < table.size(); row++) {
+    out << table.frame_index[row] << "," << table.timestamp_us[row] << ","
+        << table.marker_id[row];
+    for (const std::vector<double>& column : table.pose) {
+      out << "," << column[row];
+    }
+    out << "," << table.confidence[row] << "\n";
+  }
+  return out.good();
+}
+
+std::optional<PoseTable> ExtractPoses(const std::string& video_file,
+                                      const PoseDetector& detector,
+                                      const OfflineOptions& options) {
+  ClipSource probe(video_file);
+  if (!probe.Open()) {
+    std::cout << "Could not open video \"" << video_file << "\"" << std::endl;
+    return std::nullopt;
+  }
+  const int64_t frame_count = std::max<int64_t>(probe.FrameCount(), 0);
+  // Without frame accurate seeking every chunk would decode forward from
+  // the start of the file. One worker takes the chunks in order instead,
+  // which decodes the file once.
+  const bool seekable =
+      frame_count == 0 || (probe.Seek(frame_count / 2) && probe.IsSeekable());
+  probe.Close();
+
+  int workers = options.workers > 0
+                    ? options.workers
+                    : std::max(1, (int)std::thread::hardware_concurrency());
+  if (!seekable) {
+    std::cout << "\"" << video_file
+              << "\" cannot seek frame accurately, decoding it in one pass"
+              << std::endl;
+    workers = 1;
+  }
+  const int64_t chunk_frames =
+      options.chunk_frames > 0
+          ? options.chunk_frames
+          : std::max(MIN_CHUNK_FRAMES,
+                     frame_count / (workers * CHUNKS_PER_WORKER) + 1);
+  const std::vector<std::pair<int64_t, int64_t>> chunks =
+      SplitIntoChunks(frame_count, chunk_frames);
+  std::vector<PoseTable> chunk_tables(chunks.size());
+  std::atomic<size_t> next_chunk(0);
+  std::atomic<bool> failed(false);
+
+  auto work = [&]() {
+    ClipSource source(video_file);
+    if (!source.Open()) {
+      failed = true;
+      return;
+    }
+    Frame frame;
+    PoseBatch poses;
+    for (size_t c = next_chunk++; c < chunks.size() && !failed;
+         c = next_chunk++) {
+      // A chunk past the real end of the file stays empty
+      if (!source.Seek(chunks[c].first)) {
+        continue;
+      }
+      PoseTable& table = chunk_tables[c];
+      for (int64_t i = chunks[c].first; i < chunks[c].second; i++) {
+        if (!source.Read(frame)) {
+          break;
+        }
+        poses.SetFromObservations(detector.DetectPoses(frame.image));
+        table.Append(frame.index, frame.timestamp_us, poses);
+        table.frame_count++;
+      }
+    }
+  };
+
+  // Frames are the unit of parallelism here, tiles of one frame would only
+  // compete with the other workers for the same cores.
+  const int previous_threads = cv::getNumThreads();
+  if (workers > 1) {
+    cv::setNumThreads(1);
+  }
+  std::vector<std::thread> threads;
+  for (int w = 0; w < workers; w++) {
+    threads.emplace_back(work);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  cv::setNumThreads(previous_threads);
+  if (failed) {
+    std::cout << "Could not decode video \"" << video_file << "\"" << std::endl;
+    return std::nullopt;
+  }
+
+  PoseTable table;
+  for (const PoseTable& chunk_table : chunk_tables) {
+    table.Append(chunk_table);
+  }
+  return table;
+}
+
+bool PoseTablesEqual(const PoseTable& a, const PoseTable& b) {
+  return a.frame_count == b.frame_count && a.frame_index == b.frame_index &&
+         a.timestamp_us == b.timestamp_us && a.marker_id == b.marker_id &&
+         a.pose == b.pose && a.confidence == b.confidence;
+}
+
+int RunOfflineExtraction(const std::string& video_file,
+                         const std::string& output_file,
+                         const std::string& csv_file,
+                         const OfflineOptions& options) {
+  ClipSource probe(video_file);
+  if (!probe.Open()) {
+    std::cout << "Could not open video \"" << video_file << "\"" << std::endl;
+    return 1;
+  }
+  const cv::Size frame_size = probe.FrameSize();
+  probe.Close();
+  std::optional<PoseDetector> detector = CreateOfflineDetector(frame_size);
+  if (!detector.has_value()) {
+    return 1;
+  }
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::optional<PoseTable> table =
+      ExtractPoses(video_file, detector.value(), options);
+  if (!table.has_value()) {
+    return 1;
+  }
+  const double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  std::cout << "Extracted " << table->size() << " poses from "
+            << table->frame_count << " frames in " << seconds << " s ("
+            << table->frame_count / std::max(seconds, 1e-9) << " frames/s)"
+            << std::endl;
+
+  if (options.verify) {
+    // A single chunk on a single worker is the plain sequential pass
+    OfflineOptions sequential;
+    sequential.workers = 1;
+    sequential.chunk_frames = std::numeric_limits<int64_t>::max();
+    std::optional<PoseTable> reference =
+        ExtractPoses(video_file, detector.value(), sequential);
+    if (!reference.has_value()) {
+      return 1;
+    }
+    if (!PoseTablesEqual(table.value(), reference.value())) {
+      std::cout << "Chunked extraction differs from a sequential pass ("
+                << table->size() << " rows in " << table->frame_count
+                << " frames against " << reference->size() << " rows in "
+                << reference->frame_count << " frames)" << std::endl;
+      return 1;
+    }
+    std::cout << "Chunked extraction matches a sequential pass" << std::endl;
+  }
+
+  if (!WritePoseTable(output_file, table.value())) {
+    std::cout << "Could not write \"" << output_file << "\"" << std::endl;
+    return 1;
+  }
+  if (!csv_file.empty() && !WritePoseCsv(csv_file, table.value())) {
+    std::cout << "Could not write \"" << csv_file << "\"" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+}  // namespace CameraMarkerServer
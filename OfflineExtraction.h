@@ -0,0 +1,87 @@
+#ifndef OFFLINE_EXTRACTION_H_
+#define OFFLINE_EXTRACTION_H_
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include "CameraDetector.h"
+#include "PoseBatch.h"
+
+// Offline pose extraction runs the pose detector over every frame of a
+// recorded video or raw recording (*.vgraw) and stores the poses as a pose table (*.vgpose):
+//
+//   PoseTableHeader
+//   int64   frame_index[row_count]
+//   int64   timestamp_us[row_count]
+//   int32   marker_id[row_count]
+//   float64 one column per POSE_COLUMN_NAMES entry, row_count values each
+//   float32 confidence[row_count], 0 to 1, since version 2
+//
+// Every row is one marker seen in one frame. Rows are ordered by frame
+// index, then by marker id.
+namespace CameraMarkerServer {
+
+const char POSE_TABLE_MAGIC[8] = {'V', 'G', 'P', 'O', 'S', 'E', 'S', '1'};
+const std::string POSE_TABLE_EXTENSION = ".vgpose";
+const size_t POSE_VALUE_COUNT = 9;
+const char* const POSE_COLUMN_NAMES[POSE_VALUE_COUNT] = {
+    "tx", "ty", "tz", "forward_x", "forward_y", "forward_z",
+    "up_x", "up_y", "up_z"};
+
+#pragma pack(push, 1)
+struct PoseTableHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t pose_column_count;  // POSE_VALUE_COUNT
+  uint64_t frame_count;        // Frames processed, with or without markers
+  uint64_t row_count;
+};
+#pragma pack(pop)
+
+// Pose rows held column by column, in the order they are written.
+struct PoseTable {
+  std::vector<int64_t> frame_index;
+  std::vector<int64_t> timestamp_us;
+  std::vector<int32_t> marker_id;
+  std::array<std::vector<double>, POSE_VALUE_COUNT> pose;
+  std::vector<float> confidence;
+  int64_t frame_count = 0;
+
+  size_t size() const { return marker_id.size(); }
+  // Appends every pose of poses as a row of frame.
+  void Append(int64_t frame, int64_t timestamp, const PoseBatch& poses);
+  void Append(const PoseTable& other);
+};
+
+bool WritePoseTable(const std::string& path, const PoseTable& table);
+bool WritePoseCsv(const std::string& path, const PoseTable& table);
+
+struct OfflineOptions {
+  int workers = 0;          // 0 uses every hardware thread
+  int64_t chunk_frames = 0; // Frames decoded per work item, 0 picks a size
+  bool verify = false;      // Also run one sequential pass and compare
+};
+
+// Detects the poses in every frame of video_file. Workers take chunks of
+// consecutive frames, each decoding its chunk with its own decoder. The
+// result does not depend on the number of workers: every frame is decoded
+// and detected exactly as a single pass over the file would. Files the
+// backend cannot seek frame accurately are decoded by one worker in one
+// pass.
+std::optional<PoseTable> ExtractPoses(const std::string& video_file,
+                                      const PoseDetector& detector,
+                                      const OfflineOptions& options);
+
+// True when both tables hold the same rows, bit for bit.
+bool PoseTablesEqual(const PoseTable& a, const PoseTable& b);
+
+// Command line entry, see Main.cpp. Reads the detector settings and the
+// calibration like the server does. csv_file may be empty.
+int RunOfflineExtraction(const std::string& video_file,
+                         const std::string& output_file,
+                         const std::string& csv_file,
+                         const OfflineOptions& options);
+
+}  // namespace CameraMarkerServer
+#endif  // OFFLINE_EXTRACTION_H_
@@ -0,0 +1,164 @@
+#include "PoseBatch.h"
+#include <cmath>
+
+namespace CameraMarkerServer {
+namespace {
+// Below this angle sin(theta/2)/theta is replaced by its Taylor series,
+// which avoids dividing by a vanishing angle
+const float SMALL_ANGLE = 1e-4f;
+}  // namespace
+
+void QuaternionAxes(const cv::Vec4d& q, cv::Vec3d& forward, cv::Vec3d& up) {
+  const double w = q[0], x = q[1], y = q[2], z = q[3];
+  forward = cv::Vec3d(2 * (x * z + y * w), 2 * (y * z - x * w),
+                      1 - 2 * (x * x + y * y));
+  up = cv::Vec3d(2 * (x * y - z * w), 1 - 2 * (x * x + z * z),
+                 2 * (y * z + x * w));
+}
+
+cv::Vec4d RotationQuaternion(const cv::Matx33d& m) {
+  cv::Vec4d q;
+  const double trace = m(0, 0) + m(1, 1) + m(2, 2);
+  if (trace > 0) {
+    const double s = 2 * std::sqrt(trace + 1);
+    q = cv::Vec4d(0.25 * s, (m(2, 1) - m(1, 2)) / s, (m(0, 2) - m(2, 0)) / s,
+                  (m(1, 0) - m(0, 1)) / s);
+  } else if (m(0, 0) > m(1, 1) && m(0, 0) > m(2, 2)) {
+    const double s = 2 * std::sqrt(1 + m(0, 0) - m(1, 1) - m(2, 2));
+    q = cv::Vec4d((m(2, 1) - m(1, 2)) / s, 0.25 * s, (m(0, 1) + m(1, 0)) / s,
+                  (m(0, 2) + m(2, 0)) / s);
+  } else if (m(1, 1) > m(2, 2)) {
+    const double s = 2 * std::sqrt(1 + m(1, 1) - m(0, 0) - m(2, 2));
+    q = cv::Vec4d((m(0, 2) - m(2, 0)) / s, (m(0, 1) + m(1, 0)) / s, 0.25 * s,
+                  (m(1, 2) + m(2, 1)) / s);
+  } else {
+    const double s = 2 * std::sqrt(1 + m(2, 2) - m(0, 0) - m(1, 1));
+    q = cv::Vec4d((m(1, 0) - m(0, 1)) / s, (m(0, 2) + m(2, 0)) / s,
+                  (m(1, 2) + m(2, 1)) / s, 0.25 * s);
+  }
+  return q / cv::norm(q);
+}
+
+void PoseBatch::Resize(size_t n) {
+  ids.resize(n);
+  qw.resize(n);
+  qx.resize(n);
+  qy.resize(n);
+  qz.resize(n);
+  tx.resize(n);
+  ty.resize(n);
+  tz.resize(n);
+  confidence.resize(n);
+  capture_time.resize(n);
+}
+
+void PoseBatch::Append(const PoseBatch& other, size_t i) {
+  ids.push_back(other.ids[i]);
+  qw.push_back(other.qw[i]);
+  qx.push_back(other.qx[i]);
+  qy.push_back(other.qy[i]);
+  qz.push_back(other.qz[i]);
+  tx.push_back(other.tx[i]);
+  ty.push_back(other.ty[i]);
+  tz.push_back(other.tz[i]);
+  confidence.push_back(other.confidence[i]);
+  capture_time.push_back(other.capture_time[i]);
+}
+
+void PoseBatch::Append(int id, const cv::Vec4d& quaternion,
+                       const cv::Vec3d& translation, float pose_confidence,
+                       std::chrono::steady_clock::time_point pose_capture_time) {
+  ids.push_back(id);
+  qw.push_back((float)quaternion[0]);
+  qx.push_back((float)quaternion[1]);
+  qy.push_back((float)quaternion[2]);
+  qz.push_back((float)quaternion[3]);
+  tx.push_back((float)translation[0]);
+  ty.push_back((float)translation[1]);
+  tz.push_back((float)translation[2]);
+  confidence.push_back(pose_confidence);
+  capture_time.push_back(pose_capture_time);
+}
+
+void PoseBatch::SetFromObservations(
+    const std::vector<MarkerObservation>& observations,
+    std::chrono::steady_clock::time_point pose_capture_time) {
+  const int n = (int)observations.size();
+  Resize(n);
+  // The rotation vectors are gathered into the x, y and z columns and
+  // turned into quaternions in place
+  for (int i = 0; i < n; i++) {
+    const MarkerObservation& observation = observations[i];
+    ids[i] = observation.id;
+    qx[i] = (float)observation.rvec[0];
+    qy[i] = (float)observation.rvec[1];
+    qz[i] = (float)observation.rvec[2];
+    tx[i] = (float)observation.tvec[0];
+    ty[i] = (float)observation.tvec[1];
+    tz[i] = (float)observation.tvec[2];
+    confidence[i] = observation.confidence;
+    capture_time[i] = pose_capture_time;
+  }
+  float* __restrict w = qw.data();
+  float* __restrict x = qx.data();
+  float* __restrict y = qy.data();
+  float* __restrict z = qz.data();
+  for (int i = 0; i < n; i++) {
+    const float theta_sq = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+    const float theta = std::sqrt(theta_sq);
+    const float half = 0.5f * theta;
+    // Both branches are computed and selected, keeping the loop vectorizable
+    const float series = 0.5f - theta_sq * (1.0f / 48.0f);
+    const float exact = std::sin(half) / (theta > SMALL_ANGLE ? theta : 1.0f);
+    const float scale = theta > SMALL_ANGLE ? exact : series;
+    w[i] = std::cos(half);
+    x[i] *= scale;
+    y[i] *= scale;
+    z[i] *= scale;
+  }
+}
+
+void PoseBatch::Transform(const RigidTransform& transform) {
+  if (transform.is_identity) {
+    return;
+  }
+  const cv::Vec4d r = RotationQuaternion(transform.rotation);
+  const float rw = (float)r[0], rx = (float)r[1], ry = (float)r[2],
+              rz = (float)r[3];
+  const cv::Matx33d& m = transform.rotation;
+  const float m00 = (float)m(0, 0), m01 = (float)m(0, 1), m02 = (float)m(0, 2);
+  const float m10 = (float)m(1, 0), m11 = (float)m(1, 1), m12 = (float)m(1, 2);
+  const float m20 = (float)m(2, 0), m21 = (float)m(2, 1), m22 = (float)m(2, 2);
+  const float ox = (float)transform.translation[0];
+  const float oy = (float)transform.translation[1];
+  const float oz = (float)transform.translation[2];
+  const int n = (int)size();
+  float* __restrict w = qw.data();
+  float* __restrict x = qx.data();
+  float* __restrict y = qy.data();
+  float* __restrict z = qz.data();
+  float* __restrict px = tx.data();
+  float* __restrict py = ty.data();
+  float* __restrict pz = tz.data();
+  for (int i = 0; i < n; i++) {
+    // r * q, the pose's rotation followed by the transform's
+    const float qw_i = w[i], qx_i = x[i], qy_i = y[i], qz_i = z[i];
+    w[i] = rw * qw_i - rx * qx_i - ry * qy_i - rz * qz_i;
+    x[i] = rw * qx_i + rx * qw_i + ry * qz_i - rz * qy_i;
+    y[i] = rw * qy_i - rx * qz_i + ry * qw_i + rz * qx_i;
+    z[i] = rw * qz_i + rx * qy_i - ry * qx_i + rz * qw_i;
+    const float tx_i = px[i], ty_i = py[i], tz_i = pz[i];
+    px[i] = m00 * tx_i + m01 * ty_i + m02 * tz_i + ox;
+    py[i] = m10 * tx_i + m11 * ty_i + m12 * tz_i + oy;
+    pz[i] = m20 * tx_i + m21 * ty_i + m22 * tz_i + oz;
+  }
+}
+
+Pose PoseBatch::ExpandPose(size_t i) const {
+  Pose pose;
+  QuaternionAxes(Quaternion(i), pose.forward, pose.up);
+  pose.translation = Translation(i);
+  return pose;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,101 @@
+#ifndef POSE_BATCH_H_
+#define POSE_BATCH_H_
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "CameraDetector.h"
+
+namespace CameraMarkerServer {
+// Column storage is aligned to a full AVX register so loops over a column
+// can use aligned vector loads.
+const size_t POSE_BATCH_ALIGNMENT = 32;
+
+template <typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+  AlignedAllocator() {}
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U>&) {}
+  template <typename U>
+  struct rebind {
+    typedef AlignedAllocator<U> other;
+  };
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(::operator new(
+        n * sizeof(T), std::align_val_t(POSE_BATCH_ALIGNMENT)));
+  }
+  void deallocate(T* p, size_t) {
+    ::operator delete(p, std::align_val_t(POSE_BATCH_ALIGNMENT));
+  }
+  template <typename U>
+  bool operator==(const AlignedAllocator<U>&) const { return true; }
+  template <typename U>
+  bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloats;
+
+// Forward (rotated z) and up (rotated y) axes of the unit quaternion
+// (w, x, y, z).
+void QuaternionAxes(const cv::Vec4d& q, cv::Vec3d& forward, cv::Vec3d& up);
+
+// Unit quaternion (w, x, y, z) of a rotation matrix.
+cv::Vec4d RotationQuaternion(const cv::Matx33d& rotation);
+
+// Poses of many markers as a structure of arrays: one float column per
+// quaternion and translation component, plus the id, confidence and capture
+// time of each pose. Rotations are kept as unit quaternions (w, x, y, z);
+// the forward and up axes of the text protocol are expanded from them only
+// when a pose is sent.
+//
+// Batches carry the pose stream from detection through the camera merge and
+// the filter to the outputs. A batch reused across frames keeps its
+// allocation once it has grown to the largest marker count seen.
+class PoseBatch {
+ public:
+  PoseBatch() {}
+
+  size_t size() const { return ids.size(); }
+  bool empty() const { return ids.empty(); }
+  void Clear() { Resize(0); }
+  void Resize(size_t n);
+
+  // Appends pose i of other.
+  void Append(const PoseBatch& other, size_t i);
+  void Append(int id, const cv::Vec4d& quaternion,
+              const cv::Vec3d& translation, float pose_confidence,
+              std::chrono::steady_clock::time_point pose_capture_time);
+
+  // Replaces the batch with the camera frame poses of observations, all
+  // captured at pose_capture_time. The rotation vectors of all markers are
+  // converted to quaternions in one pass; the loop has no branches and reads
+  // and writes whole columns, so the compiler vectorizes it across markers.
+  void SetFromObservations(
+      const std::vector<MarkerObservation>& observations,
+      std::chrono::steady_clock::time_point pose_capture_time =
+          std::chrono::steady_clock::time_point());
+  // Applies a rigid transform to all poses in one pass.
+  void Transform(const RigidTransform& transform);
+
+  cv::Vec4d Quaternion(size_t i) const {
+    return cv::Vec4d(qw[i], qx[i], qy[i], qz[i]);
+  }
+  cv::Vec3d Translation(size_t i) const {
+    return cv::Vec3d(tx[i], ty[i], tz[i]);
+  }
+  // Forward, up and translation of pose i, as the text protocol sends them.
+  Pose ExpandPose(size_t i) const;
+
+  std::vector<int32_t> ids;
+  AlignedFloats qw, qx, qy, qz;
+  AlignedFloats tx, ty, tz;
+  AlignedFloats confidence;
+  std::vector<std::chrono::steady_clock::time_point> capture_time;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_BATCH_H_
@@ -0,0 +1,284 @@
+#include "PoseEncoding.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "PoseBatch.h"
+
+namespace CameraMarkerServer {
+namespace {
+const size_t HEADER_SIZE = 14;
+const uint8_t DELTA_FLAG = 1;
+// The three smaller components of a unit quaternion lie within +-1/sqrt(2)
+const double COMPONENT_LIMIT = std::sqrt(0.5);
+const int COMPONENT_STEPS = 511;  // 10 bits per component, centered
+const int COMPONENT_BITS = 10;
+
+void PutU8(std::string& out, uint8_t value) { out.push_back((char)value); }
+
+void PutU16(std::string& out, uint16_t value) {
+  PutU8(out, value & 0xff);
+  PutU8(out, value >> 8);
+}
+
+void PutU32(std::string& out, uint32_t value) {
+  PutU16(out, value & 0xffff);
+  PutU16(out, value >> 16);
+}
+
+void PutVarint(std::string& out, uint64_t value) {
+  while (value >= 0x80) {
+    PutU8(out, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  PutU8(out, (uint8_t)value);
+}
+
+// Zigzag maps small negative and positive numbers to small varints.
+void PutSignedVarint(std::string& out, int64_t value) {
+  PutVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+class PacketReader {
+ public:
+  explicit PacketReader(const std::string& data) : data_(data) {}
+
+  bool ok() const { return ok_; }
+  bool AtEnd() const { return at_ == data_.size(); }
+
+  uint8_t U8() {
+    if (at_ >= data_.size()) {
+      ok_ = false;
+      return 0;
+    }
+    return (uint8_t)data_[at_++];
+  }
+  uint16_t U16() {
+    const uint16_t low = U8();
+    return low | (uint16_t)(U8() << 8);
+  }
+  uint32_t U32() {
+    const uint32_t low = U16();
+    return low | ((uint32_t)U16() << 16);
+  }
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64 && ok_; shift += 7) {
+      const uint8_t byte = U8();
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return 0;
+  }
+  int64_t SignedVarint() {
+    const uint64_t value = Varint();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+  }
+
+ private:
+  const std::string& data_;
+  size_t at_ = 0;
+  bool ok_ = true;
+};
+
+uint32_t PackRotation(const QuantizedPose& pose) {
+  return ((uint32_t)pose.largest << (3 * COMPONENT_BITS)) |
+         ((uint32_t)pose.rotation[0] << (2 * COMPONENT_BITS)) |
+         ((uint32_t)pose.rotation[1] << COMPONENT_BITS) |
+         (uint32_t)pose.rotation[2];
+}
+
+void UnpackRotation(uint32_t packed, QuantizedPose& pose) {
+  const uint32_t mask = (1u << COMPONENT_BITS) - 1;
+  pose.largest = (int)(packed >> (3 * COMPONENT_BITS));
+  pose.rotation[0] = (int)((packed >> (2 * COMPONENT_BITS)) & mask);
+  pose.rotation[1] = (int)((packed >> COMPONENT_BITS) & mask);
+  pose.rotation[2] = (int)(packed & mask);
+}
+}  // namespace
+
+QuantizedPose QuantizePose(const cv::Vec4d& rotation,
+                           const cv::Vec3d& translation, double resolution) {
+  QuantizedPose quantized;
+  for (int i = 0; i < 3; i++) {
+    quantized.translation[i] = std::llround(translation[i] / resolution);
+  }
+  // Batch quaternions are float, renormalized before the components are
+  // stepped
+  const cv::Vec4d q = cv::normalize(rotation);
+  quantized.largest = 0;
+  for (int i = 1; i < 4; i++) {
+    if (std::abs(q[i]) > std::abs(q[quantized.largest])) quantized.largest = i;
+  }
+  // q and -q are the same rotation; a positive largest component needs no
+  // sign bit
+  const double sign = q[quantized.largest] < 0 ? -1 : 1;
+  for (int i = 0, c = 0; i < 4; i++) {
+    if (i == quantized.largest) continue;
+    const long step =
+        std::lround(sign * q[i] / COMPONENT_LIMIT * COMPONENT_STEPS);
+    quantized.rotation[c++] =
+        (int)std::clamp(step, -(long)COMPONENT_STEPS, (long)COMPONENT_STEPS) +
+        COMPONENT_STEPS;
+  }
+  return quantized;
+}
+
+Pose DequantizePose(const QuantizedPose& quantized, double resolution) {
+  Pose pose;
+  for (int i = 0; i < 3; i++) {
+    pose.translation[i] = quantized.translation[i] * resolution;
+  }
+  cv::Vec4d q;
+  double sum_of_squares = 0;
+  for (int i = 0, c = 0; i < 4; i++) {
+    if (i == quantized.largest) continue;
+    q[i] = (double)(quantized.rotation[c++] - COMPONENT_STEPS) /
+           COMPONENT_STEPS * COMPONENT_LIMIT;
+    sum_of_squares += q[i] * q[i];
+  }
+  q[quantized.largest] = std::sqrt(std::max(0.0, 1 - sum_of_squares));
+  QuaternionAxes(q, pose.forward, pose.up);
+  return pose;
+}
+
+void PoseEncoder::Add(int id, const cv::Vec4d& rotation,
+                      const cv::Vec3d& translation, float confidence) {
+  // Quantize with the resolution as the receiver reads it from the header
+  const double resolution = (float)options_.resolution;
+  QuantizedPose quantized = QuantizePose(rotation, translation, resolution);
+  quantized.confidence =
+      (uint8_t)std::lround(std::clamp(confidence, 0.0f, 1.0f) * 255);
+  pending_.push_back(std::make_pair(id, quantized));
+}
+
+std::string PoseEncoder::Finish() {
+  std::string packet;
+  if (pending_.empty()) {
+    return packet;
+  }
+  const bool delta = has_previous_ &&
+                     (int)pending_.size() >= options_.delta_min_markers &&
+                     packets_since_key_ < options_.keyframe_interval;
+  packet.reserve(HEADER_SIZE + pending_.size() * 16);
+  packet.append(POSE_PACKET_MAGIC, 2);
+  PutU8(packet, POSE_PACKET_VERSION);
+  PutU8(packet, delta ? DELTA_FLAG : 0);
+  PutU16(packet, sequence_);
+  PutU16(packet, delta ? key_sequence_ : sequence_);
+  const float resolution = (float)options_.resolution;
+  uint32_t resolution_bits;
+  std::memcpy(&resolution_bits, &resolution, sizeof(resolution_bits));
+  PutU32(packet, resolution_bits);
+  PutU16(packet, (uint16_t)std::min<size_t>(pending_.size(), UINT16_MAX));
+
+  if (!delta) {
+    previous_.clear();
+  }
+  for (size_t i = 0; i < pending_.size() && i < UINT16_MAX; i++) {
+    const int id = pending_[i].first;
+    const QuantizedPose& pose = pending_[i].second;
+    std::unordered_map<int, QuantizedPose>::const_iterator base =
+        delta ? previous_.find(id) : previous_.end();
+    if (base != previous_.end() && base->second.largest == pose.largest) {
+      PutVarint(packet, ((uint64_t)id << 1) | 1);
+      for (int c = 0; c < 3; c++) {
+        PutSignedVarint(packet,
+                        pose.translation[c] - base->second.translation[c]);
+      }
+      for (int c = 0; c < 3; c++) {
+        PutSignedVarint(packet, pose.rotation[c] - base->second.rotation[c]);
+      }
+    } else {
+      PutVarint(packet, (uint64_t)id << 1);
+      for (int c = 0; c < 3; c++) {
+        PutSignedVarint(packet, pose.translation[c]);
+      }
+      PutU32(packet, PackRotation(pose));
+    }
+    PutU8(packet, pose.confidence);
+    if (!delta) {
+      previous_[id] = pose;
+    }
+  }
+  if (!delta) {
+    key_sequence_ = sequence_;
+    has_previous_ = true;
+  }
+  packets_since_key_ = delta ? packets_since_key_ + 1 : 0;
+  sequence_++;
+  pending_.clear();
+  return packet;
+}
+
+bool PoseDecoder::Decode(const std::string& packet,
+                         std::vector<DecodedPose>& poses) {
+  poses.clear();
+  PacketReader reader(packet);
+  if (packet.compare(0, 2, POSE_PACKET_MAGIC) != 0) {
+    return false;
+  }
+  reader.U16();
+  const uint8_t version = reader.U8();
+  const uint8_t flags = reader.U8();
+  const uint16_t sequence = reader.U16();
+  const uint16_t base_sequence = reader.U16();
+  const uint32_t resolution_bits = reader.U32();
+  const uint16_t count = reader.U16();
+  float resolution;
+  std::memcpy(&resolution, &resolution_bits, sizeof(resolution));
+  const bool delta = (flags & DELTA_FLAG) != 0;
+  if (!reader.ok() || version < 1 || version > POSE_PACKET_VERSION ||
+      !(resolution > 0) ||
+      (delta && (!has_previous_ || base_sequence != previous_sequence_))) {
+    return false;
+  }
+
+  std::unordered_map<int, QuantizedPose> current;
+  for (uint16_t i = 0; i < count && reader.ok(); i++) {
+    const uint64_t key = reader.Varint();
+    const int id = (int)(key >> 1);
+    QuantizedPose pose;
+    if (key & 1) {
+      std::unordered_map<int, QuantizedPose>::const_iterator base =
+          previous_.find(id);
+      if (!delta || base == previous_.end()) {
+        return false;
+      }
+      pose = base->second;
+      for (int c = 0; c < 3; c++) {
+        pose.translation[c] += reader.SignedVarint();
+      }
+      for (int c = 0; c < 3; c++) {
+        pose.rotation[c] += (int)reader.SignedVarint();
+      }
+    } else {
+      for (int c = 0; c < 3; c++) {
+        pose.translation[c] = reader.SignedVarint();
+      }
+      UnpackRotation(reader.U32(), pose);
+    }
+    pose.confidence = version >= 2 ? reader.U8() : 255;
+    if (!delta) {
+      current[id] = pose;
+    }
+    poses.push_back(DecodedPose{id, DequantizePose(pose, resolution),
+                                pose.confidence / 255.0f});
+  }
+  if (!reader.ok() || !reader.AtEnd()) {
+    poses.clear();
+    return false;
+  }
+  // Delta packets leave the base alone, the next one is relative to the
+  // same key packet
+  if (!delta) {
+    previous_.swap(current);
+    previous_sequence_ = sequence;
+    has_previous_ = true;
+  }
+  return true;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,103 @@
+#ifndef POSE_ENCODING_H_
+#define POSE_ENCODING_H_
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "CameraDetector.h"
+
+namespace CameraMarkerServer {
+// Quantized pose packets, an alternative to one text packet per pose.
+//
+// A packet carries all poses sent in one frame. Little endian layout:
+//   char[2]  "VQ", text packets start with a marker id or "status"
+//   uint8    version
+//   uint8    flags, bit 0 set for a delta packet
+//   uint16   sequence number
+//   uint16   sequence number of the key packet a delta packet is relative to
+//   float32  translation resolution in Pose_Marker_Size units per step
+//   uint16   pose count
+// followed by each pose:
+//   varint   id << 1 | 1 if this pose is a delta against the key packet
+//   absolute: zigzag varint x, y, z in resolution steps, then uint32
+//             smallest-three quaternion: index of the largest component in
+//             bits 30-31, the other three in 10 bits each
+//   delta:    zigzag varint differences of the same six integers to the
+//             marker's pose in the base packet
+//   uint8     confidence, 0 to 255 for 0 to 1, not delta encoded
+// Delta packets are relative to the last key packet, not to each other, so
+// a lost delta packet costs only its own poses. A marker is delta encoded
+// only if it was in the key packet with the same largest quaternion
+// component. A receiver that missed the key packet drops delta packets
+// until the next one. Version 1 packets have no confidence byte; their
+// poses decode with confidence 1.
+const char POSE_PACKET_MAGIC[] = "VQ";
+const uint8_t POSE_PACKET_VERSION = 2;
+
+struct PoseEncodingOptions {
+  double resolution = 0.1;  // Translation step in Pose_Marker_Size units
+  // Frames with fewer markers are always key packets, a delta saves too
+  // little on them
+  int delta_min_markers = 8;
+  int keyframe_interval = 30;  // Packets between key packets
+};
+
+struct DecodedPose {
+  int id;
+  Pose pose;
+  float confidence;
+};
+
+// A pose reduced to the integers that go on the wire.
+struct QuantizedPose {
+  int64_t translation[3];
+  int largest;         // Index of the dropped quaternion component
+  int rotation[3];     // The other three, 0 to 1022
+  uint8_t confidence = 255;
+};
+
+// rotation is a quaternion (w, x, y, z).
+QuantizedPose QuantizePose(const cv::Vec4d& rotation,
+                           const cv::Vec3d& translation, double resolution);
+Pose DequantizePose(const QuantizedPose& quantized, double resolution);
+
+// Builds packets from the poses of successive frames. Not thread safe, one
+// encoder per stream.
+class PoseEncoder {
+ public:
+  explicit PoseEncoder(const PoseEncodingOptions& options) : options_(options) {}
+
+  // rotation is a quaternion (w, x, y, z), as PoseBatch keeps them.
+  void Add(int id, const cv::Vec4d& rotation, const cv::Vec3d& translation,
+           float confidence = 1);
+  bool empty() const { return pending_.empty(); }
+  // Encodes the poses added since the last call into one packet.
+  std::string Finish();
+
+ private:
+  PoseEncodingOptions options_;
+  std::vector<std::pair<int, QuantizedPose>> pending_;
+  // Poses of the last key packet, the base of the delta packets after it
+  std::unordered_map<int, QuantizedPose> previous_;
+  uint16_t sequence_ = 0;
+  uint16_t key_sequence_ = 0;
+  int packets_since_key_ = 0;
+  bool has_previous_ = false;
+};
+
+// Receiving side of PoseEncoder, for consumers and tools.
+class PoseDecoder {
+ public:
+  // Returns false for a malformed packet or a delta packet whose base is
+  // not the last decoded key packet.
+  bool Decode(const std::string& packet, std::vector<DecodedPose>& poses);
+
+ private:
+  // Poses and sequence number of the last key packet
+  std::unordered_map<int, QuantizedPose> previous_;
+  uint16_t previous_sequence_ = 0;
+  bool has_previous_ = false;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_ENCODING_H_
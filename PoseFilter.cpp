@@ -0,0 +1,126 @@
+#include "PoseFilter.h"
+#include <algorithm>
+
+namespace CameraMarkerServer {
+namespace {
+const double PI = 3.14159265358979323846;
+
+// Weight of a new sample in an exponential smoother with the given cutoff
+double SmoothingFactor(double cutoff_hz, double dt) {
+  const double tau = 1.0 / (2 * PI * cutoff_hz);
+  return 1.0 / (1.0 + tau / dt);
+}
+
+// Filters a value and its velocity with a cutoff that rises with speed.
+// speed_scale turns the velocity's norm into the units beta is given in.
+template <typename Vec>
+void OneEuroStep(Vec& value, Vec& velocity, const Vec& measured, double dt,
+                 double min_cutoff_hz, double beta, double speed_scale,
+                 double derivative_alpha) {
+  const Vec raw_velocity = (measured - value) / dt;
+  velocity += derivative_alpha * (raw_velocity - velocity);
+  const double cutoff = min_cutoff_hz + beta * speed_scale * cv::norm(velocity);
+  value += SmoothingFactor(cutoff, dt) * (measured - value);
+}
+
+// q and -q are the same rotation; the one on value's side is blended, so
+// the filter never averages across the sign flip
+cv::Vec4d AlignedQuaternion(const cv::Vec4d& q, const cv::Vec4d& value) {
+  return q.dot(value) < 0 ? -q : q;
+}
+}  // namespace
+
+PoseFilter::PoseFilter(const PoseFilterOptions& options)
+    : options_(options),
+      states_(std::make_unique<std::array<MarkerState, MAX_MARKER_ID>>()) {}
+
+void PoseFilter::Update(const PoseBatch& poses) {
+  passthrough_.Clear();
+  for (size_t i = 0; i < poses.size(); i++) {
+    const int id = poses.ids[i];
+    if (id < 0 || id >= MAX_MARKER_ID) {
+      passthrough_.Append(poses, i);
+      continue;
+    }
+    MarkerState& state = (*states_)[id];
+    const std::chrono::steady_clock::time_point capture_time =
+        poses.capture_time[i];
+    const bool lost =
+        capture_time - state.last_measurement > options_.max_extrapolation;
+    if (!state.active || lost) {
+      // Start over rather than blending with where the marker was long ago
+      state.active = true;
+      state.last_measurement = capture_time;
+      state.confidence = poses.confidence[i];
+      state.translation = poses.Translation(i);
+      state.rotation = poses.Quaternion(i);
+      state.translation_velocity = cv::Vec3d();
+      state.rotation_velocity = cv::Vec4d();
+      continue;
+    }
+    const double dt =
+        std::chrono::duration<double>(capture_time - state.last_measurement)
+            .count();
+    if (dt <= 0) {
+      continue;
+    }
+    Filter(state, poses.Translation(i), poses.Quaternion(i), dt);
+    state.last_measurement = capture_time;
+    state.confidence = poses.confidence[i];
+  }
+}
+
+void PoseFilter::Filter(MarkerState& state, const cv::Vec3d& translation,
+                        const cv::Vec4d& rotation, double dt) const {
+  const double derivative_alpha =
+      SmoothingFactor(options_.derivative_cutoff_hz, dt);
+  // Translation moves in marker units per second. A unit quaternion changes
+  // at half the angular speed, so its speed is doubled to radians per second.
+  OneEuroStep(state.translation, state.translation_velocity, translation, dt,
+              options_.min_cutoff_hz, options_.translation_beta, 1.0,
+              derivative_alpha);
+  OneEuroStep(state.rotation, state.rotation_velocity,
+              AlignedQuaternion(rotation, state.rotation), dt,
+              options_.min_cutoff_hz, options_.rotation_beta, 2.0,
+              derivative_alpha);
+  state.rotation = cv::normalize(state.rotation);
+}
+
+void PoseFilter::Predict(std::chrono::steady_clock::time_point now,
+                         PoseBatch& output) const {
+  output.Clear();
+  const std::chrono::steady_clock::time_point target = now + options_.prediction;
+  for (int id = 0; id < MAX_MARKER_ID; id++) {
+    const MarkerState& state = (*states_)[id];
+    if (!state.active ||
+        now - state.last_measurement > options_.max_extrapolation) {
+      continue;
+    }
+    // Extrapolation is bounded, a constant velocity guess goes wrong fast
+    const double horizon =
+        std::chrono::duration<double>(
+            std::clamp<std::chrono::steady_clock::duration>(
+                target - state.last_measurement,
+                std::chrono::steady_clock::duration::zero(),
+                options_.max_extrapolation))
+            .count();
+    output.Append(
+        id, cv::normalize(state.rotation + state.rotation_velocity * horizon),
+        state.translation + state.translation_velocity * horizon,
+        state.confidence, state.last_measurement);
+  }
+  for (size_t i = 0; i < passthrough_.size(); i++) {
+    if (now - passthrough_.capture_time[i] <= options_.max_extrapolation) {
+      output.Append(passthrough_, i);
+    }
+  }
+}
+
+void PoseFilter::Reset() {
+  for (MarkerState& state : *states_) {
+    state.active = false;
+  }
+  passthrough_.Clear();
+}
+
+}  // namespace CameraMarkerServer
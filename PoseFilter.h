@@ -0,0 +1,78 @@
+#ifndef POSE_FILTER_H_
+#define POSE_FILTER_H_
+#include <array>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "PoseBatch.h"
+
+namespace CameraMarkerServer {
+struct PoseFilterOptions {
+  double min_cutoff_hz = 1.0;   // Smoothing of a marker at rest, lower is
+                                // smoother but lags more
+  // How quickly smoothing drops with speed, per marker unit per second for
+  // translation and per radian per second for rotation
+  double translation_beta = 0.005;
+  double rotation_beta = 0.5;
+  double derivative_cutoff_hz = 1.0;
+  // Extra time the output is predicted past the send time, e.g. to cover
+  // the network and the game's own frame.
+  std::chrono::microseconds prediction{0};
+  // Longest a pose is extrapolated past its last detection. Markers unseen
+  // for longer are no longer output.
+  std::chrono::microseconds max_extrapolation{50000};
+};
+
+// Per marker One-Euro filter with a constant velocity model. Measurements
+// are smoothed with a cutoff that rises with the marker's speed, so markers
+// at rest stop jittering while fast motion is followed with little lag.
+// Output poses are predicted from the capture time of their last detection
+// to the send time, which also fills in frames where a marker was missed.
+//
+// State is a fixed table indexed by marker id, allocated once. Predefined
+// dictionaries stay below MAX_MARKER_ID; larger ids from custom
+// dictionaries are passed through unfiltered.
+class PoseFilter {
+ public:
+  static const int MAX_MARKER_ID = 1024;
+
+  PoseFilter(const PoseFilterOptions& options);
+
+  // Feeds the merged poses. Poses that are not newer than the marker's last
+  // measurement, e.g. results merged again, are ignored.
+  void Update(const PoseBatch& poses);
+
+  // Writes the filtered pose of every tracked marker predicted to now plus
+  // the configured prediction, with the confidence and capture time of its
+  // last detection. output is cleared first and keeps its capacity, so
+  // steady state calls do not allocate.
+  void Predict(std::chrono::steady_clock::time_point now,
+               PoseBatch& output) const;
+
+  void Reset();
+
+ private:
+  // The translation and the rotation quaternion are filtered as vectors;
+  // the quaternion is renormalized after every step
+  struct MarkerState {
+    bool active = false;
+    std::chrono::steady_clock::time_point last_measurement;
+    cv::Vec3d translation;
+    cv::Vec4d rotation;               // Unit quaternion (w, x, y, z)
+    cv::Vec3d translation_velocity;   // Units per second
+    cv::Vec4d rotation_velocity;      // Quaternion change per second
+    float confidence = 1;
+  };
+
+  void Filter(MarkerState& state, const cv::Vec3d& translation,
+              const cv::Vec4d& rotation, double dt) const;
+
+  PoseFilterOptions options_;
+  std::unique_ptr<std::array<MarkerState, MAX_MARKER_ID>> states_;
+  // Poses of ids beyond the table, with their capture times
+  PoseBatch passthrough_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_FILTER_H_
@@ -0,0 +1,483 @@
+#include "PoseLoadTest.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <asio/io_service.hpp>
+#include <asio/ip/udp.hpp>
+#include "FrameScheduler.h"
+#include "PoseBatch.h"
+#include "PoseOutput.h"
+#include "ThreadUtils.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace CameraMarkerServer {
+namespace {
+using asio::ip::udp;
+
+// The last marker of every frame carries the frame number modulo this in
+// its x translation, so receivers can look up when the frame was sent
+const int64_t STAMP_PERIOD = 65536;
+// One microsecond each; the last bucket collects everything slower
+const size_t LATENCY_BUCKETS = 100000;
+const size_t MAX_PACKET_SIZE = 65536;
+const int RECEIVE_BUFFER_BYTES = 4 << 20;
+const std::chrono::milliseconds STOP_RETRY_INTERVAL(10);
+const char STOP_PACKET[] = "stop";
+// Soak limits, against the baseline interval
+const double MIN_RATE_SHARE = 0.95;
+const double MAX_CPU_GROWTH = 1.5;
+const double MAX_MEMORY_GROWTH_MB = 32;
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Resident memory of the process, 0 where it cannot be read.
+double ResidentMemoryMb() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                            sizeof(counters))) {
+    return 0;
+  }
+  return counters.WorkingSetSize / (1024.0 * 1024.0);
+#else
+  std::ifstream statm("/proc/self/statm");
+  long total_pages = 0;
+  long resident_pages = 0;
+  if (!(statm >> total_pages >> resident_pages)) {
+    return 0;
+  }
+  return resident_pages * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+#endif
+}
+
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(LATENCY_BUCKETS, 0) {}
+
+  void Add(int64_t latency_ns) {
+    const size_t bucket =
+        std::min<size_t>(std::max<int64_t>(latency_ns / 1000, 0),
+                         LATENCY_BUCKETS - 1);
+    counts_[bucket]++;
+    count_++;
+  }
+  void Add(const LatencyHistogram& other) {
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+      counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+  }
+  void Clear() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+  }
+  int64_t count() const { return count_; }
+  // Upper bound in microseconds of the bucket holding the given fraction of
+  // the samples
+  int64_t Percentile(double fraction) const {
+    const int64_t rank = (int64_t)std::ceil(fraction * count_);
+    int64_t seen = 0;
+    for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+      seen += counts_[i];
+      if (seen >= rank && seen > 0) {
+        return (int64_t)i + 1;
+      }
+    }
+    return 0;
+  }
+
+ private:
+  std::vector<int64_t> counts_;
+  int64_t count_ = 0;
+};
+
+// Frames in the test move on smooth paths like tracked props do, so that
+// quantized packets see realistic deltas.
+void SyntheticPoses(int64_t frame, double rate_hz, int markers,
+                    PoseBatch& poses) {
+  const double t = frame / rate_hz;
+  poses.Clear();
+  for (int i = 0; i < markers; i++) {
+    const double phase = t + 0.7 * i;
+    const double heading = 0.5 * phase;
+    // A turn about up that points forward at (cos(heading), 0, sin(heading))
+    const double angle = 0.5 * CV_PI - heading;
+    poses.Append(i,
+                 cv::Vec4d(std::cos(0.5 * angle), 0, std::sin(0.5 * angle), 0),
+                 cv::Vec3d(2.0 * (i % 8) + std::cos(phase),
+                           1.5 + 0.2 * std::sin(2 * phase),
+                           2.0 * (i / 8) + std::sin(phase)),
+                 1.0f, std::chrono::steady_clock::time_point());
+  }
+  poses.tx.back() = (float)(frame % STAMP_PERIOD);
+}
+
+// A subscriber stand-in. Decodes every packet like a consumer would and
+// times the frame stamps.
+class Receiver {
+ public:
+  Receiver(asio::io_service& io_service, int stamp_id, bool quantized,
+           const std::atomic<int64_t>* send_times)
+      : socket_(io_service),
+        waker_(io_service),
+        stamp_id_(stamp_id),
+        quantized_(quantized),
+        send_times_(send_times),
+        running_(false),
+        finished_(false),
+        packets_(0),
+        stamps_(0),
+        undecodable_(0) {}
+
+  bool Open() {
+    asio::error_code error;
+    socket_.open(udp::v4(), error);
+    if (!error) {
+      socket_.bind(udp::endpoint(asio::ip::address_v4::loopback(), 0), error);
+    }
+    if (!error) {
+      // The kernel may cap it; drops are then counted, not hidden
+      socket_.set_option(
+          asio::socket_base::receive_buffer_size(RECEIVE_BUFFER_BYTES), error);
+      error = asio::error_code();
+    }
+    if (error) {
+      std::cout << "Could not open a receiver socket: " << error.message()
+                << std::endl;
+      return false;
+    }
+    return waker_.OpenConnection(endpoint());
+  }
+  udp::endpoint endpoint() const {
+    asio::error_code error;
+    return socket_.local_endpoint(error);
+  }
+
+  void Start() {
+    running_ = true;
+    thread_ = std::thread(&Receiver::Loop, this);
+  }
+  // The receive blocks, so the receiver is sent packets until it notices
+  void Stop() {
+    running_ = false;
+    while (thread_.joinable() && !finished_) {
+      waker_.Send(STOP_PACKET);
+      std::this_thread::sleep_for(STOP_RETRY_INTERVAL);
+    }
+    if (thread_.joinable()) thread_.join();
+  }
+
+  int64_t packets() const { return packets_; }
+  int64_t stamps() const { return stamps_; }
+  int64_t undecodable() const { return undecodable_; }
+  // Moves the latencies recorded since the last call into histogram.
+  void TakeLatencies(LatencyHistogram& histogram) {
+    std::lock_guard<std::mutex> lock(latency_mutex_);
+    histogram.Add(latencies_);
+    latencies_.Clear();
+  }
+
+ private:
+  void Loop() {
+    SetCurrentThreadName("loadtest:receive");
+    std::vector<char> buffer(MAX_PACKET_SIZE);
+    std::vector<DecodedPose> poses;
+    while (running_) {
+      udp::endpoint sender;
+      asio::error_code error;
+      const size_t size =
+          socket_.receive_from(asio::buffer(buffer), sender, 0, error);
+      const int64_t received_ns = NowNs();
+      if (error || !running_) {
+        continue;
+      }
+      packets_++;
+      const std::string packet(buffer.data(), size);
+      double stamp = -1;
+      if (quantized_) {
+        if (!decoder_.Decode(packet, poses)) {
+          undecodable_++;
+          continue;
+        }
+        for (const DecodedPose& pose : poses) {
+          if (pose.id == stamp_id_) {
+            stamp = pose.pose.translation[0];
+          }
+        }
+      } else {
+        // id_[forward]_[up]_[translation]_confidence, the x translation
+        // follows the last bracket
+        const size_t translation = packet.rfind('[');
+        if (std::atoi(packet.c_str()) == stamp_id_ &&
+            translation != std::string::npos) {
+          stamp = std::strtod(packet.c_str() + translation + 1, nullptr);
+        }
+      }
+      if (stamp < 0) {
+        continue;
+      }
+      stamps_++;
+      const int64_t sent_ns =
+          send_times_[std::llround(stamp) % STAMP_PERIOD].load(
+              std::memory_order_relaxed);
+      if (sent_ns > 0 && received_ns >= sent_ns) {
+        std::lock_guard<std::mutex> lock(latency_mutex_);
+        latencies_.Add(received_ns - sent_ns);
+      }
+    }
+    finished_ = true;
+  }
+
+  udp::socket socket_;
+  UDPClient waker_;
+  const int stamp_id_;
+  const bool quantized_;
+  const std::atomic<int64_t>* send_times_;
+  PoseDecoder decoder_;
+  std::thread thread_;
+  std::atomic<bool> running_;
+  std::atomic<bool> finished_;
+  std::atomic<int64_t> packets_;
+  std::atomic<int64_t> stamps_;
+  std::atomic<int64_t> undecodable_;
+  std::mutex latency_mutex_;
+  LatencyHistogram latencies_;
+};
+
+// Counters summed over all receivers.
+struct ReceivedTotals {
+  int64_t packets = 0;
+  int64_t stamps = 0;
+  int64_t undecodable = 0;
+};
+
+ReceivedTotals SumReceivers(
+    const std::vector<std::unique_ptr<Receiver>>& receivers) {
+  ReceivedTotals totals;
+  for (const std::unique_ptr<Receiver>& receiver : receivers) {
+    totals.packets += receiver->packets();
+    totals.stamps += receiver->stamps();
+    totals.undecodable += receiver->undecodable();
+  }
+  return totals;
+}
+
+double DropPercent(int64_t sent, int64_t received) {
+  return sent > 0 ? std::max<int64_t>(sent - received, 0) * 100.0 / sent : 0;
+}
+
+std::string LatencySummary(const LatencyHistogram& latencies) {
+  std::ostringstream os;
+  os << "latency p50/p95/p99/max (us): " << latencies.Percentile(0.5) << "/"
+     << latencies.Percentile(0.95) << "/" << latencies.Percentile(0.99) << "/"
+     << latencies.Percentile(1.0);
+  if (latencies.Percentile(1.0) >= (int64_t)LATENCY_BUCKETS) {
+    os << "+";
+  }
+  return os.str();
+}
+}  // namespace
+
+int RunPoseLoadTest(const PoseLoadTestOptions& options) {
+  if (options.markers < 1 || options.subscribers < 1 ||
+      !(options.rate_hz > 0) || options.report_interval.count() < 1) {
+    std::cout << "Invalid load test options" << std::endl;
+    return 1;
+  }
+  const bool quantized = options.encoding.has_value();
+  const int stamp_id = options.markers - 1;
+  // Datagrams each subscriber gets per frame
+  const int packets_per_frame = quantized ? 1 : options.markers;
+  std::unique_ptr<std::atomic<int64_t>[]> send_times(
+      new std::atomic<int64_t>[STAMP_PERIOD]);
+  for (int64_t i = 0; i < STAMP_PERIOD; i++) {
+    send_times[i] = 0;
+  }
+
+  asio::io_service io_service;
+  std::vector<std::unique_ptr<Receiver>> receivers;
+  Outputs outputs;
+  for (int i = 0; i < options.subscribers; i++) {
+    receivers.push_back(std::make_unique<Receiver>(io_service, stamp_id,
+                                                   quantized, send_times.get()));
+    outputs.push_back(std::make_unique<UDPClient>(io_service));
+    if (!receivers.back()->Open() ||
+        !outputs.back()->OpenConnection(receivers.back()->endpoint())) {
+      return 1;
+    }
+    receivers.back()->Start();
+  }
+  std::cout << "Sending " << options.markers << " markers at "
+            << options.rate_hz << " Hz as "
+            << (quantized ? "quantized" : "text") << " packets to "
+            << options.subscribers << " local subscriber(s)";
+  if (options.duration.count() > 0) {
+    std::cout << " for " << options.duration.count() << " s";
+  }
+  std::cout << std::endl;
+
+  SetCurrentThreadName("loadtest:send");
+  const std::chrono::microseconds period(
+      (int64_t)std::llround(1e6 / options.rate_hz));
+  FrameScheduler scheduler(period);
+  std::optional<PoseEncoder> encoder;
+  if (quantized) {
+    encoder.emplace(options.encoding.value());
+  }
+  PoseBatch poses;
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point interval_start = start;
+  // Only the send path counts, not the scheduler's wait for the next frame,
+  // which spins close to the deadline
+  std::chrono::nanoseconds interval_send_cpu(0);
+  ReceivedTotals interval_received;
+  int64_t interval_frames = 0;
+  int64_t total_frames = 0;
+  int64_t intervals = 0;
+  int64_t missed_deadlines = 0;
+  LatencyHistogram interval_latencies;
+  LatencyHistogram total_latencies;
+  // Taken after the first interval, once the process has warmed up
+  double baseline_cpu_us = 0;
+  double baseline_memory_mb = 0;
+  const double start_memory_mb = ResidentMemoryMb();
+  std::vector<std::string> failures;
+
+  while (options.duration.count() == 0 ||
+         std::chrono::steady_clock::now() - start < options.duration) {
+    scheduler.WaitForNextFrame();
+    const std::chrono::steady_clock::time_point work_start =
+        std::chrono::steady_clock::now();
+    SyntheticPoses(total_frames, options.rate_hz, options.markers, poses);
+    send_times[total_frames % STAMP_PERIOD].store(NowNs(),
+                                                  std::memory_order_relaxed);
+    const std::chrono::nanoseconds send_cpu_start = CurrentThreadCpuTime();
+    SendPoses(outputs, encoder, MAX_TEXT_VERSION, poses);
+    FlushPoses(outputs, encoder);
+    interval_send_cpu += CurrentThreadCpuTime() - send_cpu_start;
+    scheduler.RecordWork(std::chrono::steady_clock::now() - work_start);
+    total_frames++;
+    interval_frames++;
+
+    const std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (now - interval_start < options.report_interval) {
+      continue;
+    }
+    const double seconds =
+        std::chrono::duration<double>(now - interval_start).count();
+    const int64_t sent =
+        interval_frames * packets_per_frame * options.subscribers;
+    const double cpu_us_per_packet =
+        std::chrono::duration<double, std::micro>(interval_send_cpu).count() /
+        std::max<int64_t>(sent, 1);
+    const ReceivedTotals received_totals = SumReceivers(receivers);
+    const int64_t received =
+        received_totals.packets - interval_received.packets;
+    const int64_t stamps = received_totals.stamps - interval_received.stamps;
+    const int64_t undecodable =
+        received_totals.undecodable - interval_received.undecodable;
+    interval_latencies.Clear();
+    for (std::unique_ptr<Receiver>& receiver : receivers) {
+      receiver->TakeLatencies(interval_latencies);
+    }
+    total_latencies.Add(interval_latencies);
+    const JitterStats jitter = scheduler.jitter_stats();
+    missed_deadlines += jitter.missed_deadlines;
+    scheduler.ResetJitterStats();
+    const double memory_mb = ResidentMemoryMb();
+    intervals++;
+
+    std::cout << std::fixed << std::setprecision(2) << "["
+              << std::chrono::duration_cast<std::chrono::seconds>(now - start)
+                     .count()
+              << " s] sent " << sent / seconds << " packets/s, received "
+              << received / seconds << " packets/s, dropped "
+              << DropPercent(sent, received) << "% of packets and "
+              << DropPercent(interval_frames * options.subscribers, stamps)
+              << "% of frames, " << undecodable << " undecodable, "
+              << "missed deadlines " << jitter.missed_deadlines << ", CPU "
+              << cpu_us_per_packet << " us/packet, "
+              << LatencySummary(interval_latencies) << ", memory "
+              << memory_mb << " MB" << std::defaultfloat << std::endl;
+
+    // Every packet lost or late counts against the throughput; the first
+    // interval includes the warm up and only sets the baseline
+    const double target_rate =
+        options.rate_hz * packets_per_frame * options.subscribers;
+    if (intervals == 1) {
+      baseline_cpu_us = cpu_us_per_packet;
+      baseline_memory_mb = memory_mb;
+    } else {
+      std::ostringstream failure;
+      if (received / seconds < MIN_RATE_SHARE * target_rate) {
+        failure << "throughput " << received / seconds << " of "
+                << target_rate << " packets/s";
+      } else if (cpu_us_per_packet > MAX_CPU_GROWTH * baseline_cpu_us) {
+        failure << "CPU per packet grew from " << baseline_cpu_us << " to "
+                << cpu_us_per_packet << " us";
+      } else if (memory_mb - baseline_memory_mb > MAX_MEMORY_GROWTH_MB) {
+        failure << "memory grew from " << baseline_memory_mb << " to "
+                << memory_mb << " MB";
+      }
+      if (!failure.str().empty()) {
+        std::cout << "Soak limit exceeded: " << failure.str() << std::endl;
+        failures.push_back(failure.str());
+      }
+    }
+    interval_start = now;
+    interval_send_cpu = std::chrono::nanoseconds(0);
+    interval_received = received_totals;
+    interval_frames = 0;
+  }
+
+  for (std::unique_ptr<Receiver>& receiver : receivers) {
+    receiver->Stop();
+  }
+  for (std::unique_ptr<Receiver>& receiver : receivers) {
+    receiver->TakeLatencies(total_latencies);
+  }
+  const ReceivedTotals totals = SumReceivers(receivers);
+  const int64_t sent = total_frames * packets_per_frame * options.subscribers;
+  std::cout << "Sent " << total_frames << " frames, " << sent
+            << " packets; dropped " << DropPercent(sent, totals.packets)
+            << "% of packets, " << totals.undecodable << " undecodable, "
+            << missed_deadlines << " missed deadlines, "
+            << LatencySummary(total_latencies) << ", memory "
+            << start_memory_mb << " -> " << ResidentMemoryMb() << " MB"
+            << std::endl;
+  if (!failures.empty()) {
+    std::cout << "Soak failed in " << failures.size() << " of " << intervals
+              << " intervals" << std::endl;
+    return 1;
+  }
+  std::cout << "Soak passed" << std::endl;
+  return 0;
+}
+
+}  // namespace CameraMarkerServer
@@ -0,0 +1,31 @@
+#ifndef POSE_LOAD_TEST_H_
+#define POSE_LOAD_TEST_H_
+#include <chrono>
+#include <optional>
+#include "PoseEncoding.h"
+
+// Load test of the output side, run from the command line instead of the
+// server, see Main.cpp. Synthetic poses go through the server's own
+// serialization and UDPClient send path to local receivers standing in for
+// the subscribers.
+namespace CameraMarkerServer {
+
+struct PoseLoadTestOptions {
+  int markers = 32;
+  double rate_hz = 120;  // Frames per second, each sending every marker
+  int subscribers = 1;
+  std::optional<PoseEncodingOptions> encoding;  // Text packets if not set
+  std::chrono::seconds duration{60};  // 0 runs until the process is stopped
+  std::chrono::seconds report_interval{10};
+};
+
+// Reports the sustained packet rate, the CPU time the send path spends per
+// packet, the drop rate and the latency percentiles every report interval.
+// Run for hours it doubles as a soak test: intervals whose throughput falls
+// short of the target, whose CPU per packet grows or during which the
+// process grew in memory past the baseline taken after the first interval
+// are reported, and fail the run. Returns the process exit code.
+int RunPoseLoadTest(const PoseLoadTestOptions& options);
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_LOAD_TEST_H_
@@ -0,0 +1,43 @@
+#include "PoseMerger.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <utility>
+
+namespace CameraMarkerServer {
+
+// static
+double PoseMerger::ObservationScore(const MarkerObservation& observation) {
+  // The offset keeps a perfect fit from dominating regardless of size
+  const double REPROJECTION_ERROR_FLOOR = 0.1;
+  return std::sqrt(observation.pixel_area) * std::cos(observation.view_angle) /
+         (observation.reprojection_error + REPROJECTION_ERROR_FLOOR);
+}
+
+void PoseMerger::Merge(
+    const std::vector<std::optional<CameraResult>>& latest_results,
+    std::chrono::steady_clock::time_point now, PoseBatch& merged) const {
+  // Result and row of the best pose of every id
+  std::map<int, std::pair<const CameraResult*, size_t>> best;
+  std::map<int, double> best_score;
+  for (const std::optional<CameraResult>& result : latest_results) {
+    if (!result.has_value() || now - result->capture_time > max_age_) {
+      continue;
+    }
+    for (size_t i = 0; i < result->observations.size(); i++) {
+      const MarkerObservation& observation = result->observations[i];
+      double score = ObservationScore(observation);
+      auto it = best_score.find(observation.id);
+      if (it == best_score.end() || score > it->second) {
+        best_score[observation.id] = score;
+        best[observation.id] = std::make_pair(&result.value(), i);
+      }
+    }
+  }
+  merged.Clear();
+  for (const auto& entry : best) {
+    merged.Append(entry.second.first->poses, entry.second.second);
+  }
+}
+
+}  // namespace CameraMarkerServer
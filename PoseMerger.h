@@ -0,0 +1,34 @@
+#ifndef POSE_MERGER_H_
+#define POSE_MERGER_H_
+#include <chrono>
+#include <optional>
+#include <vector>
+#include "CameraPipeline.h"
+#include "CameraDetector.h"
+#include "PoseBatch.h"
+
+namespace CameraMarkerServer {
+// Combines the latest world frame poses of every camera into one batch with
+// a single pose per marker id.
+class PoseMerger {
+ public:
+  PoseMerger(std::chrono::milliseconds max_age) : max_age_(max_age) {}
+
+  // Results captured more than max_age before now are ignored. When several
+  // cameras see the same id the pose whose observation scores best wins.
+  // merged is cleared first and keeps its allocation.
+  void Merge(const std::vector<std::optional<CameraResult>>& latest_results,
+             std::chrono::steady_clock::time_point now,
+             PoseBatch& merged) const;
+
+  // Larger, better fitting markers facing the camera score higher: the
+  // score grows with the marker's side length in pixels and falls with its
+  // reprojection error and view angle.
+  static double ObservationScore(const MarkerObservation& observation);
+
+ private:
+  std::chrono::milliseconds max_age_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_MERGER_H_
@@ -0,0 +1,53 @@
+#include "PoseOutput.h"
+#include <iomanip>
+#include <sstream>
+#include "Tracing.h"
+
+namespace CameraMarkerServer {
+
+void SendToAll(Outputs& outputs, const std::string& message) {
+  TRACE_SPAN("send");
+  for (std::unique_ptr<UDPClient>& output : outputs) {
+    output->Send(message);
+  }
+}
+
+void SendPoses(Outputs& outputs, std::optional<PoseEncoder>& encoder,
+               int text_version, const PoseBatch& poses) {
+  if (encoder.has_value()) {
+    TRACE_SPAN("serialize");
+    for (size_t i = 0; i < poses.size(); i++) {
+      encoder->Add(poses.ids[i], poses.Quaternion(i), poses.Translation(i),
+                   poses.confidence[i]);
+    }
+    return;
+  }
+  for (size_t i = 0; i < poses.size(); i++) {
+    std::ostringstream os;
+    {
+      TRACE_SPAN("serialize");
+      const Pose pose = poses.ExpandPose(i);
+      if (text_version >= 2) {
+        os << poses.ids[i] << "_";
+      }
+      os << pose.forward << "_" << pose.up << "_" << pose.translation;
+      if (text_version >= 3) {
+        os << "_" << std::fixed << std::setprecision(2) << poses.confidence[i];
+      }
+    }
+    SendToAll(outputs, os.str());
+  }
+}
+
+void FlushPoses(Outputs& outputs, std::optional<PoseEncoder>& encoder) {
+  if (encoder.has_value() && !encoder->empty()) {
+    std::string packet;
+    {
+      TRACE_SPAN("serialize");
+      packet = encoder->Finish();
+    }
+    SendToAll(outputs, packet);
+  }
+}
+
+}  // namespace CameraMarkerServer
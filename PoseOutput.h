@@ -0,0 +1,37 @@
+#ifndef POSE_OUTPUT_H_
+#define POSE_OUTPUT_H_
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "PoseBatch.h"
+#include "PoseEncoding.h"
+#include "UdpServerConnection.h"
+
+// The server's send path: pose serialization and the UDP outputs it goes
+// to. Shared by the send loop and the pose load test.
+namespace CameraMarkerServer {
+
+using Outputs = std::vector<std::unique_ptr<UDPClient>>;
+
+// Text pose packet layouts, picked with Encoding_TextVersion so receivers
+// written against an older layout keep working:
+//   1  forward_up_translation, the single marker layout, without the id
+//   2  id_forward_up_translation
+//   3  id_forward_up_translation_confidence, the confidence with two
+//      decimals
+const int MAX_TEXT_VERSION = 3;
+
+void SendToAll(Outputs& outputs, const std::string& message);
+
+// Sends every pose of the batch right away as a text packet of
+// text_version, or adds them to the frame's quantized packet. Forward and up
+// are only expanded from the quaternions for text packets.
+void SendPoses(Outputs& outputs, std::optional<PoseEncoder>& encoder,
+               int text_version, const PoseBatch& poses);
+
+// Sends the frame's quantized packet, if poses were added to it.
+void FlushPoses(Outputs& outputs, std::optional<PoseEncoder>& encoder);
+
+}  // namespace CameraMarkerServer
+#endif  // POSE_OUTPUT_H_
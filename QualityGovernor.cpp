@@ -0,0 +1,87 @@
+#include "QualityGovernor.h"
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+
+namespace CameraMarkerServer {
+
+// static
+std::vector<QualityLevel> QualityGovernor::DefaultLevels() {
+  std::vector<QualityLevel> levels(6);
+  levels[1].refine_corners = false;
+  levels[2].refine_corners = false;
+  levels[2].downscale = 0.75;
+  levels[3].refine_corners = false;
+  levels[3].downscale = 0.5;
+  levels[3].use_tiling = false;  // Tiles are not worth it on a small frame
+  levels[4] = levels[3];
+  levels[4].detection_cadence = 2;
+  levels[5] = levels[3];
+  levels[5].detection_cadence = 3;
+  return levels;
+}
+
+QualityGovernor::QualityGovernor(const std::string& name,
+                                 const GovernorOptions& options)
+    : name_(name), options_(options), levels_(DefaultLevels()) {
+  level_entries_.assign(levels_.size(), 0);
+  level_entries_[0] = 1;
+}
+
+bool QualityGovernor::RecordFrame(
+    std::chrono::steady_clock::duration processing_time) {
+  const double processing_ms =
+      std::chrono::duration<double, std::milli>(processing_time).count() /
+      levels_[level_].detection_cadence;
+  const double target_ms =
+      std::chrono::duration<double, std::milli>(options_.latency_target)
+          .count();
+  if (processing_ms > target_ms) {
+    slow_frames_++;
+    fast_frames_ = 0;
+  } else if (processing_ms < target_ms * options_.headroom) {
+    fast_frames_++;
+    slow_frames_ = 0;
+  } else {
+    slow_frames_ = 0;
+    fast_frames_ = 0;
+  }
+
+  if (slow_frames_ >= options_.step_down_frames &&
+      level_ + 1 < (int)levels_.size()) {
+    ChangeLevel(level_ + 1, processing_ms);
+    return true;
+  }
+  if (fast_frames_ >= options_.step_up_frames && level_ > 0) {
+    ChangeLevel(level_ - 1, processing_ms);
+    return true;
+  }
+  return false;
+}
+
+void QualityGovernor::ChangeLevel(int new_level, double processing_ms) {
+  // Every camera's detect thread logs, localtime's shared buffer would race
+  std::time_t now = std::time(nullptr);
+  std::tm local_time = {};
+#ifdef _WIN32
+  localtime_s(&local_time, &now);
+#else
+  localtime_r(&now, &local_time);
+#endif
+  const QualityLevel& level = levels_[new_level];
+  transition_count_++;
+  level_entries_[new_level]++;
+  std::cout << std::put_time(&local_time, "%Y-%m-%d %H:%M:%S") << " ["
+            << name_ << "] transition " << transition_count_
+            << ": quality level " << level_ << " -> " << new_level
+            << ", entered " << level_entries_[new_level]
+            << " times (processing " << processing_ms << " ms, scale "
+            << level.downscale << ", tiling " << level.use_tiling
+            << ", refine " << level.refine_corners << ", cadence "
+            << level.detection_cadence << ")" << std::endl;
+  level_ = new_level;
+  slow_frames_ = 0;
+  fast_frames_ = 0;
+}
+
+}  // namespace CameraMarkerServer
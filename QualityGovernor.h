@@ -0,0 +1,58 @@
+#ifndef QUALITY_GOVERNOR_H_
+#define QUALITY_GOVERNOR_H_
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace CameraMarkerServer {
+// One step of the quality ladder. Level 0 is the configured full quality;
+// every later level gives up some accuracy for speed.
+struct QualityLevel {
+  double downscale = 1.0;     // Scale applied to the frame before detection
+  bool use_tiling = true;     // Keep the configured tile grid
+  bool refine_corners = true; // Keep the configured corner refinement
+  int detection_cadence = 1;  // Run detection on every Nth frame
+};
+
+struct GovernorOptions {
+  std::chrono::microseconds latency_target{16667};
+  int step_down_frames = 5;   // Consecutive slow frames before degrading
+  int step_up_frames = 60;    // Consecutive fast frames before recovering
+  double headroom = 0.6;      // Fast means below headroom * latency_target
+};
+
+// Closed loop controller that walks the quality ladder based on measured
+// processing time per captured frame. The asymmetric step counts and the gap
+// between the degrade and recover thresholds give it hysteresis, so it
+// settles instead of oscillating between two levels.
+class QualityGovernor {
+ public:
+  QualityGovernor(const std::string& name, const GovernorOptions& options);
+
+  // Records the processing time of one detection. It is spread over the
+  // detection_cadence frames of the current level, so skipping frames shows
+  // up as the saving it is. Returns true when this changed the current level.
+  bool RecordFrame(std::chrono::steady_clock::duration processing_time);
+
+  const QualityLevel& current() const { return levels_[level_]; }
+  int level() const { return level_; }
+
+  static std::vector<QualityLevel> DefaultLevels();
+
+ private:
+  void ChangeLevel(int new_level, double processing_ms);
+
+  std::string name_;
+  GovernorOptions options_;
+  std::vector<QualityLevel> levels_;
+  int level_ = 0;
+  int slow_frames_ = 0;
+  int fast_frames_ = 0;
+  // Logged with every transition
+  int64_t transition_count_ = 0;
+  std::vector<int64_t> level_entries_;  // How often each level was entered
+};
+
+}  // namespace CameraMarkerServer
+#endif  // QUALITY_GOVERNOR_H_
@@ -0,0 +1,252 @@
+#include "RawFrameRecording.h"
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CameraMarkerServer {
+namespace {
+const uint32_t RAW_RECORDING_VERSION = 1;
+
+bool IsContinuousFrame(const cv::Mat& image) {
+  return !image.empty() && image.isContinuous();
+}
+}  // namespace
+
+#ifdef _WIN32
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    CloseHandle(file);
+    return false;
+  }
+  HANDLE mapping =
+      CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    CloseHandle(file);
+    return false;
+  }
+  void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  if (view == nullptr) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    return false;
+  }
+  file_handle_ = file;
+  mapping_handle_ = mapping;
+  data_ = static_cast<uint8_t*>(view);
+  size_ = static_cast<size_t>(file_size.QuadPart);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) {
+    UnmapViewOfFile(data_);
+  }
+  if (mapping_handle_ != nullptr) {
+    CloseHandle(mapping_handle_);
+  }
+  if (file_handle_ != nullptr) {
+    CloseHandle(file_handle_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  mapping_handle_ = nullptr;
+  file_handle_ = nullptr;
+}
+#else
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    ::close(fd);
+    return false;
+  }
+  void* view = mmap(nullptr, static_cast<size_t>(file_stat.st_size),
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (view == MAP_FAILED) {
+    ::close(fd);
+    return false;
+  }
+  madvise(view, static_cast<size_t>(file_stat.st_size), MADV_SEQUENTIAL);
+  fd_ = fd;
+  data_ = static_cast<uint8_t*>(view);
+  size_ = static_cast<size_t>(file_stat.st_size);
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) {
+    munmap(data_, size_);
+  }
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  data_ = nullptr;
+  size_ = 0;
+  fd_ = -1;
+}
+#endif
+
+bool RawRecordingFrameSource::Open() {
+  Close();
+  if (!file_.Open(path_)) {
+    std::cout << "Could not map raw recording: \"" << path_ << "\""
+              << std::endl;
+    return false;
+  }
+  if (file_.size() < sizeof(RawRecordingHeader)) {
+    std::cout << "Raw recording is truncated: \"" << path_ << "\""
+              << std::endl;
+    file_.Close();
+    return false;
+  }
+  std::memcpy(&header_, file_.data(), sizeof(header_));
+  const uint64_t index_bytes =
+      header_.frame_count * sizeof(RawRecordingIndexEntry);
+  if (std::memcmp(header_.magic, RAW_RECORDING_MAGIC,
+                  sizeof(RAW_RECORDING_MAGIC)) != 0 ||
+      header_.version != RAW_RECORDING_VERSION || header_.index_offset == 0 ||
+      header_.index_offset + index_bytes > file_.size()) {
+    std::cout << "Invalid or unfinished raw recording: \"" << path_ << "\""
+              << std::endl;
+    file_.Close();
+    return false;
+  }
+  index_.resize(header_.frame_count);
+  std::memcpy(index_.data(), file_.data() + header_.index_offset, index_bytes);
+  for (const RawRecordingIndexEntry& entry : index_) {
+    if (entry.offset + header_.frame_bytes > header_.index_offset) {
+      std::cout << "Corrupt raw recording index: \"" << path_ << "\""
+                << std::endl;
+      file_.Close();
+      index_.clear();
+      return false;
+    }
+  }
+  next_frame_ = 0;
+  is_opened_ = true;
+  return true;
+}
+
+bool RawRecordingFrameSource::Read(Frame& frame) {
+  if (!is_opened_ || next_frame_ >= index_.size()) {
+    return false;
+  }
+  const RawRecordingIndexEntry& entry = index_[next_frame_];
+  if (replay_mode_ == REAL_TIME) {
+    if (next_frame_ == 0) {
+      replay_start_ = std::chrono::steady_clock::now();
+    } else {
+      std::this_thread::sleep_until(
+          replay_start_ +
+          std::chrono::microseconds(entry.timestamp_us - index_[0].timestamp_us));
+    }
+  }
+  // The frame points straight into the mapping; there is nothing to decode.
+  frame.image = cv::Mat(header_.height, header_.width, header_.type,
+                        const_cast<uint8_t*>(file_.data() + entry.offset));
+  frame.timestamp_us = entry.timestamp_us;
+  frame.index = static_cast<int64_t>(next_frame_);
+  next_frame_++;
+  return true;
+}
+
+bool RawRecordingFrameSource::Seek(int64_t frame_index) {
+  if (!is_opened_ || frame_index < 0 || frame_index > frame_count()) {
+    return false;
+  }
+  next_frame_ = static_cast<size_t>(frame_index);
+  return true;
+}
+
+void RawRecordingFrameSource::Close() {
+  file_.Close();
+  index_.clear();
+  is_opened_ = false;
+}
+
+bool RawFrameRecorder::Open(const std::string& path) {
+  Close();
+  out_.open(path, std::ios::binary | std::ios::trunc);
+  if (!out_.is_open()) {
+    std::cout << "Could not open raw recording for writing: \"" << path
+              << "\"" << std::endl;
+    return false;
+  }
+  header_ = {};
+  std::memcpy(header_.magic, RAW_RECORDING_MAGIC, sizeof(RAW_RECORDING_MAGIC));
+  header_.version = RAW_RECORDING_VERSION;
+  index_.clear();
+  // The header is rewritten with the final counts on Close.
+  out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  write_offset_ = sizeof(header_);
+  return out_.good();
+}
+
+bool RawFrameRecorder::Write(const Frame& frame) {
+  if (!out_.is_open() || frame.image.empty()) {
+    return false;
+  }
+  const cv::Mat& image = frame.image;
+  const uint64_t frame_bytes = image.total() * image.elemSize();
+  if (index_.empty()) {
+    header_.width = image.cols;
+    header_.height = image.rows;
+    header_.type = image.type();
+    header_.frame_bytes = frame_bytes;
+  } else if (image.cols != header_.width || image.rows != header_.height ||
+             image.type() != header_.type) {
+    return false;
+  }
+  if (IsContinuousFrame(image)) {
+    out_.write(reinterpret_cast<const char*>(image.data), frame_bytes);
+  } else {
+    const size_t row_bytes = image.cols * image.elemSize();
+    for (int row = 0; row < image.rows; row++) {
+      out_.write(reinterpret_cast<const char*>(image.ptr(row)), row_bytes);
+    }
+  }
+  index_.push_back({frame.timestamp_us, write_offset_});
+  write_offset_ += frame_bytes;
+  return out_.good();
+}
+
+bool RawFrameRecorder::Close() {
+  if (!out_.is_open()) {
+    return false;
+  }
+  header_.frame_count = index_.size();
+  header_.index_offset = write_offset_;
+  out_.write(reinterpret_cast<const char*>(index_.data()),
+             index_.size() * sizeof(RawRecordingIndexEntry));
+  out_.seekp(0);
+  out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  bool ok = out_.good();
+  out_.close();
+  index_.clear();
+  return ok;
+}
+
+}  // namespace CameraMarkerServer
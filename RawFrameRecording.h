@@ -0,0 +1,124 @@
+#ifndef RAW_FRAME_RECORDING_H_
+#define RAW_FRAME_RECORDING_H_
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "FrameSource.h"
+
+// Raw frame recordings (*.vgraw) store uncompressed frames back to back so
+// that a replay is a pointer into a memory mapped file with no decode step.
+//
+// Layout:
+//   RawRecordingHeader
+//   frame 0 pixels, frame 1 pixels, ...   (frame_bytes each, rows packed)
+//   RawRecordingIndexEntry[frame_count]   (at index_offset)
+//
+// The index is written when the recorder is closed, so a recording that was
+// not closed cleanly cannot be replayed.
+namespace CameraMarkerServer {
+
+const char RAW_RECORDING_MAGIC[8] = {'V', 'G', 'R', 'A', 'W', 'F', 'R', '1'};
+const std::string RAW_RECORDING_EXTENSION = ".vgraw";
+
+#pragma pack(push, 1)
+struct RawRecordingHeader {
+  char magic[8];
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t type;  // OpenCV matrix type, e.g. CV_8UC3
+  uint64_t frame_bytes;
+  uint64_t frame_count;
+  uint64_t index_offset;
+};
+
+struct RawRecordingIndexEntry {
+  int64_t timestamp_us;
+  uint64_t offset;
+};
+#pragma pack(pop)
+
+// Read only memory mapping of a whole file. Pages are mapped copy-on-write,
+// so callers may draw into frames that point into the mapping.
+class MappedFile {
+ public:
+  MappedFile() {}
+  ~MappedFile() { Close(); }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool Open(const std::string& path);
+  void Close();
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  void* file_handle_ = nullptr;
+  void* mapping_handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+class RawRecordingFrameSource : public FrameSource {
+ public:
+  enum ReplayMode {
+    REAL_TIME,  // Frames are released at the pace they were recorded at
+    MAX_SPEED   // Frames are released as fast as they are read
+  };
+  RawRecordingFrameSource(const std::string& path, ReplayMode replay_mode)
+      : path_(path), replay_mode_(replay_mode) {}
+  bool Open() override;
+  bool IsOpened() const override { return is_opened_; }
+  bool Read(Frame& frame) override;
+  bool IsLive() const override { return false; }
+  cv::Size FrameSize() const override {
+    return cv::Size(header_.width, header_.height);
+  }
+  void Close() override;
+
+  int64_t frame_count() const { return static_cast<int64_t>(index_.size()); }
+  // Positions the source so that the next Read returns frame frame_index.
+  bool Seek(int64_t frame_index);
+
+ private:
+  std::string path_;
+  ReplayMode replay_mode_;
+  MappedFile file_;
+  RawRecordingHeader header_ = {};
+  std::vector<RawRecordingIndexEntry> index_;
+  size_t next_frame_ = 0;
+  bool is_opened_ = false;
+  std::chrono::steady_clock::time_point replay_start_;
+};
+
+// Appends frames to a raw recording. All frames must share the size and
+// type of the first one; mismatching frames are dropped.
+class RawFrameRecorder {
+ public:
+  RawFrameRecorder() {}
+  ~RawFrameRecorder() { Close(); }
+  RawFrameRecorder(const RawFrameRecorder&) = delete;
+  RawFrameRecorder& operator=(const RawFrameRecorder&) = delete;
+
+  bool Open(const std::string& path);
+  bool Write(const Frame& frame);
+  // Writes the index and finalizes the header.
+  bool Close();
+  bool IsOpened() const { return out_.is_open(); }
+
+ private:
+  std::ofstream out_;
+  RawRecordingHeader header_ = {};
+  std::vector<RawRecordingIndexEntry> index_;
+  uint64_t write_offset_ = 0;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // RAW_FRAME_RECORDING_H_
@@ -0,0 +1,128 @@
+#include "RigidObject.h"
+#include <iostream>
+#include <set>
+#include <opencv2/calib3d.hpp>
+#include "PoseFilter.h"
+
+namespace CameraMarkerServer {
+namespace {
+bool ReadVec3(const cv::FileNode& node, cv::Vec3d& value) {
+  std::vector<double> values;
+  node >> values;
+  if (values.size() != 3) {
+    return false;
+  }
+  value = cv::Vec3d(values[0], values[1], values[2]);
+  return true;
+}
+
+std::vector<double> ToVector(const cv::Vec3d& value) {
+  return std::vector<double>(value.val, value.val + 3);
+}
+}  // namespace
+
+std::vector<cv::Point3f> ObjectMarkerCorners(const ObjectMarker& marker,
+                                             float marker_length) {
+  // Same layout as the single marker solve in PoseDetector
+  const float half = marker_length / 2.f;
+  const cv::Vec3d local[4] = {
+      cv::Vec3d(-half, half, 0), cv::Vec3d(half, half, 0),
+      cv::Vec3d(half, -half, 0), cv::Vec3d(-half, -half, 0)};
+  cv::Matx33d rotation;
+  cv::Rodrigues(marker.rotation, rotation);
+  std::vector<cv::Point3f> corners;
+  for (const cv::Vec3d& corner : local) {
+    const cv::Vec3d p = rotation * corner + marker.center;
+    corners.push_back(cv::Point3f((float)p[0], (float)p[1], (float)p[2]));
+  }
+  return corners;
+}
+
+bool ReadRigidObjects(const cv::FileNode& node,
+                      std::vector<RigidObject>& objects) {
+  objects.clear();
+  if (node.empty()) {
+    return true;
+  }
+  bool good = true;
+  std::set<int> object_ids;
+  std::set<int> marker_ids;
+  for (const cv::FileNode& object_node : node) {
+    RigidObject object;
+    object_node["Name"] >> object.name;
+    object_node["Id"] >> object.id;
+    if (object.id < 0 || !object_ids.insert(object.id).second) {
+      std::cerr << "Invalid or duplicate id " << object.id << " of object \""
+                << object.name << "\"" << std::endl;
+      good = false;
+    } else if (object.id >= PoseFilter::MAX_MARKER_ID) {
+      // Larger ids would pass the pose filter unfiltered
+      std::cerr << "Id " << object.id << " of object \"" << object.name
+                << "\" must be below " << PoseFilter::MAX_MARKER_ID
+                << std::endl;
+      good = false;
+    }
+    for (const cv::FileNode& marker_node : object_node["Markers"]) {
+      ObjectMarker marker;
+      marker_node["Id"] >> marker.id;
+      if (!ReadVec3(marker_node["Center"], marker.center) ||
+          (!marker_node["Rotation"].empty() &&
+           !ReadVec3(marker_node["Rotation"], marker.rotation))) {
+        std::cerr << "Marker " << marker.id << " of object \"" << object.name
+                  << "\" needs a Center and Rotation of three values"
+                  << std::endl;
+        good = false;
+      }
+      if (marker.id < 0 || !marker_ids.insert(marker.id).second) {
+        std::cerr << "Marker " << marker.id << " of object \"" << object.name
+                  << "\" is invalid or already used by another object"
+                  << std::endl;
+        good = false;
+      }
+      object.markers.push_back(marker);
+    }
+    if (object.markers.empty()) {
+      std::cerr << "Object \"" << object.name << "\" has no markers"
+                << std::endl;
+      good = false;
+    }
+    objects.push_back(object);
+  }
+  return good;
+}
+
+bool CheckObjectIds(const std::vector<RigidObject>& objects,
+                    int dictionary_size) {
+  std::set<int> member_ids;
+  for (const RigidObject& object : objects) {
+    for (const ObjectMarker& marker : object.markers) {
+      member_ids.insert(marker.id);
+    }
+  }
+  bool good = true;
+  for (const RigidObject& object : objects) {
+    if (object.id < dictionary_size && member_ids.count(object.id) == 0) {
+      std::cerr << "Id " << object.id << " of object \"" << object.name
+                << "\" is also the id of a standalone marker" << std::endl;
+      good = false;
+    }
+  }
+  return good;
+}
+
+void WriteRigidObjects(cv::FileStorage& fs,
+                       const std::vector<RigidObject>& objects) {
+  fs << "Objects" << "[";
+  for (const RigidObject& object : objects) {
+    fs << "{" << "Name" << object.name << "Id" << object.id << "Markers"
+       << "[";
+    for (const ObjectMarker& marker : object.markers) {
+      fs << "{" << "Id" << marker.id << "Center" << ToVector(marker.center)
+         << "Rotation" << ToVector(marker.rotation) << "}";
+    }
+    fs << "]" << "}";
+  }
+  fs << "]";
+}
+
+}  // namespace CameraMarkerServer
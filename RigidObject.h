@@ -0,0 +1,44 @@
+#ifndef RIGID_OBJECT_H_
+#define RIGID_OBJECT_H_
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+namespace CameraMarkerServer {
+// Placement of one marker on a rigid object.
+struct ObjectMarker {
+  int id = -1;
+  cv::Vec3d center;    // Marker center in the object frame
+  cv::Vec3d rotation;  // Rodrigues rotation from marker to object frame
+};
+
+// A prop carrying several markers, tracked as one pose from a single PnP
+// solve over the corners of all its visible markers.
+struct RigidObject {
+  std::string name;
+  int id = -1;  // Sent in place of a marker id
+  std::vector<ObjectMarker> markers;
+};
+
+// Corners of a marker of the given side length in the object frame, in
+// ArUco corner order: top left, top right, bottom right, bottom left.
+std::vector<cv::Point3f> ObjectMarkerCorners(const ObjectMarker& marker,
+                                             float marker_length);
+
+// Reads the Objects list of the settings. Every entry has a Name, an Id and
+// Markers, each with an Id, a Center [x, y, z] and optionally a Rotation
+// [rx, ry, rz]. Malformed entries, duplicate object ids, object ids the pose
+// filter has no state for and markers shared by two objects are reported to
+// std::cerr and make this return false.
+bool ReadRigidObjects(const cv::FileNode& node,
+                      std::vector<RigidObject>& objects);
+// Reports objects whose id is also the id of a standalone marker, one of
+// the dictionary_size markers that is not on an object. Both would be sent
+// under the same id. Returns false if there is one.
+bool CheckObjectIds(const std::vector<RigidObject>& objects,
+                    int dictionary_size);
+void WriteRigidObjects(cv::FileStorage& fs,
+                       const std::vector<RigidObject>& objects);
+
+}  // namespace CameraMarkerServer
+#endif  // RIGID_OBJECT_H_
@@ -0,0 +1,321 @@
+#include "SelfTests.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "CameraPipeline.h"
+#include "FrameSource.h"
+#include "MarkerDetector.h"
+
+namespace CameraMarkerServer {
+namespace {
+const cv::Size TEST_FRAME_SIZE(1280, 720);
+const int TEST_MARKER_PIXELS = 60;
+const int TEST_QUIET_ZONE = 10;
+// Covers a rotated marker and its quiet zone centered on a seam
+const int TEST_TILE_OVERLAP = 72;
+// Tiles see a different neighbourhood at their edges than a full frame pass,
+// refined corners may move by a fraction of a pixel
+const float MAX_CORNER_DIFFERENCE = 0.5f;
+
+struct TestMarker {
+  int id;
+  cv::Point2f center;
+};
+
+// Centers on every seam between two tiles, every seam crossing and every
+// tile interior, following MarkerDetector's tile split.
+std::vector<TestMarker> SeamMarkers(const TilingOptions& tiling,
+                                    const cv::Size& size) {
+  std::vector<float> xs;  // Tile centers and seams, alternating
+  std::vector<float> ys;
+  for (int tx = 0; tx < tiling.tiles_x; tx++) {
+    const float x0 = (float)(size.width * tx / tiling.tiles_x);
+    const float x1 = (float)(size.width * (tx + 1) / tiling.tiles_x);
+    if (tx > 0) xs.push_back(x0);
+    xs.push_back((x0 + x1) / 2);
+  }
+  for (int ty = 0; ty < tiling.tiles_y; ty++) {
+    const float y0 = (float)(size.height * ty / tiling.tiles_y);
+    const float y1 = (float)(size.height * (ty + 1) / tiling.tiles_y);
+    if (ty > 0) ys.push_back(y0);
+    ys.push_back((y0 + y1) / 2);
+  }
+  std::vector<TestMarker> markers;
+  for (float y : ys) {
+    for (float x : xs) {
+      markers.push_back({(int)markers.size(), cv::Point2f(x, y)});
+    }
+  }
+  return markers;
+}
+
+cv::Mat RenderMarkers(const cv::aruco::Dictionary& dictionary,
+                      const std::vector<TestMarker>& markers,
+                      const cv::Size& size) {
+  cv::Mat frame(size, CV_8UC1);
+  for (int y = 0; y < frame.rows; y++) {
+    frame.row(y).setTo(cv::Scalar(60 + 120 * y / frame.rows));
+  }
+  for (const TestMarker& marker : markers) {
+    cv::Mat image;
+    cv::aruco::generateImageMarker(dictionary, marker.id, TEST_MARKER_PIXELS,
+                                   image, 1);
+    cv::copyMakeBorder(image, image, TEST_QUIET_ZONE, TEST_QUIET_ZONE,
+                       TEST_QUIET_ZONE, TEST_QUIET_ZONE, cv::BORDER_CONSTANT,
+                       cv::Scalar(255));
+    const float side = (float)image.cols;
+    const std::vector<cv::Point2f> source_quad = {
+        cv::Point2f(0, 0), cv::Point2f(side, 0), cv::Point2f(side, side),
+        cv::Point2f(0, side)};
+    // Turned so that no corner lines up with a seam
+    const float angle = 0.3f + 0.37f * marker.id;
+    std::vector<cv::Point2f> quad(4);
+    for (int c = 0; c < 4; c++) {
+      const float corner_angle = angle + (float)CV_PI / 4 + c * (float)CV_PI / 2;
+      quad[c] = marker.center + side * std::sqrt(0.5f) *
+                                    cv::Point2f(std::cos(corner_angle),
+                                                std::sin(corner_angle));
+    }
+    cv::warpPerspective(image, frame,
+                        cv::getPerspectiveTransform(source_quad, quad),
+                        frame.size(), cv::INTER_LINEAR,
+                        cv::BORDER_TRANSPARENT);
+  }
+  cv::GaussianBlur(frame, frame, cv::Size(3, 3), 0.8);
+  return frame;
+}
+
+const cv::Size WATCHDOG_FRAME_SIZE(320, 240);
+const std::chrono::milliseconds WATCHDOG_FRAME_INTERVAL(10);
+const int WATCHDOG_STALL_MS = 200;
+const int WATCHDOG_REOPEN_INTERVAL_MS = 300;
+const int64_t WATCHDOG_FRAMES_BEFORE_FAULT = 30;
+// Longer than the stall timeout plus the time a reopen waits for the
+// blocked capture thread to let go
+const std::chrono::milliseconds WATCHDOG_BLOCK_DURATION(1500);
+const std::chrono::milliseconds WATCHDOG_TEST_DURATION(3000);
+const std::chrono::milliseconds WATCHDOG_POLL_INTERVAL(5);
+// Results taken after tracking came back before capture counts as restarted
+const int MIN_FRAMES_AFTER_RECOVERY = 10;
+
+// A camera stand-in: blank frames at a fixed rate, reported as live.
+class SyntheticLiveSource : public FrameSource {
+ public:
+  bool Open() override {
+    opened_ = true;
+    next_index_ = 0;
+    start_time_ = std::chrono::steady_clock::now();
+    return true;
+  }
+  bool IsOpened() const override { return opened_; }
+  bool Read(Frame& frame) override {
+    if (!opened_) {
+      return false;
+    }
+    std::this_thread::sleep_for(WATCHDOG_FRAME_INTERVAL);
+    // Fills a pooled buffer in place when one is offered
+    frame.image.create(WATCHDOG_FRAME_SIZE, CV_8UC1);
+    frame.image.setTo(cv::Scalar(128));
+    frame.timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - start_time_)
+                             .count();
+    frame.index = next_index_++;
+    return true;
+  }
+  bool IsLive() const override { return true; }
+  cv::Size FrameSize() const override { return WATCHDOG_FRAME_SIZE; }
+  void Close() override { opened_ = false; }
+
+ private:
+  std::atomic<bool> opened_{false};
+  int64_t next_index_ = 0;
+  std::chrono::steady_clock::time_point start_time_;
+};
+
+// Only what a camera pipeline reads; nothing is loaded from disk.
+CalibrationSettings WatchdogTestSettings() {
+  CalibrationSettings s;
+  s.cameraName = "selftest";
+  s.inputType = CalibrationSettings::CAMERA;
+  s.recordFileName = "";
+  s.targetFrameRate = 1000.0 / WATCHDOG_FRAME_INTERVAL.count();
+  s.delay = (int)WATCHDOG_FRAME_INTERVAL.count();
+  s.roiFullFrameInterval = 1;
+  s.governorEnabled = false;
+  s.governorTargetMs = 0;
+  s.governorStepDownFrames = 5;
+  s.governorStepUpFrames = 60;
+  s.governorHeadroom = 0.6;
+  s.watchdogStallMs = WATCHDOG_STALL_MS;
+  s.watchdogReopenIntervalMs = WATCHDOG_REOPEN_INTERVAL_MS;
+  s.threadCaptureCpus = "";
+  s.threadDetectCpus = "";
+  s.threadRealtime = false;
+  s.cameraToWorld = cv::Matx44d::eye();
+  s.flightRecorderSeconds = 0;
+  s.flightRecorderScale = 0.5;
+  s.flightRecorderQuality = 90;
+  s.flightRecorderFrameTimeMs = 0;
+  s.flightRecorderMarkerLostMs = 0;
+  s.flightRecorderDirectory = "flight";
+  return s;
+}
+
+std::shared_ptr<const DetectionConfig> WatchdogDetectionConfig() {
+  CameraParameters camera_params;
+  camera_params.insintric_camera_parms =
+      (cv::Mat_<double>(3, 3) << 300, 0, WATCHDOG_FRAME_SIZE.width / 2.0, 0,
+       300, WATCHDOG_FRAME_SIZE.height / 2.0, 0, 0, 1);
+  camera_params.distortion_mat = cv::Mat::zeros(1, 5, CV_64F);
+  camera_params.image_size = WATCHDOG_FRAME_SIZE;
+  auto config = std::make_shared<DetectionConfig>();
+  config->detector = std::make_shared<const PoseDetector>(
+      50.f, cv::aruco::getPredefinedDictionary(cv::aruco::DICT_4X4_250),
+      cv::aruco::DetectorParameters(), camera_params);
+  config->frame_period = WATCHDOG_FRAME_INTERVAL;
+  return config;
+}
+
+// Runs one fault through a pipeline. Returns true if capture recovered.
+bool RunWatchdogFault(const char* name, const FaultOptions& fault) {
+  auto make_source = [&fault]() {
+    return std::shared_ptr<FrameSource>(
+        std::make_shared<FaultInjectingFrameSource>(
+            std::make_unique<SyntheticLiveSource>(), fault));
+  };
+  CalibrationSettings s = WatchdogTestSettings();
+  s.frameSource = make_source();
+  s.frameSource->Open();
+  std::atomic<int> reopens(0);
+  CameraPipeline pipeline(0, s, WatchdogDetectionConfig(), [&]() {
+    reopens++;
+    return make_source();
+  });
+
+  bool saw_lost = false;
+  int frames_before_fault = 0;
+  int frames_after_recovery = 0;
+  CameraResult result;
+  pipeline.Start();
+  const std::chrono::steady_clock::time_point end =
+      std::chrono::steady_clock::now() + WATCHDOG_TEST_DURATION;
+  while (std::chrono::steady_clock::now() < end) {
+    const bool lost = pipeline.IsTrackingLost();
+    saw_lost = saw_lost || lost;
+    while (pipeline.TryTakeResult(result)) {
+      if (!saw_lost) {
+        frames_before_fault++;
+      } else if (!lost) {
+        frames_after_recovery++;
+      }
+    }
+    std::this_thread::sleep_for(WATCHDOG_POLL_INTERVAL);
+  }
+  pipeline.Stop();
+
+  const bool ok = frames_before_fault > 0 && saw_lost && reopens > 0 &&
+                  frames_after_recovery >= MIN_FRAMES_AFTER_RECOVERY;
+  std::cout << (ok ? "  ok    " : "  FAIL  ") << name << ": "
+            << frames_before_fault << " frames before the fault, tracking "
+            << (saw_lost ? "lost" : "never lost") << ", " << reopens
+            << " reopen(s), " << frames_after_recovery
+            << " frames after recovery" << std::endl;
+  return ok;
+}
+
+// Largest distance between matching corners, or a negative value when the
+// ids differ.
+float CornerDifference(const std::vector<std::vector<cv::Point2f>>& corners_a,
+                       const std::vector<int>& ids_a,
+                       const std::vector<std::vector<cv::Point2f>>& corners_b,
+                       const std::vector<int>& ids_b) {
+  if (ids_a != ids_b) {
+    return -1;
+  }
+  float difference = 0;
+  for (size_t i = 0; i < ids_a.size(); i++) {
+    for (size_t c = 0; c < corners_a[i].size(); c++) {
+      difference = std::max(
+          difference, (float)cv::norm(corners_a[i][c] - corners_b[i][c]));
+    }
+  }
+  return difference;
+}
+}  // namespace
+
+int RunTiledDetectionSelfTest() {
+  const cv::aruco::Dictionary dictionary =
+      cv::aruco::getPredefinedDictionary(cv::aruco::DICT_4X4_250);
+  bool passed = true;
+  for (cv::aruco::CornerRefineMethod refinement :
+       {cv::aruco::CORNER_REFINE_NONE, cv::aruco::CORNER_REFINE_SUBPIX}) {
+    cv::aruco::DetectorParameters params;
+    params.cornerRefinementMethod = refinement;
+    const MarkerDetector full_frame(dictionary, params, TilingOptions());
+    for (const cv::Size& grid :
+         {cv::Size(2, 2), cv::Size(3, 2), cv::Size(4, 3)}) {
+      TilingOptions tiling;
+      tiling.tiles_x = grid.width;
+      tiling.tiles_y = grid.height;
+      tiling.overlap = TEST_TILE_OVERLAP;
+      const MarkerDetector tiled(dictionary, params, tiling);
+      const std::vector<TestMarker> markers =
+          SeamMarkers(tiling, TEST_FRAME_SIZE);
+      const cv::Mat frame = RenderMarkers(dictionary, markers, TEST_FRAME_SIZE);
+
+      std::vector<std::vector<cv::Point2f>> full_corners;
+      std::vector<int> full_ids;
+      full_frame.Detect(frame, full_corners, full_ids);
+      std::vector<std::vector<cv::Point2f>> tiled_corners;
+      std::vector<int> tiled_ids;
+      tiled.Detect(frame, tiled_corners, tiled_ids);
+
+      const float difference =
+          CornerDifference(full_corners, full_ids, tiled_corners, tiled_ids);
+      // A full frame pass that misses markers would make the comparison
+      // meaningless
+      const bool ok = full_ids.size() == markers.size() && difference >= 0 &&
+                      difference <= MAX_CORNER_DIFFERENCE;
+      passed = passed && ok;
+      std::cout << (ok ? "  ok    " : "  FAIL  ") << grid.width << "x"
+                << grid.height << " tiles, "
+                << (refinement == cv::aruco::CORNER_REFINE_NONE ? "unrefined"
+                                                                : "subpix")
+                << ": " << markers.size() << " rendered, " << full_ids.size()
+                << " full frame, " << tiled_ids.size() << " tiled";
+      if (difference >= 0) {
+        std::cout << ", max corner difference " << difference << " px";
+      } else {
+        std::cout << ", ids differ";
+      }
+      std::cout << std::endl;
+    }
+  }
+  std::cout << "Tiled detection self-test " << (passed ? "passed" : "failed")
+            << std::endl;
+  return passed ? 0 : 1;
+}
+
+int RunWatchdogSelfTest() {
+  FaultOptions stall;
+  stall.mode = FaultOptions::BLOCK;
+  stall.stall_after_frames = WATCHDOG_FRAMES_BEFORE_FAULT;
+  stall.stall_duration = WATCHDOG_BLOCK_DURATION;
+  FaultOptions disconnect;
+  disconnect.mode = FaultOptions::EMPTY;
+  disconnect.stall_after_frames = WATCHDOG_FRAMES_BEFORE_FAULT;
+  const bool passed = RunWatchdogFault("stall", stall) &&
+                      RunWatchdogFault("disconnect", disconnect);
+  std::cout << "Watchdog self-test " << (passed ? "passed" : "failed")
+            << std::endl;
+  return passed ? 0 : 1;
+}
+
+}  // namespace CameraMarkerServer
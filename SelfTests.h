@@ -0,0 +1,22 @@
+#ifndef SELF_TESTS_H_
+#define SELF_TESTS_H_
+
+// Self-tests run from the command line instead of the server, see Main.cpp.
+// They need no camera or calibration. Each prints what it checked and
+// returns the process exit code, 0 when every check passed.
+namespace CameraMarkerServer {
+
+// Renders synthetic markers on the tile seams, seam crossings and tile
+// interiors of several tile grids, and checks that tiled detection finds the
+// same ids at the same corners as a full frame pass.
+int RunTiledDetectionSelfTest();
+
+// Runs a camera pipeline on a synthetic live source wrapped in a
+// FaultInjectingFrameSource, once with a read that blocks (a stall) and
+// once with reads that fail until reopened (a disconnect). Checks that the
+// watchdog reports tracking lost, reopens the source and that frames flow
+// again afterwards.
+int RunWatchdogSelfTest();
+
+}  // namespace CameraMarkerServer
+#endif  // SELF_TESTS_H_
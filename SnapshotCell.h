@@ -0,0 +1,117 @@
+#ifndef SNAPSHOT_CELL_H_
+#define SNAPSHOT_CELL_H_
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace CameraMarkerServer {
+// Holds the current version of an immutable configuration. Writers publish
+// whole new snapshots, so readers see either the old or the new one and
+// never a mix. Reading takes two atomic loads and two atomic stores, never
+// a lock, which keeps it out of the way of the frame loops.
+//
+// Each reading thread owns a reader slot. While a ReadGuard is alive its
+// slot holds the generation it started in, and snapshots replaced since are
+// kept alive until every slot has moved past them. A guard is meant to be
+// held for one frame at most, so retired snapshots go away within a frame
+// of the next publish.
+template <typename T>
+class SnapshotCell {
+ public:
+  class ReadGuard {
+   public:
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard() { slot_.store(IDLE); }
+
+    const T& operator*() const { return *snapshot_; }
+    const T* operator->() const { return snapshot_; }
+
+   private:
+    friend class SnapshotCell;
+    ReadGuard(std::atomic<uint64_t>& slot, const T* snapshot)
+        : slot_(slot), snapshot_(snapshot) {}
+
+    std::atomic<uint64_t>& slot_;
+    const T* snapshot_;
+  };
+
+  SnapshotCell(std::shared_ptr<const T> initial, int readers)
+      : slots_(new std::atomic<uint64_t>[readers]),
+        readers_(readers),
+        generation_(0),
+        current_(initial.get()),
+        owner_(std::move(initial)) {
+    for (int i = 0; i < readers_; i++) {
+      slots_[i].store(IDLE);
+    }
+  }
+  SnapshotCell(const SnapshotCell&) = delete;
+  SnapshotCell& operator=(const SnapshotCell&) = delete;
+
+  // reader is a slot in [0, readers) that no other thread reads with and
+  // that has no other guard alive.
+  ReadGuard Read(int reader) const {
+    std::atomic<uint64_t>& slot = slots_[reader];
+    // The generation is recorded before the snapshot is loaded; a publish
+    // that bumps it afterwards sees this slot and keeps what we load.
+    slot.store(generation_.load());
+    return ReadGuard(slot, current_.load());
+  }
+
+  // The snapshot readers get now, for writers building the next one.
+  std::shared_ptr<const T> Current() const {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    return owner_;
+  }
+
+  void Publish(std::shared_ptr<const T> snapshot) {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    current_.store(snapshot.get());
+    // Readers that record this generation or a later one load the new
+    // snapshot, so the old one is only needed by slots still below it.
+    const uint64_t generation = generation_.fetch_add(1) + 1;
+    retired_.push_back(std::make_pair(generation, std::move(owner_)));
+    owner_ = std::move(snapshot);
+    ReclaimLocked();
+  }
+
+  // Frees retired snapshots no reader can still hold.
+  void Reclaim() {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    ReclaimLocked();
+  }
+
+ private:
+  static constexpr uint64_t IDLE = std::numeric_limits<uint64_t>::max();
+
+  void ReclaimLocked() {
+    uint64_t oldest = IDLE;
+    for (int i = 0; i < readers_; i++) {
+      oldest = std::min(oldest, slots_[i].load());
+    }
+    retired_.erase(
+        std::remove_if(retired_.begin(), retired_.end(),
+                       [oldest](const std::pair<uint64_t,
+                                                std::shared_ptr<const T>>&
+                                    retired) { return retired.first <= oldest; }),
+        retired_.end());
+  }
+
+  const std::unique_ptr<std::atomic<uint64_t>[]> slots_;
+  const int readers_;
+  std::atomic<uint64_t> generation_;
+  std::atomic<const T*> current_;
+  mutable std::mutex writer_mutex_;
+  std::shared_ptr<const T> owner_;
+  // Replaced snapshots with the generation that replaced them
+  std::vector<std::pair<uint64_t, std::shared_ptr<const T>>> retired_;
+};
+
+}  // namespace CameraMarkerServer
+#endif  // SNAPSHOT_CELL_H_
@@ -0,0 +1,190 @@
+#include "ThreadUtils.h"
+#include <cstdint>
+#include <iostream>
+#include <sstream>
+#include "Tracing.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#endif
+
+namespace CameraMarkerServer {
+namespace {
+#ifndef _WIN32
+// Linux limits thread names to 15 characters plus the terminator
+const size_t MAX_THREAD_NAME_LENGTH = 15;
+#endif
+
+std::string CpuListToString(const std::vector<int>& cpus) {
+  std::ostringstream os;
+  for (size_t i = 0; i < cpus.size(); i++) {
+    os << (i > 0 ? "," : "") << cpus[i];
+  }
+  return os.str();
+}
+
+// Returns an empty string on success, otherwise the reason for the failure.
+std::string SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+#ifdef _WIN32
+  DWORD_PTR mask = 0;
+  for (int cpu : cpus) {
+    if (cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+      return "CPU " + std::to_string(cpu) + " is outside the affinity mask";
+    }
+    mask |= (DWORD_PTR)1 << cpu;
+  }
+  if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+    return "error " + std::to_string(GetLastError());
+  }
+  return "";
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= CPU_SETSIZE) {
+      return "CPU " + std::to_string(cpu) + " is outside the affinity mask";
+    }
+    CPU_SET(cpu, &set);
+  }
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  return error == 0 ? "" : std::strerror(error);
+#else
+  return "not supported on this platform";
+#endif
+}
+
+std::string SetCurrentThreadRealtime() {
+#ifdef _WIN32
+  if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+    return "error " + std::to_string(GetLastError());
+  }
+  return "";
+#else
+  // Just above the default real-time priority, below kernel threads
+  sched_param param = {};
+  param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 9;
+  int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (error == EPERM) {
+    return "insufficient privileges";
+  }
+  return error == 0 ? "" : std::strerror(error);
+#endif
+}
+}  // namespace
+
+std::optional<std::vector<int>> ParseCpuList(const std::string& text) {
+  std::vector<int> cpus;
+  std::stringstream ss(text);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.empty()) {
+      continue;
+    }
+    int first = 0;
+    int last = 0;
+    char dash = 0;
+    std::istringstream is(item);
+    if (!(is >> first) || first < 0) {
+      return std::nullopt;
+    }
+    last = first;
+    if (is >> dash && (dash != '-' || !(is >> last) || last < first)) {
+      return std::nullopt;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+ThreadOptions MakeThreadOptions(const std::string& cpu_list, bool realtime) {
+  ThreadOptions options;
+  options.cpus = ParseCpuList(cpu_list).value_or(std::vector<int>());
+  options.realtime = realtime;
+  return options;
+}
+
+void SetCurrentThreadName(const std::string& name) {
+  SetTraceThreadName(name);
+#ifdef _WIN32
+  std::wstring wide_name(name.begin(), name.end());
+  SetThreadDescription(GetCurrentThread(), wide_name.c_str());
+#elif defined(__APPLE__)
+  pthread_setname_np(name.substr(0, MAX_THREAD_NAME_LENGTH).c_str());
+#else
+  pthread_setname_np(pthread_self(),
+                     name.substr(0, MAX_THREAD_NAME_LENGTH).c_str());
+#endif
+}
+
+void ConfigureCurrentThread(const std::string& name,
+                            const ThreadOptions& options) {
+  SetCurrentThreadName(name);
+  std::ostringstream log;
+  log << "Thread " << name << ": ";
+  if (options.cpus.empty()) {
+    log << "any CPU";
+  } else {
+    std::string error = SetCurrentThreadAffinity(options.cpus);
+    if (error.empty()) {
+      log << "pinned to CPUs " << CpuListToString(options.cpus);
+    } else {
+      log << "could not pin to CPUs " << CpuListToString(options.cpus) << " ("
+          << error << "), running on any CPU";
+    }
+  }
+  if (options.realtime) {
+    std::string error = SetCurrentThreadRealtime();
+    if (error.empty()) {
+      log << ", real-time priority";
+    } else {
+      log << ", no real-time priority (" << error << ")";
+    }
+  }
+  std::cout << log.str() << std::endl;
+}
+
+bool IsCurrentThreadRealtime() {
+#ifdef _WIN32
+  return GetThreadPriority(GetCurrentThread()) ==
+         THREAD_PRIORITY_TIME_CRITICAL;
+#else
+  int policy = SCHED_OTHER;
+  sched_param param = {};
+  if (pthread_getschedparam(pthread_self(), &policy, &param) != 0) {
+    return false;
+  }
+  return policy == SCHED_FIFO || policy == SCHED_RR;
+#endif
+}
+
+std::chrono::nanoseconds CurrentThreadCpuTime() {
+#ifdef _WIN32
+  FILETIME creation, exit, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user)) {
+    return std::chrono::nanoseconds(0);
+  }
+  // FILETIMEs count 100 ns intervals
+  const uint64_t kernel_ticks =
+      ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+  const uint64_t user_ticks =
+      ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+  return std::chrono::nanoseconds((kernel_ticks + user_ticks) * 100);
+#else
+  timespec time = {};
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return std::chrono::seconds(time.tv_sec) +
+         std::chrono::nanoseconds(time.tv_nsec);
+#endif
+}
+
+}  // namespace CameraMarkerServer
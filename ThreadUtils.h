@@ -0,0 +1,41 @@
+#ifndef THREAD_UTILS_H_
+#define THREAD_UTILS_H_
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace CameraMarkerServer {
+// Scheduling of one pipeline stage thread.
+struct ThreadOptions {
+  std::vector<int> cpus;  // CPUs the thread may run on, empty for any
+  bool realtime = false;  // Request a real-time scheduling class
+};
+
+// Parses a CPU list such as "2,3" or "4-7,12". An empty string is an empty
+// list. Returns nullopt for a malformed list.
+std::optional<std::vector<int>> ParseCpuList(const std::string& text);
+
+// Options from a CPU list setting; a malformed list allows any CPU.
+ThreadOptions MakeThreadOptions(const std::string& cpu_list, bool realtime);
+
+// Names the calling thread so it shows up in debuggers, profilers and
+// traces. Names longer than the platform allows are truncated, except in
+// traces.
+void SetCurrentThreadName(const std::string& name);
+
+// Names the calling thread and applies options to it. Whatever cannot be
+// applied, typically real-time priority without the privileges for it, is
+// logged and skipped; the thread then runs with default scheduling.
+void ConfigureCurrentThread(const std::string& name,
+                            const ThreadOptions& options);
+
+// Whether the calling thread runs under a real-time scheduling class, as
+// ConfigureCurrentThread requests.
+bool IsCurrentThreadRealtime();
+
+// CPU time, user and kernel, the calling thread has used so far.
+std::chrono::nanoseconds CurrentThreadCpuTime();
+
+}  // namespace CameraMarkerServer
+#endif  // THREAD_UTILS_H_
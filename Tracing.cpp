@@ -0,0 +1,227 @@
+#include "Tracing.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace CameraMarkerServer {
+namespace {
+// 64k spans of about 32 bytes per recording thread; at 60 frames per
+// second and a handful of spans per frame that is a few minutes
+const uint64_t EVENTS_PER_THREAD = 1 << 16;
+const int TRACE_PROCESS_ID = 1;
+// Rings of exited threads kept for dumps. Retired capture threads come and
+// go with every camera reopen; older rings are freed.
+const size_t MAX_EXITED_THREADS = 8;
+
+// Fields are relaxed atomics so that a dump racing the owning thread reads
+// torn events instead of undefined behaviour; torn ones are then dropped.
+struct TraceEvent {
+  std::atomic<const char*> name{nullptr};
+  std::atomic<int64_t> start_ns{0};
+  std::atomic<int64_t> end_ns{0};
+  std::atomic<int64_t> frame{0};
+};
+
+struct ThreadTrace {
+  int id = 0;
+  std::string name;  // Guarded by registry_mutex
+  std::unique_ptr<TraceEvent[]> events;
+  // Spans started and finished writing. A dump copies below written and
+  // drops what started being overwritten meanwhile.
+  std::atomic<uint64_t> claimed{0};
+  std::atomic<uint64_t> written{0};
+  std::atomic<bool> exited{false};
+};
+
+// Per thread state. Name and frame live here rather than in the trace, so
+// setting them never registers a thread while tracing is off.
+struct CurrentThread {
+  ~CurrentThread() {
+    if (trace) {
+      trace->exited = true;
+    }
+  }
+  std::shared_ptr<ThreadTrace> trace;  // Registered by the first span
+  std::string name;
+  int64_t frame = -1;
+};
+
+struct CopiedEvent {
+  const char* name;
+  int64_t start_ns;
+  int64_t end_ns;
+  int64_t frame;
+};
+
+const std::chrono::steady_clock::time_point trace_epoch =
+    std::chrono::steady_clock::now();
+std::mutex registry_mutex;
+// Traces of the last MAX_EXITED_THREADS exited threads stay here so their
+// spans are dumped
+std::vector<std::shared_ptr<ThreadTrace>> registry;
+int next_thread_id = 1;
+thread_local CurrentThread current_thread;
+
+// Drops the oldest exited traces beyond MAX_EXITED_THREADS. The memory is
+// freed after the lock is released, by the caller dropping the result.
+std::vector<std::shared_ptr<ThreadTrace>> RemoveExitedLocked() {
+  std::vector<std::shared_ptr<ThreadTrace>> removed;
+  size_t exited = 0;
+  for (const std::shared_ptr<ThreadTrace>& trace : registry) {
+    exited += trace->exited ? 1 : 0;
+  }
+  for (size_t i = 0; i < registry.size() && exited > MAX_EXITED_THREADS;) {
+    if (registry[i]->exited) {
+      removed.push_back(std::move(registry[i]));
+      registry.erase(registry.begin() + i);
+      exited--;
+    } else {
+      i++;
+    }
+  }
+  return removed;
+}
+
+ThreadTrace& CurrentThreadTrace() {
+  if (!current_thread.trace) {
+    // The ring is large, it is allocated before taking the lock
+    std::shared_ptr<ThreadTrace> trace = std::make_shared<ThreadTrace>();
+    trace->events.reset(new TraceEvent[EVENTS_PER_THREAD]);
+    std::vector<std::shared_ptr<ThreadTrace>> removed;
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      trace->id = next_thread_id++;
+      trace->name = current_thread.name;
+      registry.push_back(trace);
+      removed = RemoveExitedLocked();
+    }
+    current_thread.trace = std::move(trace);
+  }
+  return *current_thread.trace;
+}
+
+void WriteEscaped(std::ostream& os, const std::string& text) {
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      os << '\\';
+    }
+    os << c;
+  }
+}
+}  // namespace
+
+namespace tracing_internal {
+std::atomic<bool> enabled(false);
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - trace_epoch)
+      .count();
+}
+
+void Record(const char* name, int64_t start_ns, int64_t end_ns) {
+  ThreadTrace& trace = CurrentThreadTrace();
+  const uint64_t index = trace.written.load(std::memory_order_relaxed);
+  trace.claimed.store(index + 1, std::memory_order_relaxed);
+  // Orders the claim before the event writes, for dumps that see them
+  std::atomic_thread_fence(std::memory_order_release);
+  TraceEvent& event = trace.events[index % EVENTS_PER_THREAD];
+  event.name.store(name, std::memory_order_relaxed);
+  event.start_ns.store(start_ns, std::memory_order_relaxed);
+  event.end_ns.store(end_ns, std::memory_order_relaxed);
+  event.frame.store(current_thread.frame, std::memory_order_relaxed);
+  trace.written.store(index + 1, std::memory_order_release);
+}
+}  // namespace tracing_internal
+
+void SetTracingEnabled(bool enabled) { tracing_internal::enabled = enabled; }
+
+bool IsTracingEnabled() { return tracing_internal::enabled; }
+
+void SetTraceFrame(int64_t frame) { current_thread.frame = frame; }
+
+void SetTraceThreadName(const std::string& name) {
+  current_thread.name = name;
+  if (current_thread.trace) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    current_thread.trace->name = name;
+  }
+}
+
+bool WriteChromeTrace(const std::string& file) {
+  std::ofstream out(file);
+  if (!out.is_open()) {
+    std::cout << "Could not write the trace to \"" << file << "\"" << std::endl;
+    return false;
+  }
+  // The file is written without the lock, threads registering meanwhile
+  // are left out. The snapshot keeps the rings of threads exiting meanwhile.
+  std::vector<std::shared_ptr<ThreadTrace>> traces;
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    traces = registry;
+    for (const std::shared_ptr<ThreadTrace>& trace : traces) {
+      names.push_back(trace->name.empty()
+                          ? "thread" + std::to_string(trace->id)
+                          : trace->name);
+    }
+  }
+  // Timestamps are microseconds, kept to the nanosecond
+  out << std::fixed << std::setprecision(3);
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first_event = true;
+  size_t spans = 0;
+  std::vector<CopiedEvent> copied;
+  for (size_t t = 0; t < traces.size(); t++) {
+    const std::shared_ptr<ThreadTrace>& trace = traces[t];
+    out << (first_event ? "" : ",") << "\n{\"ph\":\"M\",\"pid\":"
+        << TRACE_PROCESS_ID << ",\"tid\":" << trace->id
+        << ",\"name\":\"thread_name\",\"args\":{\"name\":\"";
+    WriteEscaped(out, names[t]);
+    out << "\"}}";
+    first_event = false;
+
+    const uint64_t written = trace->written.load(std::memory_order_acquire);
+    const uint64_t begin =
+        written > EVENTS_PER_THREAD ? written - EVENTS_PER_THREAD : 0;
+    copied.clear();
+    for (uint64_t i = begin; i < written; i++) {
+      const TraceEvent& event = trace->events[i % EVENTS_PER_THREAD];
+      copied.push_back(
+          CopiedEvent{event.name.load(std::memory_order_relaxed),
+                      event.start_ns.load(std::memory_order_relaxed),
+                      event.end_ns.load(std::memory_order_relaxed),
+                      event.frame.load(std::memory_order_relaxed)});
+    }
+    // Events the thread began to overwrite while they were copied are torn
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t claimed = trace->claimed.load(std::memory_order_relaxed);
+    const uint64_t valid_begin =
+        claimed > EVENTS_PER_THREAD ? claimed - EVENTS_PER_THREAD : 0;
+    for (uint64_t i = std::max(begin, valid_begin); i < written; i++) {
+      const CopiedEvent& event = copied[i - begin];
+      out << ",\n{\"ph\":\"X\",\"pid\":" << TRACE_PROCESS_ID
+          << ",\"tid\":" << trace->id << ",\"name\":\"" << event.name
+          << "\",\"ts\":" << event.start_ns / 1000.0
+          << ",\"dur\":" << (event.end_ns - event.start_ns) / 1000.0
+          << ",\"args\":{\"frame\":" << event.frame << "}}";
+      spans++;
+    }
+  }
+  out << "\n]}\n";
+  out.close();
+  if (out.fail()) {
+    std::cout << "Could not write the trace to \"" << file << "\"" << std::endl;
+    return false;
+  }
+  std::cout << "Wrote " << spans << " spans to " << file << std::endl;
+  return true;
+}
+
+}  // namespace CameraMarkerServer
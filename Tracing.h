@@ -0,0 +1,78 @@
+#ifndef TRACING_H_
+#define TRACING_H_
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Builds without tracing define TRACING_ENABLED to 0; the trace macros then
+// expand to nothing.
+#ifndef TRACING_ENABLED
+#define TRACING_ENABLED 1
+#endif
+
+namespace CameraMarkerServer {
+// Per frame span tracing. Every thread records its spans into its own
+// fixed size ring buffer, which only that thread writes, so recording takes
+// no lock; the oldest spans are overwritten once the ring is full. The
+// rings are written out as a Chrome trace, which chrome://tracing and
+// ui.perfetto.dev open, to see which stage of which frame stalled.
+//
+// Recording is off until SetTracingEnabled(true). While off a span costs
+// one relaxed atomic load, and threads are not registered: a thread gets
+// its ring with its first recorded span.
+void SetTracingEnabled(bool enabled);
+bool IsTracingEnabled();
+
+// Frame number the calling thread's spans are tagged with from now on.
+void SetTraceFrame(int64_t frame);
+// Name the calling thread's spans are shown under.
+void SetTraceThreadName(const std::string& name);
+
+// Writes the spans still in the rings as Chrome trace event JSON. Threads
+// keep recording while this runs. Returns false if the file cannot be
+// written.
+bool WriteChromeTrace(const std::string& file);
+
+namespace tracing_internal {
+extern std::atomic<bool> enabled;
+int64_t NowNs();
+void Record(const char* name, int64_t start_ns, int64_t end_ns);
+}  // namespace tracing_internal
+
+// Records the time from construction to destruction as a span. name must
+// outlive the trace, in practice a string literal.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+      : name_(tracing_internal::enabled.load(std::memory_order_relaxed)
+                  ? name
+                  : nullptr),
+        start_ns_(name_ ? tracing_internal::NowNs() : 0) {}
+  ~TraceSpan() {
+    if (name_) {
+      tracing_internal::Record(name_, start_ns_, tracing_internal::NowNs());
+    }
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* const name_;
+  const int64_t start_ns_;
+};
+
+}  // namespace CameraMarkerServer
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#if TRACING_ENABLED
+// Traces the rest of the enclosing scope as a span called name.
+#define TRACE_SPAN(name) \
+  ::CameraMarkerServer::TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_FRAME(frame) ::CameraMarkerServer::SetTraceFrame(frame)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_FRAME(frame) ((void)0)
+#endif
+
+#endif  // TRACING_H_
@@ -5,14 +5,18 @@ namespace CameraMarkerServer {
 using ::asio::ip::udp;
 
 bool UDPClient::OpenConnection(const std::string& host, const std::string& port) {
+  std::optional<udp::endpoint> endpoint =
+      ResolveEndpoint(io_service_, host, port);
+  return endpoint.has_value() && OpenConnection(endpoint.value());
+}
+bool UDPClient::OpenConnection(const udp::endpoint& endpoint) {
   if (is_connected_) {
     return false;
   }
   socket_ = udp::socket(io_service_, udp::endpoint(udp::v4(), 0));
-  udp::resolver resolver(io_service_);
-  udp::resolver::query query(udp::v4(), host, port);
-  endpoint_ = *resolver.resolve(query);
+  endpoint_ = endpoint;
   is_connected_ = true;
+  return true;
 }
 bool UDPClient::CloseConnection() {
   if (!is_connected_) {
@@ -26,4 +30,16 @@ bool UDPClient::Send(const std::string& msg) {
   size_t bytes_sent = socket_.send_to(asio::buffer(msg, msg.size()), endpoint_);
   return bytes_sent > 0;
 }
+std::optional<udp::endpoint> ResolveEndpoint(asio::io_service& io_service,
+                                             const std::string& host,
+                                             const std::string& port) {
+  udp::resolver resolver(io_service);
+  udp::resolver::query query(udp::v4(), host, port);
+  asio::error_code error;
+  udp::resolver::iterator it = resolver.resolve(query, error);
+  if (error || it == udp::resolver::iterator()) {
+    return std::nullopt;
+  }
+  return it->endpoint();
+}
 }  // namespace CameraMarkerServer
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <asio/ip/udp.hpp>
 #include <asio/io_service.hpp>
 #include <memory>
+#include <optional>
+#include <string>
 
 namespace CameraMarkerServer {
 
@@ -17,6 +19,7 @@ class UDPClient {
         socket_(io_service_, udp::endpoint(udp::v4(), 0)) {}
 
   bool OpenConnection(const std::string& host, const std::string& port);
+  bool OpenConnection(const udp::endpoint& endpoint);
 
   bool CloseConnection();
 
@@ -31,5 +34,10 @@ class UDPClient {
   udp::endpoint endpoint_;
 };
 
+// Resolves an IPv4 host and port, nullopt if it cannot be resolved.
+std::optional<udp::endpoint> ResolveEndpoint(asio::io_service& io_service,
+                                             const std::string& host,
+                                             const std::string& port);
+
 }
 #endif // UDP_SERVER_
\ No newline at end of file